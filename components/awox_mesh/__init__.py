@@ -1,16 +1,104 @@
+import logging
+import re
+
 import esphome.codegen as cg
 import esphome.config_validation as cv
 from esphome.components import esp32_ble_tracker, esp32_ble_client
 
-from esphome.const import CONF_ID
+from esphome.const import (
+    CONF_ID,
+    CONF_INTERVAL,
+    CONF_FORMAT,
+    CONF_TIMEOUT,
+    CONF_MQTT,
+    CONF_SIZE,
+    CONF_TOPIC,
+    CONF_MODE,
+)
+from esphome.core import CORE
 
 AUTO_LOAD = ["esp32_ble_client", "esp32_ble_tracker"]
 DEPENDENCIES = ["mqtt", "esp32"]
 
+_LOGGER = logging.getLogger(__name__)
+
 awox_ns = cg.esphome_ns.namespace("awox_mesh")
 
 Awox = awox_ns.class_("AwoxMesh", esp32_ble_tracker.ESPBTDeviceListener, cg.Component)
 MeshDevice = awox_ns.class_("MeshDevice", esp32_ble_client.BLEClientBase)
+SnapshotFormat = awox_ns.enum("SnapshotFormat")
+ScanMode = awox_ns.enum("ScanMode")
+TransitionSupport = awox_ns.enum("TransitionSupport")
+AdmissionPolicy = awox_ns.enum("AdmissionPolicy")
+
+SNAPSHOT_FORMATS = {
+    "json": SnapshotFormat.SNAPSHOT_FORMAT_JSON,
+    "binary": SnapshotFormat.SNAPSHOT_FORMAT_BINARY,
+}
+
+SCAN_MODES = {
+    "full": ScanMode.SCAN_MODE_FULL,
+    "low_duty": ScanMode.SCAN_MODE_LOW_DUTY,
+    "pause": ScanMode.SCAN_MODE_PAUSED,
+}
+
+TRANSITION_MODES = {
+    "auto": TransitionSupport.TRANSITION_AUTO,
+    "native": TransitionSupport.TRANSITION_NATIVE,
+    "hub": TransitionSupport.TRANSITION_HUB,
+}
+
+ADMISSION_POLICIES = {
+    "drop_oldest": AdmissionPolicy.ADMISSION_DROP_OLDEST,
+    "reject": AdmissionPolicy.ADMISSION_REJECT,
+    "reconcile": AdmissionPolicy.ADMISSION_RECONCILE,
+}
+
+CONF_AWOX_MESH_ID = "awox_mesh_id"
+CONF_MESH_NAME = "mesh_name"
+CONF_MESH_PASSWORD = "mesh_password"
+CONF_CONNECTION = "connection"
+CONF_MESHES = "meshes"
+CONF_MQTT_NAMESPACE = "mqtt_namespace"
+CONF_STATE_SNAPSHOT = "state_snapshot"
+CONF_DELTAS = "deltas"
+CONF_SCAN_POLICY = "scan_policy"
+CONF_SEARCHING_WINDOW = "searching_window"
+CONF_CONNECTED_WINDOW = "connected_window"
+CONF_CONNECTED = "connected"
+CONF_CONNECTION_PARAMETERS = "connection_parameters"
+CONF_HANDOVER = "handover"
+CONF_PROTOCOL_TASK = "protocol_task"
+CONF_RSSI_THRESHOLD = "rssi_threshold"
+CONF_RSSI_MARGIN = "rssi_margin"
+CONF_MIN_INTERVAL = "min_interval"
+CONF_METRICS = "metrics"
+CONF_PACKET_TRACE = "packet_trace"
+CONF_PROFILING = "profiling"
+CONF_CLUSTER = "cluster"
+CONF_HUB_ID = "hub_id"
+CONF_HEARTBEAT_INTERVAL = "heartbeat_interval"
+CONF_FAST_INTERVAL = "fast_interval"
+CONF_TRANSITIONS = "transitions"
+CONF_MAX_STEPS = "max_steps"
+CONF_EFFECT_LENGTH = "effect_length"
+CONF_STATUS_POLLING = "status_polling"
+CONF_PERIOD = "period"
+CONF_IN_FLIGHT = "in_flight"
+CONF_COMMAND_QUEUE = "command_queue"
+CONF_CAPACITY = "capacity"
+CONF_POLICY = "policy"
+CONF_TTL = "ttl"
+CONF_LIGHT_CURVES = "light_curves"
+CONF_COMPACT_DISCOVERY = "compact_discovery"
+CONF_PRODUCT_ID = "product_id"
+CONF_GAMMA = "gamma"
+CONF_MIN_LEVEL = "min_level"
+CONF_MIN_MIREDS = "min_mireds"
+CONF_MAX_MIREDS = "max_mireds"
+CONF_IDLE_INTERVAL = "idle_interval"
+CONF_IDLE_LATENCY = "idle_latency"
+CONF_IDLE_DELAY = "idle_delay"
 
 CONNECTION_SCHEMA = esp32_ble_tracker.ESP_BLE_DEVICE_SCHEMA.extend(
     {
@@ -18,32 +106,376 @@ CONNECTION_SCHEMA = esp32_ble_tracker.ESP_BLE_DEVICE_SCHEMA.extend(
     }
 ).extend(cv.COMPONENT_SCHEMA)
 
-CONFIG_SCHEMA = (
+
+def validate_topic_level(value):
+    value = cv.string_strict(value)
+    if re.search(r"[/#+\s]", value):
+        raise cv.Invalid("Can not contain '/', '#', '+' or whitespace")
+    return value
+
+
+MESH_SCHEMA = cv.Schema(
+    {
+        cv.Required(CONF_MESH_NAME): cv.string_strict,
+        cv.Required(CONF_MESH_PASSWORD): cv.string_strict,
+        cv.Optional(CONF_MQTT_NAMESPACE): validate_topic_level,
+        cv.Optional(CONF_CONNECTION, {}): CONNECTION_SCHEMA,
+    }
+)
+
+
+def validate_meshes(config):
+    if CONF_MESHES in config:
+        if CONF_MESH_NAME in config or CONF_MESH_PASSWORD in config:
+            raise cv.Invalid("Use either mesh_name and mesh_password or a list of meshes")
+        # Only the generated default, every mesh has its own connection
+        config = config.copy()
+        config.pop(CONF_CONNECTION, None)
+    else:
+        if CONF_MESH_NAME not in config or CONF_MESH_PASSWORD not in config:
+            raise cv.Invalid("mesh_name and mesh_password are required")
+        config = config.copy()
+        config[CONF_MESHES] = [
+            {
+                CONF_MESH_NAME: config.pop(CONF_MESH_NAME),
+                CONF_MESH_PASSWORD: config.pop(CONF_MESH_PASSWORD),
+                CONF_CONNECTION: config.pop(CONF_CONNECTION),
+            }
+        ]
+
+    meshes = config[CONF_MESHES]
+    if len(meshes) > 1:
+        # Mesh IDs overlap between meshes, give each mesh its own topics
+        for mesh in meshes:
+            if CONF_MQTT_NAMESPACE not in mesh:
+                mesh[CONF_MQTT_NAMESPACE] = re.sub(r"[^a-z0-9_-]", "_", mesh[CONF_MESH_NAME].lower())
+        names = [mesh[CONF_MESH_NAME] for mesh in meshes]
+        if len(set(names)) != len(names):
+            raise cv.Invalid("Every mesh needs a unique mesh_name")
+        namespaces = [mesh[CONF_MQTT_NAMESPACE] for mesh in meshes]
+        if len(set(namespaces)) != len(namespaces):
+            raise cv.Invalid("Every mesh needs a unique mqtt_namespace")
+    return config
+
+
+STATE_SNAPSHOT_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_INTERVAL, default="60s"): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_FORMAT, default="json"): cv.enum(SNAPSHOT_FORMATS, lower=True),
+        cv.Optional(CONF_DELTAS, default=False): cv.boolean,
+    }
+)
+
+
+def validate_scan_policy(config):
+    for window in (CONF_SEARCHING_WINDOW, CONF_CONNECTED_WINDOW):
+        if config[window] > config[CONF_INTERVAL]:
+            raise cv.Invalid(f"{window} can not be larger than the scan interval")
+    return config
+
+
+SCAN_POLICY_SCHEMA = cv.All(
+    cv.Schema(
+        {
+            cv.Optional(CONF_INTERVAL, default="320ms"): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_SEARCHING_WINDOW, default="300ms"): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_CONNECTED, default="low_duty"): cv.enum(SCAN_MODES, lower=True),
+            cv.Optional(CONF_CONNECTED_WINDOW, default="15ms"): cv.positive_time_period_milliseconds,
+        }
+    ),
+    validate_scan_policy,
+)
+
+
+def validate_connection_parameters(config):
+    # Bluetooth Core spec: the supervision timeout has to exceed (1 + latency) * interval * 2
+    timeout = config[CONF_TIMEOUT].total_milliseconds
+    for interval, latency in (
+        (CONF_FAST_INTERVAL, 0),
+        (CONF_IDLE_INTERVAL, config[CONF_IDLE_LATENCY]),
+    ):
+        minimum = (1 + latency) * config[interval].total_microseconds / 1000 * 2
+        if timeout <= minimum:
+            raise cv.Invalid(
+                f"timeout has to be longer than {minimum:g}ms for the {interval} with a latency of {latency}"
+            )
+    return config
+
+
+CONNECTION_PARAMETERS_SCHEMA = cv.All(
+    cv.Schema(
+        {
+            cv.Optional(CONF_FAST_INTERVAL, default="7.5ms"): cv.All(
+                cv.positive_time_period_microseconds,
+                cv.Range(min=cv.TimePeriod(microseconds=7500), max=cv.TimePeriod(seconds=4)),
+            ),
+            cv.Optional(CONF_IDLE_INTERVAL, default="100ms"): cv.All(
+                cv.positive_time_period_microseconds,
+                cv.Range(min=cv.TimePeriod(microseconds=7500), max=cv.TimePeriod(seconds=4)),
+            ),
+            cv.Optional(CONF_IDLE_LATENCY, default=0): cv.int_range(min=0, max=499),
+            cv.Optional(CONF_TIMEOUT, default="4s"): cv.All(
+                cv.positive_time_period_milliseconds,
+                cv.Range(min=cv.TimePeriod(milliseconds=100), max=cv.TimePeriod(seconds=32)),
+            ),
+            cv.Optional(CONF_IDLE_DELAY, default="2s"): cv.positive_time_period_milliseconds,
+        }
+    ),
+    validate_connection_parameters,
+)
+
+HANDOVER_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_RSSI_THRESHOLD, default=-85): cv.int_range(min=-127, max=0),
+        cv.Optional(CONF_RSSI_MARGIN, default=10): cv.int_range(min=0, max=60),
+        cv.Optional(CONF_MIN_INTERVAL, default="60s"): cv.positive_time_period_milliseconds,
+    }
+)
+
+METRICS_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_INTERVAL, default="60s"): cv.positive_time_period_milliseconds,
+        cv.Optional(CONF_MQTT, default=True): cv.boolean,
+    }
+)
+
+PACKET_TRACE_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_SIZE, default=128): cv.int_range(min=16, max=1024),
+    }
+)
+
+
+def validate_transitions(config):
+    if config[CONF_MODE] != "hub":
+        _LOGGER.warning(
+            "transitions mode '%s' is experimental: the fade duration command (0xf6) and its encoding are not "
+            "confirmed for plain light changes",
+            config[CONF_MODE],
+        )
+    return config
+
+
+TRANSITIONS_SCHEMA = cv.All(
+    cv.Schema(
+        {
+            cv.Optional(CONF_MODE, default="hub"): cv.enum(TRANSITION_MODES, lower=True),
+            cv.Optional(CONF_MAX_STEPS, default=8): cv.int_range(min=2, max=50),
+            cv.Optional(CONF_EFFECT_LENGTH, default="1s"): cv.positive_time_period_milliseconds,
+        }
+    ),
+    validate_transitions,
+)
+
+
+STATUS_POLLING_SCHEMA = cv.Schema(
+    {
+        cv.Optional(CONF_PERIOD, default="5min"): cv.All(
+            cv.positive_time_period_milliseconds,
+            cv.Range(min=cv.TimePeriod(seconds=10)),
+        ),
+        cv.Optional(CONF_IN_FLIGHT, default=2): cv.int_range(min=1, max=8),
+    }
+)
+
+
+COMMAND_QUEUE_SCHEMA = cv.Schema(
+    {
+        # COMMAND_QUEUE_MAX_CAPACITY in command_scheduler.h
+        cv.Optional(CONF_CAPACITY, default=32): cv.int_range(min=8, max=64),
+        cv.Optional(CONF_POLICY, default="drop_oldest"): cv.enum(ADMISSION_POLICIES, lower=True),
+        cv.Optional(CONF_TTL, default="30s"): cv.positive_time_period_milliseconds,
+    }
+)
+
+
+def validate_light_curve(config):
+    if config[CONF_MIN_MIREDS] >= config[CONF_MAX_MIREDS]:
+        raise cv.Invalid("min_mireds has to be lower than max_mireds")
+    return config
+
+
+LIGHT_CURVE_SCHEMA = cv.All(
+    cv.Schema(
+        {
+            cv.Required(CONF_PRODUCT_ID): cv.hex_int_range(min=0, max=0xFF),
+            cv.Optional(CONF_GAMMA, default=1.0): cv.float_range(min=0.1, max=5.0),
+            cv.Optional(CONF_MIN_LEVEL, default="0%"): cv.All(cv.percentage, cv.Range(max=0.5)),
+            cv.Optional(CONF_MIN_MIREDS, default=153): cv.int_range(min=100, max=1000),
+            cv.Optional(CONF_MAX_MIREDS, default=370): cv.int_range(min=100, max=1000),
+        }
+    ),
+    validate_light_curve,
+)
+
+
+def validate_cluster(config):
+    if config[CONF_TIMEOUT] <= config[CONF_HEARTBEAT_INTERVAL]:
+        raise cv.Invalid("timeout has to be longer than the heartbeat_interval")
+    return config
+
+
+CLUSTER_SCHEMA = cv.All(
+    cv.Schema(
+        {
+            cv.Optional(CONF_TOPIC, default="awox_mesh/cluster"): cv.publish_topic,
+            cv.Optional(CONF_HUB_ID): validate_topic_level,
+            cv.Optional(CONF_HEARTBEAT_INTERVAL, default="2s"): cv.positive_time_period_milliseconds,
+            cv.Optional(CONF_TIMEOUT, default="6s"): cv.positive_time_period_milliseconds,
+        }
+    ),
+    validate_cluster,
+)
+
+CONFIG_SCHEMA = cv.All(
     cv.Schema(
         {
             cv.GenerateID(): cv.declare_id(Awox),
-            cv.Required("mesh_name"): cv.string_strict,
-            cv.Required("mesh_password"): cv.string_strict,
-            cv.Optional("connection", {}): CONNECTION_SCHEMA,
+            cv.Optional(CONF_MESH_NAME): cv.string_strict,
+            cv.Optional(CONF_MESH_PASSWORD): cv.string_strict,
+            cv.Optional(CONF_CONNECTION, {}): CONNECTION_SCHEMA,
+            cv.Optional(CONF_MESHES): cv.All(cv.ensure_list(MESH_SCHEMA), cv.Length(min=1)),
+            cv.Optional(CONF_STATE_SNAPSHOT): STATE_SNAPSHOT_SCHEMA,
+            cv.Optional(CONF_SCAN_POLICY): SCAN_POLICY_SCHEMA,
+            cv.Optional(CONF_CONNECTION_PARAMETERS): CONNECTION_PARAMETERS_SCHEMA,
+            cv.Optional(CONF_HANDOVER): HANDOVER_SCHEMA,
+            cv.Optional(CONF_PROTOCOL_TASK, default=False): cv.boolean,
+            cv.Optional(CONF_METRICS): METRICS_SCHEMA,
+            cv.Optional(CONF_PACKET_TRACE): PACKET_TRACE_SCHEMA,
+            cv.Optional(CONF_PROFILING, default=False): cv.boolean,
+            cv.Optional(CONF_CLUSTER): CLUSTER_SCHEMA,
+            cv.Optional(CONF_TRANSITIONS): TRANSITIONS_SCHEMA,
+            cv.Optional(CONF_STATUS_POLLING): STATUS_POLLING_SCHEMA,
+            cv.Optional(CONF_COMMAND_QUEUE): COMMAND_QUEUE_SCHEMA,
+            cv.Optional(CONF_LIGHT_CURVES): cv.ensure_list(LIGHT_CURVE_SCHEMA),
+            cv.Optional(CONF_COMPACT_DISCOVERY, default=False): cv.boolean,
         }
     )
     .extend(esp32_ble_tracker.ESP_BLE_DEVICE_SCHEMA)
-    .extend(cv.COMPONENT_SCHEMA)
+    .extend(cv.COMPONENT_SCHEMA),
+    validate_meshes,
+    # The scan policy restarts the scan through esp32_ble_tracker start_scan / stop_scan
+    cv.require_esphome_version(2023, 3, 0),
 )
 
 
+async def mesh_to_code(var, mesh, config):
+    connection_var = cg.new_Pvariable(mesh[CONF_CONNECTION][CONF_ID])
+    cg.add(connection_var.set_mesh_name(mesh[CONF_MESH_NAME]))
+    cg.add(connection_var.set_mesh_password(mesh[CONF_MESH_PASSWORD]))
+    if CONF_MQTT_NAMESPACE in mesh:
+        cg.add(connection_var.set_topic_namespace(mesh[CONF_MQTT_NAMESPACE]))
+    cg.add(connection_var.set_protocol_task(config[CONF_PROTOCOL_TASK]))
+    cg.add(connection_var.set_compact_discovery(config[CONF_COMPACT_DISCOVERY]))
+
+    if CONF_STATE_SNAPSHOT in config:
+        snapshot = config[CONF_STATE_SNAPSHOT]
+        cg.add(connection_var.set_state_snapshot_interval(snapshot[CONF_INTERVAL]))
+        cg.add(connection_var.set_state_snapshot_format(snapshot[CONF_FORMAT]))
+        cg.add(connection_var.set_state_snapshot_deltas(snapshot[CONF_DELTAS]))
+
+    if CONF_PACKET_TRACE in config:
+        cg.add(connection_var.set_packet_trace_size(config[CONF_PACKET_TRACE][CONF_SIZE]))
+
+    if CONF_TRANSITIONS in config:
+        transitions = config[CONF_TRANSITIONS]
+        cg.add(
+            connection_var.set_transitions(
+                transitions[CONF_MODE],
+                transitions[CONF_MAX_STEPS],
+                transitions[CONF_EFFECT_LENGTH],
+            )
+        )
+
+    for curve in config.get(CONF_LIGHT_CURVES, []):
+        cg.add(
+            connection_var.set_light_curve(
+                curve[CONF_PRODUCT_ID],
+                curve[CONF_GAMMA],
+                curve[CONF_MIN_LEVEL],
+                curve[CONF_MIN_MIREDS],
+                curve[CONF_MAX_MIREDS],
+            )
+        )
+
+    if CONF_COMMAND_QUEUE in config:
+        command_queue = config[CONF_COMMAND_QUEUE]
+        cg.add(
+            connection_var.set_command_queue(
+                command_queue[CONF_CAPACITY],
+                command_queue[CONF_POLICY],
+                command_queue[CONF_TTL],
+            )
+        )
+
+    if CONF_STATUS_POLLING in config:
+        polling = config[CONF_STATUS_POLLING]
+        cg.add(connection_var.set_status_polling(polling[CONF_PERIOD], polling[CONF_IN_FLIGHT]))
+
+    if CONF_CONNECTION_PARAMETERS in config:
+        conn_params = config[CONF_CONNECTION_PARAMETERS]
+        cg.add(
+            connection_var.set_connection_parameters(
+                int(conn_params[CONF_FAST_INTERVAL].total_microseconds / 1250),
+                int(conn_params[CONF_IDLE_INTERVAL].total_microseconds / 1250),
+                conn_params[CONF_IDLE_LATENCY],
+                int(conn_params[CONF_TIMEOUT].total_milliseconds / 10),
+                conn_params[CONF_IDLE_DELAY],
+            )
+        )
+
+    await cg.register_component(connection_var, mesh[CONF_CONNECTION])
+    cg.add(var.register_connection(connection_var))
+    await esp32_ble_tracker.register_client(connection_var, mesh[CONF_CONNECTION])
+
+
 async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
     await esp32_ble_tracker.register_ble_device(var, config)
 
-    connection_var = cg.new_Pvariable(config["connection"][CONF_ID])
-    cg.add(connection_var.set_mesh_name(config["mesh_name"]))
-    cg.add(connection_var.set_mesh_password(config["mesh_password"]))
+    if CONF_SCAN_POLICY in config:
+        scan_policy = config[CONF_SCAN_POLICY]
+        cg.add(
+            var.set_scan_policy(
+                int(scan_policy[CONF_INTERVAL].total_milliseconds / 0.625),
+                int(scan_policy[CONF_SEARCHING_WINDOW].total_milliseconds / 0.625),
+                int(scan_policy[CONF_CONNECTED_WINDOW].total_milliseconds / 0.625),
+                scan_policy[CONF_CONNECTED],
+            )
+        )
 
-    await cg.register_component(connection_var, config["connection"])
-    cg.add(var.register_connection(connection_var))
-    await esp32_ble_tracker.register_client(connection_var, config["connection"])
+    if CONF_HANDOVER in config:
+        handover = config[CONF_HANDOVER]
+        cg.add(
+            var.set_handover(
+                handover[CONF_RSSI_THRESHOLD],
+                handover[CONF_RSSI_MARGIN],
+                handover[CONF_MIN_INTERVAL],
+            )
+        )
+
+    if CONF_CLUSTER in config:
+        cluster = config[CONF_CLUSTER]
+        cg.add(
+            var.set_cluster(
+                cluster[CONF_TOPIC],
+                cluster.get(CONF_HUB_ID, CORE.name),
+                cluster[CONF_HEARTBEAT_INTERVAL],
+                cluster[CONF_TIMEOUT],
+            )
+        )
+
+    if config[CONF_PROFILING]:
+        # Build flag instead of a define, mesh_protocol.cpp does not include the ESPHome defines
+        cg.add_build_flag("-DAWOX_MESH_PROFILING")
+
+    if CONF_METRICS in config:
+        metrics = config[CONF_METRICS]
+        cg.add(var.set_metrics(metrics[CONF_INTERVAL], metrics[CONF_MQTT]))
+
+    for mesh in config[CONF_MESHES]:
+        await mesh_to_code(var, mesh, config)
 
     # Crypto
     cg.add_library("rweather/Crypto", "0.4.0")
@@ -1,10 +1,12 @@
 #pragma once
 
 #ifdef USE_ESP32
+#include <cmath>
 #include <cstring>
 #include <cstdio>
 #include <algorithm>
 #include "awox_mesh.h"
+#include "profiler.h"
 
 #include "esphome/core/log.h"
 
@@ -13,35 +15,55 @@ namespace awox_mesh {
 
 static const char *const TAG = "AwoxMesh";
 
-FoundDevice AwoxMesh::add_to_devices(const esp32_ble_tracker::ESPBTDevice &device) {
-  this->devices_.erase(
-      std::remove_if(this->devices_.begin(), this->devices_.end(),
-                     [device](const FoundDevice &_f) { return _f.address == device.address_uint64(); }),
-      this->devices_.end());
+FoundDevice AwoxMesh::add_to_devices(MeshNetwork &mesh, const esp32_ble_tracker::ESPBTDevice &device) {
+  AWOX_PROFILE("add_to_devices");
+  mesh.devices.erase(std::remove_if(mesh.devices.begin(), mesh.devices.end(),
+                                    [device](const FoundDevice &_f) { return _f.address == device.address_uint64(); }),
+                     mesh.devices.end());
 
   static FoundDevice found = {};
   found.address_str = device.address_str();
   found.address = device.address_uint64();
   found.rssi = device.get_rssi();
   found.last_detected = esphome::millis();
-  this->devices_.push_back(found);
+  mesh.devices.push_back(found);
 
-  this->remove_devices_that_are_not_available();
+  this->remove_devices_that_are_not_available(mesh);
 
-  this->sort_devices();
+  this->sort_devices(mesh);
 
   return found;
 }
 
+MeshNetwork *AwoxMesh::find_mesh(const esp32_ble_tracker::ESPBTDevice &device) {
+  if (this->meshes_.size() == 1) {
+    return &this->meshes_.front();
+  }
+
+  // Mesh nodes advertise the name of their mesh
+  auto found = std::find_if(this->meshes_.begin(), this->meshes_.end(), [&device](const MeshNetwork &_f) {
+    return _f.connection->get_mesh_name() == device.get_name();
+  });
+  return found != this->meshes_.end() ? &*found : nullptr;
+}
+
 bool AwoxMesh::parse_device(const esp32_ble_tracker::ESPBTDevice &device) {
+  AWOX_PROFILE("parse_device");
   if (device.address_str().rfind("A4:C1", 0) != 0) {
     return false;
   }
 
-  FoundDevice found = add_to_devices(device);
+  MeshNetwork *mesh = this->find_mesh(device);
+  if (mesh == nullptr) {
+    ESP_LOGV(TAG, "Awox device %s - %s is not part of a configured mesh", device.get_name().c_str(),
+             device.address_str().c_str());
+    return false;
+  }
+
+  FoundDevice found = add_to_devices(*mesh, device);
 
   ESP_LOGV(TAG, "Found Awox device %s - %s. RSSI: %d dB (total devices: %d)", device.get_name().c_str(),
-           device.address_str().c_str(), device.get_rssi(), this->devices_.size());
+           device.address_str().c_str(), device.get_rssi(), mesh->devices.size());
 
   return true;
 }
@@ -49,43 +71,450 @@ bool AwoxMesh::parse_device(const esp32_ble_tracker::ESPBTDevice &device) {
 void AwoxMesh::setup() {
   Component::setup();
 
-  this->connection->set_disconnect_callback([this]() { ESP_LOGI(TAG, "disconnected"); });
+  for (auto &mesh : this->meshes_) {
+    MeshDevice *connection = mesh.connection;
+    connection->set_disconnect_callback(
+        [connection]() { ESP_LOGI(TAG, "%s: disconnected", connection->get_mesh_name().c_str()); });
+  }
+
+  if (this->has_metrics()) {
+    this->last_metrics_report = esphome::millis();
+    this->set_interval("metrics", this->metrics_interval, [this]() { this->report_metrics(); });
+  }
+
+  if (this->cluster.is_enabled()) {
+    this->setup_cluster();
+  }
+
+#ifdef AWOX_MESH_PROFILING
+  this->set_interval("profile", 60000, [this]() { this->publish_profile(); });
+#endif
 }
 
 void AwoxMesh::loop() {
-  if (esphome::millis() - this->start > 20000 && this->devices_.size() > 0 && this->connection->address_str() == "") {
-    ESP_LOGD(TAG, "Total devices: %d", this->devices_.size());
-    for (int i = 0; i < this->devices_.size(); i++) {
-      ESP_LOGD(TAG, "Available device %s => rssi: %d", this->devices_[i].address_str.c_str(), this->devices_[i].rssi);
+  this->check_link_quality();
+  this->update_scan_policy();
+  this->update_cluster();
+
+  if (this->connecting >= 0) {
+    MeshDevice *connection = this->meshes_[this->connecting].connection;
+    // Connected, or the attempt was already given up (address cleared)
+    if (connection->connected() || connection->address_str() == "") {
+      this->cancel_timeout("connecting");
+      this->connecting = -1;
+    }
+  }
+
+  if (esphome::millis() - this->start > 20000 && this->connecting < 0) {
+    this->connect_next_mesh();
+  }
+}
+
+void AwoxMesh::connect_next_mesh() {
+  for (int i = 0; i < this->meshes_.size(); i++) {
+    int index = (this->next_mesh + i) % this->meshes_.size();
+    MeshNetwork &mesh = this->meshes_[index];
+    if (mesh.devices.size() > 0 && mesh.connection->address_str() == "") {
+      this->next_mesh = (index + 1) % this->meshes_.size();
+      this->connect_mesh(index);
+      return;
+    }
+  }
+}
+
+void AwoxMesh::connect_mesh(int index) {
+  MeshNetwork &mesh = this->meshes_[index];
+
+  ESP_LOGD(TAG, "%s: Total devices: %d", mesh.connection->get_mesh_name().c_str(), mesh.devices.size());
+  for (int i = 0; i < mesh.devices.size(); i++) {
+    ESP_LOGD(TAG, "Available device %s => rssi: %d", mesh.devices[i].address_str.c_str(), mesh.devices[i].rssi);
+  }
+  auto device = mesh.devices.front();
+  if (mesh.handover_target.address != 0) {
+    device = mesh.handover_target;
+    mesh.handover_target = {};
+  }
+
+  ESP_LOGI(TAG, "%s: Try to connect %s => rssi: %d", mesh.connection->get_mesh_name().c_str(),
+           device.address_str.c_str(), device.rssi);
+  mesh.connection->set_address(device.address);
+  mesh.connection->connect();
+  this->connecting = index;
+
+  this->set_timeout("connecting", 20000, [this, index, device]() {
+    MeshNetwork &mesh = this->meshes_[index];
+    this->connecting = -1;
+    if (mesh.connection->connected()) {
+      return;
+    }
+    ESP_LOGI(TAG, "Failed to connect %s => rssi: %d", device.address_str.c_str(), device.rssi);
+    this->remove_devices_that_are_not_available(mesh);
+    mesh.connection->disconnect();
+    mesh.connection->set_address(0);
+  });
+}
+
+void AwoxMesh::check_link_quality() {
+  const uint32_t now = esphome::millis();
+  if (!this->handover_enabled || now - this->last_link_check < 5000) {
+    return;
+  }
+  this->last_link_check = now;
+
+  for (auto &mesh : this->meshes_) {
+    this->check_link_quality(mesh, now);
+  }
+}
+
+void AwoxMesh::check_link_quality(MeshNetwork &mesh, uint32_t now) {
+  MeshDevice *connection = mesh.connection;
+  if (!connection->connected() || !connection->is_link_degraded(this->handover_rssi_threshold)) {
+    mesh.scan_for_handover = false;
+    return;
+  }
+
+  // Look around at full duty while the link is bad
+  mesh.scan_for_handover = true;
+
+  if (now - mesh.last_handover < this->handover_min_interval) {
+    return;
+  }
+
+  this->remove_devices_that_are_not_available(mesh);
+  int link_rssi = connection->get_link_rssi();
+  // Degraded by failures before the RSSI was read: only a candidate that is clearly good is worth dropping the link
+  int baseline = link_rssi != 0 ? link_rssi : this->handover_rssi_threshold;
+  for (auto &candidate : mesh.devices) {
+    if (candidate.address_str == connection->address_str()) {
+      continue;
+    }
+    if (candidate.rssi < baseline + this->handover_rssi_margin) {
+      // devices are sorted on rssi, no better candidates left
+      break;
+    }
+
+    ESP_LOGI(TAG, "Link to %s degraded (rssi: %d), handover to %s => rssi: %d", connection->address_str().c_str(),
+             link_rssi, candidate.address_str.c_str(), candidate.rssi);
+    mesh.last_handover = now;
+    mesh.handover_target = candidate;
+    connection->disconnect();
+    connection->set_address(0);
+    return;
+  }
+}
+
+void AwoxMesh::setup_cluster() {
+  ESP_LOGI(TAG, "Cluster %s, hub id: %s", this->cluster_topic.c_str(), this->cluster.get_hub_id().c_str());
+  for (auto &mesh : this->meshes_) {
+    mesh.connection->set_cluster(&this->cluster);
+  }
+
+  const std::string hubs = this->cluster_topic + "/hubs/";
+  mqtt::global_mqtt_client->subscribe_json(hubs + "+", [this](const std::string &topic, JsonObject root) {
+    this->on_cluster_member(this->cluster_hub_id_from_topic(topic), root);
+  });
+  mqtt::global_mqtt_client->subscribe(hubs + "+/heartbeat",
+                                      [this](const std::string &topic, const std::string &payload) {
+                                        this->cluster.on_heartbeat(this->cluster_hub_id_from_topic(topic),
+                                                                   esphome::millis());
+                                      });
+  mqtt::global_mqtt_client->subscribe_json(hubs + "+/proximity", [this](const std::string &topic, JsonObject root) {
+    this->on_cluster_proximity(this->cluster_hub_id_from_topic(topic), root);
+  });
+
+  this->set_interval("cluster_heartbeat", this->cluster_heartbeat_interval,
+                     [this]() { this->send_cluster_heartbeat(); });
+}
+
+std::string AwoxMesh::cluster_hub_id_from_topic(const std::string &topic) const {
+  size_t start = this->cluster_topic.size() + strlen("/hubs/");
+  if (topic.size() <= start) {
+    return "";
+  }
+  return topic.substr(start, topic.find('/', start) - start);
+}
+
+void AwoxMesh::on_cluster_member(const std::string &id, JsonObject root) {
+  ClusterPeer *peer = this->cluster.get_peer(id);
+  if (peer == nullptr) {
+    return;
+  }
+
+  if (!root.containsKey("status_topic")) {
+    return;
+  }
+  std::string status_topic = root["status_topic"].as<std::string>();
+  peer->status_offline_payload = "offline";
+  if (root.containsKey("status_offline")) {
+    peer->status_offline_payload = root["status_offline"].as<std::string>();
+  }
+  if (status_topic.empty() || status_topic == peer->status_topic) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "Cluster hub %s joined, status topic %s", id.c_str(), status_topic.c_str());
+  peer->status_topic = status_topic;
+  mqtt::global_mqtt_client->subscribe(status_topic, [this, id](const std::string &topic, const std::string &payload) {
+    ClusterPeer *peer = this->cluster.get_peer(id);
+    bool online = payload != peer->status_offline_payload;
+    if (online != peer->status_online) {
+      ESP_LOGI(TAG, "Cluster hub %s is %s", id.c_str(), online ? "online" : "offline");
+    }
+    this->cluster.on_status(topic, online);
+  });
+}
+
+void AwoxMesh::on_cluster_proximity(const std::string &id, JsonObject root) {
+  ClusterPeer *peer = this->cluster.get_peer(id);
+  if (peer == nullptr) {
+    return;
+  }
+
+  peer->proximity.clear();
+  for (JsonPair node : root) {
+    peer->proximity[node.key().c_str()] = node.value().as<int>();
+  }
+}
+
+void AwoxMesh::send_cluster_heartbeat() {
+  const std::string topic = this->cluster_topic + "/hubs/" + this->cluster.get_hub_id();
+  mqtt::global_mqtt_client->publish(topic + "/heartbeat", this->cluster.get_leader(), 0, false);
+
+  const uint32_t now = esphome::millis();
+  const bool announce = this->last_cluster_announce == 0 || now - this->last_cluster_announce >= 30000;
+  if (announce) {
+    this->last_cluster_announce = now;
+    // Retained, so hubs that start later know the others right away
+    const mqtt::Availability &availability = mqtt::global_mqtt_client->get_availability();
+    mqtt::global_mqtt_client->publish_json(
+        topic,
+        [&availability](JsonObject root) {
+          root["status_topic"] = availability.topic;
+          root["status_offline"] = availability.payload_not_available;
+        },
+        0, true);
+  }
+
+  // Ownership follows the proximity, so it goes out as soon as it changes and not only with the announce
+  std::map<std::string, int> proximity;
+  for (auto &mesh : this->meshes_) {
+    this->remove_devices_that_are_not_available(mesh);
+    for (auto &device : mesh.devices) {
+      proximity[device.address_str] = device.rssi;
+    }
+  }
+  if (!this->cluster.update_own_proximity(proximity) && !announce) {
+    return;
+  }
+  mqtt::global_mqtt_client->publish_json(
+      topic + "/proximity",
+      [this](JsonObject root) {
+        for (auto &node : this->cluster.get_own_proximity()) {
+          root[node.first] = node.second;
+        }
+      },
+      0, true);
+}
+
+void AwoxMesh::update_cluster() {
+  if (!this->cluster.is_enabled() || !this->cluster.update(esphome::millis())) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "Cluster leader is now %s", this->cluster.get_leader().c_str());
+  for (auto &mesh : this->meshes_) {
+    mesh.connection->on_leadership_changed(this->cluster.is_leader());
+  }
+}
+
+bool AwoxMesh::has_metrics() const {
+#ifdef USE_SENSOR
+  for (auto *sensor : this->metric_sensors) {
+    if (sensor != nullptr) {
+      return true;
     }
-    auto device = this->devices_.front();
+  }
+#endif
+  return this->metrics_mqtt;
+}
+
+void AwoxMesh::report_metrics() {
+  static const char *const names[METRIC_COUNT] = {
+      "queue_depth", "queue_high_water", "commands_per_second", "notifications_per_second",
+      "decoded_per_second", "unknown_reports", "failures", "publishes", "devices_online", "devices_offline",
+      "devices_undiscovered", "scanner_candidates", "reconnects", "mac_failures", "duplicates", "scan_duty"};
+
+  const uint32_t now = esphome::millis();
+  float seconds = std::max(now - this->last_metrics_report, (uint32_t) 1) / 1000.0f;
+  auto rate = [seconds](uint32_t current, uint32_t last) { return (current - last) / seconds; };
+
+  // Summed over all meshes
+  MeshMetrics metrics = {};
+  int queue_depth = 0, queue_high_water = 0, online = 0, offline = 0, undiscovered = 0, candidates = 0;
+  int reconnects = 0;
+  for (auto &mesh : this->meshes_) {
+    const MeshMetrics &mesh_metrics = mesh.connection->get_metrics();
+    metrics.add(mesh_metrics);
+    reconnects += mesh_metrics.connects > 0 ? mesh_metrics.connects - 1 : 0;
+    queue_depth += mesh.connection->get_queue_depth();
+    queue_high_water += mesh.connection->get_queue_high_water_mark();
 
-    ESP_LOGI(TAG, "Try to connect %s => rssi: %d", device.address_str.c_str(), device.rssi);
-    this->connection->set_address(device.address);
-    this->connection->connect();
+    int mesh_online, mesh_offline, mesh_undiscovered;
+    mesh.connection->count_devices(mesh_online, mesh_offline, mesh_undiscovered);
+    online += mesh_online;
+    offline += mesh_offline;
+    undiscovered += mesh_undiscovered;
+
+    this->remove_devices_that_are_not_available(mesh);
+    candidates += mesh.devices.size();
+  }
 
-    this->set_timeout("connecting", 20000, [this, device]() {
-      if (this->connection->connected()) {
-        return;
-      }
-      ESP_LOGI(TAG, "Failed to connect %s => rssi: %d", device.address_str.c_str(), device.rssi);
-      this->remove_devices_that_are_not_available();
-      this->connection->disconnect();
-      this->connection->set_address(0);
-    });
+  float values[METRIC_COUNT];
+  values[METRIC_QUEUE_DEPTH] = queue_depth;
+  values[METRIC_QUEUE_HIGH_WATER] = queue_high_water;
+  values[METRIC_COMMANDS_RATE] = rate(metrics.commands_sent, this->last_metrics.commands_sent);
+  values[METRIC_NOTIFICATIONS_RATE] = rate(metrics.notifications_received, this->last_metrics.notifications_received);
+  values[METRIC_DECODED_RATE] = rate(metrics.notifications_decoded, this->last_metrics.notifications_decoded);
+  values[METRIC_UNKNOWN_REPORTS] = metrics.unknown_reports;
+  values[METRIC_FAILURES] = metrics.failures;
+  values[METRIC_PUBLISHES] = metrics.publishes;
+  values[METRIC_DEVICES_ONLINE] = online;
+  values[METRIC_DEVICES_OFFLINE] = offline;
+  values[METRIC_DEVICES_UNDISCOVERED] = undiscovered;
+  values[METRIC_SCANNER_CANDIDATES] = candidates;
+  values[METRIC_RECONNECTS] = reconnects;
+  values[METRIC_MAC_FAILURES] = metrics.mac_failures;
+  values[METRIC_DUPLICATES] = metrics.duplicates;
+  values[METRIC_SCAN_DUTY] = this->get_scan_duty();
+
+  this->last_metrics = metrics;
+  this->last_metrics_report = now;
+
+#ifdef USE_SENSOR
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    if (this->metric_sensors[i] != nullptr) {
+      this->metric_sensors[i]->publish_state(values[i]);
+    }
+  }
+#endif
+
+  if (this->metrics_mqtt) {
+    mqtt::global_mqtt_client->publish_json(
+        mqtt::global_mqtt_client->get_topic_prefix() + "/mesh/diagnostics/metrics",
+        [this, &values](JsonObject root) {
+          for (int i = 0; i < METRIC_COUNT; i++) {
+            root[names[i]] = values[i];
+          }
+          if (this->scan_policy_enabled) {
+            static const char *const modes[] = {"full", "low_duty", "paused"};
+            root["scan_mode"] = modes[this->scan_mode];
+          }
+        },
+        0, false);
+  }
+}
+
+#ifdef AWOX_MESH_PROFILING
+void AwoxMesh::publish_profile() {
+  for (auto *section = ProfileSection::first(); section != nullptr; section = section->next) {
+    ESP_LOGD(TAG, "Profile %s: %d calls, min %d, avg %d, max %d cycles", section->name, section->count,
+             section->count > 0 ? section->min : 0, section->avg(), section->max);
+  }
+
+  mqtt::global_mqtt_client->publish_json(
+      mqtt::global_mqtt_client->get_topic_prefix() + "/mesh/diagnostics/profile",
+      [](JsonObject root) {
+        for (auto *section = ProfileSection::first(); section != nullptr; section = section->next) {
+          JsonObject stats = root.createNestedObject(section->name);
+          stats["count"] = section->count;
+          stats["min"] = section->count > 0 ? section->min : 0;
+          stats["avg"] = section->avg();
+          stats["max"] = section->max;
+        }
+      },
+      0, false);
+
+  for (auto *section = ProfileSection::first(); section != nullptr; section = section->next) {
+    section->reset();
+  }
+}
+#endif
+
+void AwoxMesh::update_scan_policy() {
+  if (!this->scan_policy_enabled) {
+    return;
+  }
+
+  // Reduced scanning only when all meshes are connected and none of them looks for a better node
+  bool searching = std::any_of(this->meshes_.begin(), this->meshes_.end(), [](const MeshNetwork &_f) {
+    return !_f.connection->connected() || _f.scan_for_handover;
+  });
+  ScanMode mode = searching ? SCAN_MODE_FULL : this->scan_connected_mode;
+
+  if (mode != this->scan_mode || !this->scan_mode_applied) {
+    this->apply_scan_mode(mode);
+  }
+}
+
+void AwoxMesh::apply_scan_mode(ScanMode mode) {
+  auto *tracker = esp32_ble_tracker::global_esp32_ble_tracker;
+
+  switch (mode) {
+    case SCAN_MODE_FULL:
+      ESP_LOGI(TAG, "Scan policy: full duty (window %d of %d)", this->scan_searching_window, this->scan_interval);
+      tracker->set_scan_interval(this->scan_interval);
+      tracker->set_scan_window(this->scan_searching_window);
+      tracker->set_scan_continuous(true);
+      break;
+    case SCAN_MODE_LOW_DUTY:
+      ESP_LOGI(TAG, "Scan policy: low duty (window %d of %d)", this->scan_connected_window, this->scan_interval);
+      tracker->set_scan_interval(this->scan_interval);
+      tracker->set_scan_window(this->scan_connected_window);
+      tracker->set_scan_continuous(true);
+      break;
+    case SCAN_MODE_PAUSED:
+      ESP_LOGI(TAG, "Scan policy: paused");
+      break;
+  }
+
+  // Scan parameters are applied when the tracker starts a scan, it is restarted so they apply right away. Stopping
+  // also clears continuous scanning, when paused it stays stopped.
+  if (this->scan_mode_applied || mode != SCAN_MODE_FULL) {
+    tracker->stop_scan();
+    if (mode != SCAN_MODE_PAUSED) {
+      tracker->set_scan_continuous(true);
+      tracker->start_scan();
+    }
+  }
+
+  this->scan_mode = mode;
+  this->scan_mode_applied = true;
+}
+
+float AwoxMesh::get_scan_duty() const {
+  if (!this->scan_policy_enabled) {
+    return NAN;
+  }
+  switch (this->scan_mode) {
+    case SCAN_MODE_FULL:
+      return this->scan_searching_window * 100.0f / this->scan_interval;
+    case SCAN_MODE_LOW_DUTY:
+      return this->scan_connected_window * 100.0f / this->scan_interval;
+    default:
+      return 0;
   }
 }
 
-void AwoxMesh::sort_devices() {
-  std::stable_sort(this->devices_.begin(), this->devices_.end(),
+void AwoxMesh::sort_devices(MeshNetwork &mesh) {
+  std::stable_sort(mesh.devices.begin(), mesh.devices.end(),
                    [](FoundDevice a, FoundDevice b) { return a.rssi > b.rssi; });
 }
 
-void AwoxMesh::remove_devices_that_are_not_available() {
+void AwoxMesh::remove_devices_that_are_not_available(MeshNetwork &mesh) {
   const uint32_t now = esphome::millis();
-  this->devices_.erase(std::remove_if(this->devices_.begin(), this->devices_.end(),
-                                      [&](const FoundDevice &_f) { return now - _f.last_detected > 20000; }),
-                       this->devices_.end());
+  mesh.devices.erase(std::remove_if(mesh.devices.begin(), mesh.devices.end(),
+                                    [&](const FoundDevice &_f) { return now - _f.last_detected > 20000; }),
+                     mesh.devices.end());
 }
 
 }  // namespace awox_mesh
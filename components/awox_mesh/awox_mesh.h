@@ -15,6 +15,9 @@
 #include "esphome/core/automation.h"
 #include "esphome/core/component.h"
 #include "esphome/core/defines.h"
+#ifdef USE_SENSOR
+#include "esphome/components/sensor/sensor.h"
+#endif
 
 #include "mesh_device.h"
 
@@ -30,11 +33,109 @@ struct FoundDevice {
   uint32_t last_detected;
 };
 
+/**
+ * One mesh network served by the hub, with its own connection and candidate nodes.
+ */
+struct MeshNetwork {
+  MeshDevice *connection;
+  std::vector<FoundDevice> devices{};
+
+  FoundDevice handover_target{};
+  uint32_t last_handover = 0;
+  /**
+   * Scan at full duty even while connected, used while looking for a better node to connect to.
+   */
+  bool scan_for_handover = false;
+};
+
+enum ScanMode {
+  SCAN_MODE_FULL = 0,
+  SCAN_MODE_LOW_DUTY = 1,
+  SCAN_MODE_PAUSED = 2,
+};
+
 class AwoxMesh : public esp32_ble_tracker::ESPBTDeviceListener, public Component {
   uint32_t start;
-  FoundDevice add_to_devices(const esp32_ble_tracker::ESPBTDevice &device);
-  void sort_devices();
-  void remove_devices_that_are_not_available();
+  FoundDevice add_to_devices(MeshNetwork &mesh, const esp32_ble_tracker::ESPBTDevice &device);
+  void sort_devices(MeshNetwork &mesh);
+  void remove_devices_that_are_not_available(MeshNetwork &mesh);
+
+  /**
+   * The mesh an advert belongs to, matched on the advertised mesh name when the hub serves more than one mesh.
+   */
+  MeshNetwork *find_mesh(const esp32_ble_tracker::ESPBTDevice &device);
+
+  /**
+   * Connection attempts are made one at a time, the meshes without a connection take turns.
+   */
+  int connecting = -1;
+  int next_mesh = 0;
+
+  void connect_next_mesh();
+  void connect_mesh(int index);
+
+  /**
+   * Scan policy, scan intervals and windows are in units of 0.625 ms like the esp32_ble_tracker settings.
+   */
+  bool scan_policy_enabled = false;
+  uint32_t scan_interval = 512;
+  uint32_t scan_searching_window = 480;
+  uint32_t scan_connected_window = 24;
+  ScanMode scan_connected_mode = SCAN_MODE_LOW_DUTY;
+  ScanMode scan_mode = SCAN_MODE_FULL;
+  bool scan_mode_applied = false;
+
+  void update_scan_policy();
+  void apply_scan_mode(ScanMode mode);
+
+  /** Percentage of the time spent scanning, NAN without a scan policy. */
+  float get_scan_duty() const;
+
+  /**
+   * Handover to a better node when the link to the connected node degrades.
+   */
+  bool handover_enabled = false;
+  int handover_rssi_threshold = -85;
+  int handover_rssi_margin = 10;
+  uint32_t handover_min_interval = 60000;
+  uint32_t last_link_check = 0;
+
+  void check_link_quality();
+  void check_link_quality(MeshNetwork &mesh, uint32_t now);
+
+  /**
+   * Runtime metrics, reported as sensors and/or a diagnostics json on MQTT every metrics_interval.
+   */
+  bool metrics_mqtt = false;
+  uint32_t metrics_interval = 60000;
+  MeshMetrics last_metrics{};
+  uint32_t last_metrics_report = 0;
+#ifdef USE_SENSOR
+  sensor::Sensor *metric_sensors[METRIC_COUNT]{};
+#endif
+
+  bool has_metrics() const;
+  void report_metrics();
+
+  /**
+   * Cooperation with other hubs on the same mesh through <cluster_topic>/hubs/<hub id>.
+   */
+  HubCluster cluster{};
+  std::string cluster_topic;
+  uint32_t cluster_heartbeat_interval = 2000;
+  uint32_t last_cluster_announce = 0;
+
+  void setup_cluster();
+  void on_cluster_member(const std::string &id, JsonObject root);
+  void on_cluster_proximity(const std::string &id, JsonObject root);
+  void send_cluster_heartbeat();
+  void update_cluster();
+  std::string cluster_hub_id_from_topic(const std::string &topic) const;
+
+#ifdef AWOX_MESH_PROFILING
+  /** Publishes the cycle counts of the profiled functions since the previous dump. */
+  void publish_profile();
+#endif
 
  public:
   void setup() override;
@@ -46,13 +147,47 @@ class AwoxMesh : public esp32_ble_tracker::ESPBTDeviceListener, public Component
 
   void register_connection(MeshDevice *connection) {
     ESP_LOGD("AwoxMesh", "register_connection");
-    this->connection = connection;
+    MeshNetwork mesh = {};
+    mesh.connection = connection;
+    this->meshes_.push_back(mesh);
   }
   void loop() override;
 
+  void set_handover(int rssi_threshold, int rssi_margin, uint32_t min_interval) {
+    this->handover_enabled = true;
+    this->handover_rssi_threshold = rssi_threshold;
+    this->handover_rssi_margin = rssi_margin;
+    this->handover_min_interval = min_interval;
+  }
+
+  void set_cluster(const std::string &topic, const std::string &hub_id, uint32_t heartbeat_interval,
+                   uint32_t timeout) {
+    this->cluster_topic = topic;
+    this->cluster.set_hub_id(hub_id);
+    this->cluster_heartbeat_interval = heartbeat_interval;
+    this->cluster.set_timeout(timeout);
+  }
+
+  void set_metrics(uint32_t interval, bool mqtt) {
+    this->metrics_interval = interval;
+    this->metrics_mqtt = mqtt;
+  }
+
+#ifdef USE_SENSOR
+  void set_metric_sensor(MetricType type, sensor::Sensor *sensor) { this->metric_sensors[type] = sensor; }
+#endif
+
+  void set_scan_policy(uint32_t interval, uint32_t searching_window, uint32_t connected_window,
+                       ScanMode connected_mode) {
+    this->scan_policy_enabled = true;
+    this->scan_interval = interval;
+    this->scan_searching_window = searching_window;
+    this->scan_connected_window = connected_window;
+    this->scan_connected_mode = connected_mode;
+  }
+
  protected:
-  MeshDevice *connection;
-  std::vector<FoundDevice> devices_{};
+  std::vector<MeshNetwork> meshes_{};
 };
 
 }  // namespace awox_mesh
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "latency_stats.h"
+
+namespace esphome {
+namespace awox_mesh {
+
+enum CommandPriority {
+  /** Commands from the per device command topics */
+  PRIORITY_INTERACTIVE = 0,
+  /** Batch commands and retries of unconfirmed state */
+  PRIORITY_AUTOMATION = 1,
+  /** Device info queries and status polling */
+  PRIORITY_BACKGROUND = 2,
+};
+
+#define COMMAND_PRIORITY_COUNT 3
+
+/** Command data of a packet, bytes 10-19 */
+#define COMMAND_DATA_SIZE 10
+/** Upper bound of the configurable queue capacity, the slots are allocated up front */
+#define COMMAND_QUEUE_MAX_CAPACITY 64
+/** Time to live (ms) of light commands from the command topics, a state that was not sent in time is resent later */
+#define COMMAND_TTL_INTERACTIVE 5000
+/** Time to live (ms) of device info queries and status polls, they are only asked again after a while */
+#define COMMAND_TTL_BACKGROUND 120000
+
+/**
+ * What happens to a command that does not fit in a full queue.
+ */
+enum AdmissionPolicy {
+  /**
+   * Make room by dropping the oldest queued command for the same destination with the same or a lower priority,
+   * reject when there is none
+   */
+  ADMISSION_DROP_OLDEST = 0,
+  /** Reject the new command */
+  ADMISSION_REJECT = 1,
+  /** Reject, the caller replaces the queued packets of the light by its desired state */
+  ADMISSION_RECONCILE = 2,
+};
+
+enum AdmissionResult {
+  ADMITTED = 0,
+  /** Admitted after dropping an older command */
+  ADMITTED_DROPPED = 1,
+  REJECTED = 2,
+};
+
+/**
+ * A queued packet, plain data so the queue never touches the heap.
+ */
+struct QueuedCommand {
+  int command;
+  uint8_t data[COMMAND_DATA_SIZE];
+  uint8_t length;
+  int dest;
+  uint32_t received_at = 0;
+  uint32_t queued_at = 0;
+  /** Time (ms) after which the command is dropped instead of sent, 0 for the default of the queue */
+  uint32_t ttl = 0;
+  CommandPriority priority = PRIORITY_INTERACTIVE;
+  /** Batch message the command belongs to, 0 for none */
+  uint16_t batch = 0;
+  /** Held back until the other commands of its batch left the queue, whatever their destination */
+  bool after_batch = false;
+
+  void set_data(const std::string &data) {
+    this->length = std::min<size_t>(data.size(), COMMAND_DATA_SIZE);
+    memcpy(this->data, data.data(), this->length);
+  }
+
+  std::string get_data() const { return std::string((const char *) this->data, this->length); }
+
+  bool same_data(const QueuedCommand &other) const {
+    return this->length == other.length && memcmp(this->data, other.data, this->length) == 0;
+  }
+};
+
+/**
+ * Outgoing command queue with priority classes in a fixed number of slots.
+ * Higher classes are always served first, within a class the destinations take turns so a flood of commands for one
+ * device does not hold back the others. Commands for a destination leave in the order they were queued.
+ */
+class CommandScheduler {
+  struct Slot {
+    bool used;
+    /** Queue order */
+    uint32_t sequence;
+    QueuedCommand command;
+  };
+
+  Slot slots_[COMMAND_QUEUE_MAX_CAPACITY] = {};
+  int capacity_ = 32;
+  uint32_t ttl_ = 30000;
+  AdmissionPolicy policy_ = ADMISSION_DROP_OLDEST;
+
+  uint32_t next_sequence_ = 0;
+  /** Destination served last per class, -1 when none yet */
+  int last_dest_[COMMAND_PRIORITY_COUNT] = {-1, -1, -1};
+  LatencyStats delay_[COMMAND_PRIORITY_COUNT];
+  int size_ = 0;
+  int high_water_ = 0;
+
+  /** Oldest command that may make room for the given one: same destination, same or lower priority. */
+  Slot *oldest_(const QueuedCommand &command) {
+    Slot *oldest = nullptr;
+    for (auto &slot : this->slots_) {
+      if (slot.used && slot.command.dest == command.dest && slot.command.priority >= command.priority &&
+          (oldest == nullptr || slot.sequence < oldest->sequence)) {
+        oldest = &slot;
+      }
+    }
+    return oldest;
+  }
+
+  void release_(Slot &slot) {
+    slot.used = false;
+    this->size_--;
+  }
+
+  bool held_(const QueuedCommand &command) const {
+    if (!command.after_batch) {
+      return false;
+    }
+    for (auto &slot : this->slots_) {
+      if (slot.used && slot.command.batch == command.batch && !slot.command.after_batch) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool ready_(const Slot &slot, int priority) const {
+    return slot.used && slot.command.priority == priority && !this->held_(slot.command);
+  }
+
+ public:
+  void set_capacity(int capacity) { this->capacity_ = std::min(capacity, COMMAND_QUEUE_MAX_CAPACITY); }
+  void set_ttl(uint32_t ttl) { this->ttl_ = ttl; }
+  void set_policy(AdmissionPolicy policy) { this->policy_ = policy; }
+  AdmissionPolicy get_policy() const { return this->policy_; }
+
+  /**
+   * \param dropped : receives the command that made room, when the result is ADMITTED_DROPPED.
+   */
+  AdmissionResult push(const QueuedCommand &command, QueuedCommand *dropped) {
+    AdmissionResult result = ADMITTED;
+    if (this->size_ >= this->capacity_) {
+      Slot *oldest = this->policy_ == ADMISSION_DROP_OLDEST ? this->oldest_(command) : nullptr;
+      if (oldest == nullptr) {
+        return REJECTED;
+      }
+      *dropped = oldest->command;
+      this->release_(*oldest);
+      result = ADMITTED_DROPPED;
+    }
+
+    for (auto &slot : this->slots_) {
+      if (!slot.used) {
+        slot.used = true;
+        slot.sequence = this->next_sequence_++;
+        slot.command = command;
+        break;
+      }
+    }
+    this->size_++;
+    this->high_water_ = std::max(this->high_water_, this->size_);
+    return result;
+  }
+
+  bool empty() const { return this->size_ == 0; }
+
+  bool full() const { return this->size_ >= this->capacity_; }
+
+  int size() const { return this->size_; }
+
+  /** Largest number of commands waiting at once since boot. */
+  int get_high_water_mark() const { return this->high_water_; }
+
+  /**
+   * Takes the next command.
+   * \param now : current time, used for the queue delay statistics.
+   * \param command : receives the command.
+   * \returns false when nothing can be sent, the queue is empty or only holds commands waiting for their batch.
+   */
+  bool pop(uint32_t now, QueuedCommand &command) {
+    for (int priority = 0; priority < COMMAND_PRIORITY_COUNT; priority++) {
+      // Next destination after the one served last, wrapping around to the lowest
+      bool found = false, found_after = false;
+      int lowest = 0, after = 0;
+      for (auto &slot : this->slots_) {
+        if (!this->ready_(slot, priority)) {
+          continue;
+        }
+        int dest = slot.command.dest;
+        if (!found || dest < lowest) {
+          lowest = dest;
+        }
+        if (dest > this->last_dest_[priority] && (!found_after || dest < after)) {
+          after = dest;
+          found_after = true;
+        }
+        found = true;
+      }
+      if (!found) {
+        continue;
+      }
+
+      int dest = found_after ? after : lowest;
+      Slot *next = nullptr;
+      for (auto &slot : this->slots_) {
+        if (this->ready_(slot, priority) && slot.command.dest == dest &&
+            (next == nullptr || slot.sequence < next->sequence)) {
+          next = &slot;
+        }
+      }
+
+      this->last_dest_[priority] = dest;
+      this->release_(*next);
+      this->delay_[priority].add(now - next->command.queued_at);
+      command = next->command;
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * Drops the commands that waited longer than their time to live.
+   * \param on_expired : called with every dropped command.
+   */
+  template<typename Callback> void expire(uint32_t now, Callback on_expired) {
+    for (auto &slot : this->slots_) {
+      uint32_t ttl = slot.command.ttl > 0 ? slot.command.ttl : this->ttl_;
+      if (slot.used && now - slot.command.queued_at > ttl) {
+        this->release_(slot);
+        on_expired(slot.command);
+      }
+    }
+  }
+
+  template<typename Predicate> void remove_if(Predicate predicate) {
+    for (auto &slot : this->slots_) {
+      if (slot.used && predicate(slot.command)) {
+        this->release_(slot);
+      }
+    }
+  }
+
+  template<typename Predicate> bool any_of(Predicate predicate) const {
+    for (auto &slot : this->slots_) {
+      if (slot.used && predicate(slot.command)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  int size(CommandPriority priority) const {
+    int size = 0;
+    for (auto &slot : this->slots_) {
+      if (slot.used && slot.command.priority == priority) {
+        size++;
+      }
+    }
+    return size;
+  }
+
+  LatencyStats &get_delay_stats(CommandPriority priority) { return this->delay_[priority]; }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
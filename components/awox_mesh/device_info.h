@@ -3,6 +3,8 @@
 #include <string>
 #include <map>
 
+#include "light_curve.h"
+
 namespace esphome {
 namespace awox_mesh {
 
@@ -38,6 +40,7 @@ class DeviceInfo {
   const char *manufacturer;
   const char *icon;
   std::map<int, bool> features;
+  const LightCurve *curve = nullptr;
 
   void add_feature(int feature) { features[feature] = true; }
 
@@ -59,6 +62,9 @@ class DeviceInfo {
   const char *get_icon() const { return this->icon; }
 
   bool has_feature(int feature) { return features.count(feature) > 0; }
+
+  void set_curve(const LightCurve *curve) { this->curve = curve; }
+  const LightCurve &get_curve() const { return this->curve != nullptr ? *this->curve : default_light_curve(); }
 };
 
 class MeshLightColor : public DeviceInfo {
@@ -112,6 +118,8 @@ class DeviceInfoResolver {
 
   std::map<int, DeviceStruct> devices{};
 
+  std::map<int, const LightCurve *> curves{};
+
   DeviceInfo *create_device_info(int product_id, DeviceStruct device) {
     return this->create_device_info(device.device_type, product_id, device.name, device.model, device.manufacturer,
                                     device.icon);
@@ -144,6 +152,10 @@ class DeviceInfoResolver {
       this->device_info[product_id] = device;
     }
 
+    if (this->curves.count(product_id)) {
+      this->device_info[product_id]->set_curve(this->curves[product_id]);
+    }
+
     return this->device_info[product_id];
   }
 
@@ -287,6 +299,13 @@ class DeviceInfoResolver {
     this->add_device(DEVICE_TYPE_PLUG, 0x8C, "EGLO PLUG", "ESMP-Bm10-UK", MANUFACTURER_EGLO, "mdi:power-socket-uk");
   }
 
+  /**
+   * Dimming curve and mired range of a product, to be set before the first device of the product reports.
+   */
+  void set_curve(int product_id, float gamma, float min_level, int min_mireds, int max_mireds) {
+    this->curves[product_id] = new LightCurve(gamma, min_level, min_mireds, max_mireds);
+  }
+
   DeviceInfo *get_by_product_id(int product_id) {
     if (device_info.count(product_id)) {
       return device_info[product_id];
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace awox_mesh {
+
+/**
+ * Another hub on the same mesh(es), as seen through the cluster topics.
+ */
+struct ClusterPeer {
+  std::string id;
+  /** Availability (last will) topic of the hub */
+  std::string status_topic;
+  std::string status_offline_payload;
+  bool status_online = true;
+  uint32_t last_heartbeat = 0;
+  /** Advert RSSI per node MAC as observed by the hub */
+  std::map<std::string, int> proximity{};
+};
+
+/**
+ * Leader election and split of the command destinations between the hubs of a cluster.
+ * Only bookkeeping, the MQTT side lives in AwoxMesh so this can be driven by anything that delivers the messages.
+ *
+ * A hub is alive while its heartbeats arrive within the timeout and its status topic is not offline.
+ * The alive hub with the lowest id is the leader. A destination belongs to the alive hub that hears the node
+ * strongest, the leader takes the nodes no hub has heard.
+ */
+class HubCluster {
+  bool enabled_ = false;
+  std::string hub_id_;
+  uint32_t timeout_ = 6000;
+
+  std::vector<ClusterPeer> peers_{};
+  std::map<std::string, int> proximity_{};
+
+  std::string leader_;
+
+  bool is_alive_(const ClusterPeer &peer, uint32_t now) const {
+    return peer.status_online && peer.last_heartbeat > 0 && now - peer.last_heartbeat <= this->timeout_;
+  }
+
+ public:
+  /** RSSI change in dB that republishes the proximity of this hub */
+  static constexpr int PROXIMITY_HYSTERESIS = 3;
+
+  void set_hub_id(const std::string &hub_id) {
+    this->enabled_ = true;
+    this->hub_id_ = hub_id;
+    this->leader_ = hub_id;
+  }
+  void set_timeout(uint32_t timeout) { this->timeout_ = timeout; }
+
+  bool is_enabled() const { return this->enabled_; }
+  const std::string &get_hub_id() const { return this->hub_id_; }
+  const std::string &get_leader() const { return this->leader_; }
+  bool is_leader() const { return !this->enabled_ || this->leader_ == this->hub_id_; }
+
+  ClusterPeer *get_peer(const std::string &id) {
+    if (id == this->hub_id_) {
+      return nullptr;
+    }
+    auto found =
+        std::find_if(this->peers_.begin(), this->peers_.end(), [&id](const ClusterPeer &_f) { return _f.id == id; });
+    if (found != this->peers_.end()) {
+      return &*found;
+    }
+    ClusterPeer peer = {};
+    peer.id = id;
+    this->peers_.push_back(peer);
+    return &this->peers_.back();
+  }
+
+  void on_heartbeat(const std::string &id, uint32_t now) {
+    ClusterPeer *peer = this->get_peer(id);
+    if (peer != nullptr) {
+      peer->last_heartbeat = now;
+    }
+  }
+
+  void on_status(const std::string &status_topic, bool online) {
+    for (auto &peer : this->peers_) {
+      if (peer.status_topic == status_topic) {
+        peer.status_online = online;
+      }
+    }
+  }
+
+  /**
+   * Replaces the advert RSSI per node MAC as observed by this hub.
+   * \returns true when the other hubs should be told: a node appeared or disappeared, or its RSSI moved by at least
+   * PROXIMITY_HYSTERESIS dB.
+   */
+  bool update_own_proximity(const std::map<std::string, int> &proximity) {
+    bool changed = proximity.size() != this->proximity_.size();
+    for (auto &node : proximity) {
+      auto found = this->proximity_.find(node.first);
+      if (found == this->proximity_.end() || std::abs(found->second - node.second) >= PROXIMITY_HYSTERESIS) {
+        changed = true;
+      }
+    }
+    if (changed) {
+      this->proximity_ = proximity;
+    }
+    return changed;
+  }
+  const std::map<std::string, int> &get_own_proximity() const { return this->proximity_; }
+
+  /**
+   * Recomputes the leader.
+   * \returns true when the leadership changed.
+   */
+  bool update(uint32_t now) {
+    std::string leader = this->hub_id_;
+    for (auto &peer : this->peers_) {
+      if (this->is_alive_(peer, now) && peer.id < leader) {
+        leader = peer.id;
+      }
+    }
+    if (leader == this->leader_) {
+      return false;
+    }
+    this->leader_ = leader;
+    return true;
+  }
+
+  /**
+   * \param mac : MAC of the destination node, empty when not yet known.
+   * \returns true when this hub sends the commands for the node.
+   */
+  bool is_responsible(const std::string &mac, uint32_t now) const {
+    if (!this->enabled_) {
+      return true;
+    }
+    if (mac.empty()) {
+      return this->is_leader();
+    }
+
+    auto own = this->proximity_.find(mac);
+    std::string best_id = this->hub_id_;
+    int best_rssi = own != this->proximity_.end() ? own->second : -127;
+    for (auto &peer : this->peers_) {
+      if (!this->is_alive_(peer, now)) {
+        continue;
+      }
+      auto found = peer.proximity.find(mac);
+      int rssi = found != peer.proximity.end() ? found->second : -127;
+      if (rssi > best_rssi || (rssi == best_rssi && peer.id < best_id)) {
+        best_id = peer.id;
+        best_rssi = rssi;
+      }
+    }
+    if (best_rssi == -127) {
+      // Not heard by any hub
+      return this->is_leader();
+    }
+    return best_id == this->hub_id_;
+  }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
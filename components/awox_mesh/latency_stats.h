@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+namespace esphome {
+namespace awox_mesh {
+
+/**
+ * Keeps the last samples of a latency (in ms) to report percentiles over.
+ */
+class LatencyStats {
+  static constexpr int SAMPLES = 64;
+
+  uint32_t samples_[SAMPLES];
+  int count_ = 0;
+  int next_ = 0;
+  uint32_t max_ = 0;
+
+ public:
+  void add(uint32_t value) {
+    this->samples_[this->next_] = value;
+    this->next_ = (this->next_ + 1) % SAMPLES;
+    this->count_ = std::min(this->count_ + 1, SAMPLES);
+    this->max_ = std::max(this->max_, value);
+  }
+
+  int count() const { return this->count_; }
+
+  /** Largest sample since the last reset, not limited to the kept samples. */
+  uint32_t max() const { return this->max_; }
+
+  /**
+   * \param p : percentile between 0 and 100.
+   * \returns the percentile over the kept samples, 0 when there are none.
+   */
+  uint32_t percentile(int p) const {
+    if (this->count_ == 0) {
+      return 0;
+    }
+    uint32_t sorted[SAMPLES];
+    std::copy(this->samples_, this->samples_ + this->count_, sorted);
+    int index = std::min((this->count_ * p) / 100, this->count_ - 1);
+    std::nth_element(sorted, sorted + index, sorted + this->count_);
+    return sorted[index];
+  }
+
+  void reset() {
+    this->count_ = 0;
+    this->next_ = 0;
+    this->max_ = 0;
+  }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <map>
+
+#include "command_scheduler.h"
+#include "latency_stats.h"
+
+namespace esphome {
+namespace awox_mesh {
+
+enum TraceStage {
+  /** Command received on MQTT until its packets are queued */
+  TRACE_STAGE_RECEIVE = 0,
+  /** Waiting in the command queue */
+  TRACE_STAGE_QUEUE = 1,
+  /** Dequeued until written to the node */
+  TRACE_STAGE_WRITE = 2,
+  /** Written until the first status report of the destination */
+  TRACE_STAGE_REPORT = 3,
+  /** Received until the first status report of the destination */
+  TRACE_STAGE_TOTAL = 4,
+};
+
+#define TRACE_STAGE_COUNT 5
+
+/**
+ * Follows commands from MQTT to the first status report of their destination.
+ * Written packets are tracked by their packet counter until the destination reports, the durations of the stages end
+ * up in latency statistics per stage and the end to end latency per destination.
+ */
+class LatencyTracer {
+  static constexpr int MAX_PENDING = 16;
+  static constexpr uint32_t REPORT_TIMEOUT = 10000;
+
+  struct PendingTrace {
+    int packet_count;
+    int dest;
+    uint32_t received_at;
+    uint32_t queued_at;
+    uint32_t dequeued_at;
+    uint32_t written_at;
+  };
+
+  std::deque<PendingTrace> pending_{};
+  LatencyStats stages_[TRACE_STAGE_COUNT];
+  std::map<int, LatencyStats> destinations_{};
+  uint32_t unconfirmed_ = 0;
+
+  /**
+   * Traced packets and the ones that stayed unconfirmed, written in the first minutes after boot and later.
+   * Stale packet counters after a restart show up as a higher loss right after boot.
+   */
+  static constexpr uint32_t AFTER_BOOT = 600000;
+  uint32_t written_[2] = {0, 0};
+  uint32_t lost_[2] = {0, 0};
+
+  static int phase_(uint32_t written_at) { return written_at < AFTER_BOOT ? 0 : 1; }
+
+  void lost_trace_(const PendingTrace &trace) {
+    this->unconfirmed_++;
+    this->lost_[phase_(trace.written_at)]++;
+  }
+
+ public:
+  /**
+   * A traced command is written to the node.
+   * \param packet_count : packet counter the command was sent with.
+   */
+  void written(const QueuedCommand &command, int packet_count, uint32_t dequeued_at, uint32_t now) {
+    if (command.received_at == 0) {
+      return;
+    }
+    if (this->pending_.size() >= MAX_PENDING) {
+      this->lost_trace_(this->pending_.front());
+      this->pending_.pop_front();
+    }
+    this->written_[phase_(now)]++;
+    this->pending_.push_back(
+        {packet_count, command.dest, command.received_at, command.queued_at, dequeued_at, now});
+  }
+
+  /**
+   * Unsolicited status report of a device, completes the traces of the packets written to it (or broadcast) before
+   * the report arrived. Replies to status requests are left out by the caller, they do not tell when a command took
+   * effect.
+   * \param received_at : time the notification was received.
+   */
+  void reported(int mesh_id, uint32_t received_at) {
+    for (auto it = this->pending_.begin(); it != this->pending_.end();) {
+      if ((it->dest != mesh_id && it->dest != 0xffff) || static_cast<int32_t>(received_at - it->written_at) <= 0) {
+        it++;
+        continue;
+      }
+      this->stages_[TRACE_STAGE_RECEIVE].add(it->queued_at - it->received_at);
+      this->stages_[TRACE_STAGE_QUEUE].add(it->dequeued_at - it->queued_at);
+      this->stages_[TRACE_STAGE_WRITE].add(it->written_at - it->dequeued_at);
+      this->stages_[TRACE_STAGE_REPORT].add(received_at - it->written_at);
+      this->stages_[TRACE_STAGE_TOTAL].add(received_at - it->received_at);
+      this->destinations_[it->dest].add(received_at - it->received_at);
+      it = this->pending_.erase(it);
+    }
+  }
+
+  /**
+   * Drops the traces of which the destination did not report in time.
+   * \param on_lost : called with the destination and packet counter of every dropped trace.
+   */
+  template<typename Callback> void expire(uint32_t now, Callback on_lost) {
+    while (!this->pending_.empty() && now - this->pending_.front().written_at > REPORT_TIMEOUT) {
+      on_lost(this->pending_.front().dest, this->pending_.front().packet_count);
+      this->lost_trace_(this->pending_.front());
+      this->pending_.pop_front();
+    }
+  }
+
+  /** Drops all traces, reports from a new connection do not belong to them. */
+  void clear() {
+    this->unconfirmed_ += this->pending_.size();
+    // Cut off by the disconnect, not lost by the mesh
+    for (auto &trace : this->pending_) {
+      this->written_[phase_(trace.written_at)]--;
+    }
+    this->pending_.clear();
+  }
+
+  LatencyStats &get_stage_stats(TraceStage stage) { return this->stages_[stage]; }
+
+  std::map<int, LatencyStats> &get_destination_stats() { return this->destinations_; }
+
+  /** Traced packets without a status report of their destination. */
+  uint32_t get_unconfirmed() const { return this->unconfirmed_; }
+
+  /**
+   * \param after_boot : the first 10 minutes after boot, or the time after.
+   */
+  uint32_t get_written(bool after_boot) const { return this->written_[after_boot ? 0 : 1]; }
+  uint32_t get_lost(bool after_boot) const { return this->lost_[after_boot ? 0 : 1]; }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace awox_mesh {
+
+/** Device ranges of the light attributes */
+#define WHITE_BRIGHTNESS_MIN 1
+#define WHITE_BRIGHTNESS_MAX 0x7f
+#define COLOR_BRIGHTNESS_MIN 0xa
+#define COLOR_BRIGHTNESS_MAX 0x64
+#define TEMPERATURE_MIN 0
+#define TEMPERATURE_MAX 0x7f
+#define DEFAULT_MIN_MIREDS 153
+#define DEFAULT_MAX_MIREDS 370
+
+/**
+ * Linear mapping of one range onto another, rounded to the nearest value, computed at compile time.
+ */
+template<int FROM_MIN, int FROM_MAX, int TO_MIN, int TO_MAX> struct RangeTable {
+  uint16_t values[FROM_MAX - FROM_MIN + 1];
+
+  constexpr RangeTable() : values() {
+    for (int i = 0; i <= FROM_MAX - FROM_MIN; i++) {
+      this->values[i] = TO_MIN + (2 * i * (TO_MAX - TO_MIN) + (FROM_MAX - FROM_MIN)) / (2 * (FROM_MAX - FROM_MIN));
+    }
+  }
+};
+
+static constexpr RangeTable<0, 255, WHITE_BRIGHTNESS_MIN, WHITE_BRIGHTNESS_MAX> WHITE_FROM_BRIGHTNESS{};
+static constexpr RangeTable<0, 255, COLOR_BRIGHTNESS_MIN, COLOR_BRIGHTNESS_MAX> COLOR_FROM_BRIGHTNESS{};
+static constexpr RangeTable<WHITE_BRIGHTNESS_MIN, WHITE_BRIGHTNESS_MAX, 0, 255> BRIGHTNESS_FROM_WHITE{};
+static constexpr RangeTable<COLOR_BRIGHTNESS_MIN, COLOR_BRIGHTNESS_MAX, 0, 255> BRIGHTNESS_FROM_COLOR{};
+static constexpr RangeTable<DEFAULT_MIN_MIREDS, DEFAULT_MAX_MIREDS, TEMPERATURE_MIN, TEMPERATURE_MAX>
+    TEMPERATURE_FROM_MIREDS{};
+static constexpr RangeTable<TEMPERATURE_MIN, TEMPERATURE_MAX, DEFAULT_MIN_MIREDS, DEFAULT_MAX_MIREDS>
+    MIREDS_FROM_TEMPERATURE{};
+
+/**
+ * Conversions between the Home Assistant values (brightness 0-255, mireds) and the device ranges of a product.
+ * The default curve uses the compile time tables, a product with its own gamma, minimum level or mired range gets
+ * tables computed once when the curve is created. Either way a conversion is a single table index.
+ */
+class LightCurve {
+  const uint16_t *white_from_brightness_ = WHITE_FROM_BRIGHTNESS.values;
+  const uint16_t *color_from_brightness_ = COLOR_FROM_BRIGHTNESS.values;
+  const uint16_t *brightness_from_white_ = BRIGHTNESS_FROM_WHITE.values;
+  const uint16_t *brightness_from_color_ = BRIGHTNESS_FROM_COLOR.values;
+  const uint16_t *temperature_from_mireds_ = TEMPERATURE_FROM_MIREDS.values;
+  const uint16_t *mireds_from_temperature_ = MIREDS_FROM_TEMPERATURE.values;
+
+  int min_mireds_ = DEFAULT_MIN_MIREDS;
+  int max_mireds_ = DEFAULT_MAX_MIREDS;
+
+  std::vector<uint16_t> tables_{};
+
+  /**
+   * Appends the brightness tables of one channel: 256 device levels followed by the brightness per device level.
+   */
+  void build_brightness_(float gamma, int min_level, int device_min, int device_max) {
+    for (int i = 0; i <= 255; i++) {
+      float level = min_level + (device_max - min_level) * powf(i / 255.0f, gamma);
+      this->tables_.push_back(std::max(device_min, std::min((int) roundf(level), device_max)));
+    }
+    for (int level = device_min; level <= device_max; level++) {
+      float normalized = std::max(level - min_level, 0) / (float) (device_max - min_level);
+      this->tables_.push_back(std::min((int) roundf(255 * powf(normalized, 1.0f / gamma)), 255));
+    }
+  }
+
+ public:
+  LightCurve() = default;
+
+  /**
+   * \param gamma : exponent applied to the brightness, above 1 gives more resolution at the low end.
+   * \param min_level : fraction (0-1) of the device range the lowest brightness maps to.
+   */
+  LightCurve(float gamma, float min_level, int min_mireds, int max_mireds)
+      : min_mireds_(min_mireds), max_mireds_(max_mireds) {
+    int white_min = WHITE_BRIGHTNESS_MIN + (int) roundf(min_level * (WHITE_BRIGHTNESS_MAX - WHITE_BRIGHTNESS_MIN));
+    int color_min = COLOR_BRIGHTNESS_MIN + (int) roundf(min_level * (COLOR_BRIGHTNESS_MAX - COLOR_BRIGHTNESS_MIN));
+    this->build_brightness_(gamma, white_min, WHITE_BRIGHTNESS_MIN, WHITE_BRIGHTNESS_MAX);
+    this->build_brightness_(gamma, color_min, COLOR_BRIGHTNESS_MIN, COLOR_BRIGHTNESS_MAX);
+    int mireds_offset = this->tables_.size();
+    for (int mireds = min_mireds; mireds <= max_mireds; mireds++) {
+      this->tables_.push_back(TEMPERATURE_MIN + (2 * (mireds - min_mireds) * (TEMPERATURE_MAX - TEMPERATURE_MIN) +
+                                                 (max_mireds - min_mireds)) /
+                                                    (2 * (max_mireds - min_mireds)));
+    }
+    for (int temperature = TEMPERATURE_MIN; temperature <= TEMPERATURE_MAX; temperature++) {
+      this->tables_.push_back(min_mireds + (2 * temperature * (max_mireds - min_mireds) + TEMPERATURE_MAX) /
+                                               (2 * TEMPERATURE_MAX));
+    }
+
+    // Pointers last, the vector does not move anymore
+    const uint16_t *table = this->tables_.data();
+    this->white_from_brightness_ = table;
+    this->brightness_from_white_ = table + 256;
+    this->color_from_brightness_ = this->brightness_from_white_ + (WHITE_BRIGHTNESS_MAX - WHITE_BRIGHTNESS_MIN + 1);
+    this->brightness_from_color_ = this->color_from_brightness_ + 256;
+    this->temperature_from_mireds_ = table + mireds_offset;
+    this->mireds_from_temperature_ = this->temperature_from_mireds_ + (max_mireds - min_mireds + 1);
+  }
+
+  LightCurve(const LightCurve &) = delete;
+  LightCurve &operator=(const LightCurve &) = delete;
+
+  int get_min_mireds() const { return this->min_mireds_; }
+  int get_max_mireds() const { return this->max_mireds_; }
+
+  uint8_t white_from_brightness(int brightness) const {
+    return this->white_from_brightness_[std::max(0, std::min(brightness, 255))];
+  }
+  uint8_t color_from_brightness(int brightness) const {
+    return this->color_from_brightness_[std::max(0, std::min(brightness, 255))];
+  }
+  int brightness_from_white(int level) const {
+    return this->brightness_from_white_[std::max(WHITE_BRIGHTNESS_MIN, std::min(level, WHITE_BRIGHTNESS_MAX)) -
+                                        WHITE_BRIGHTNESS_MIN];
+  }
+  int brightness_from_color(int level) const {
+    return this->brightness_from_color_[std::max(COLOR_BRIGHTNESS_MIN, std::min(level, COLOR_BRIGHTNESS_MAX)) -
+                                        COLOR_BRIGHTNESS_MIN];
+  }
+  uint8_t temperature_from_mireds(int mireds) const {
+    return this->temperature_from_mireds_[std::max(this->min_mireds_, std::min(mireds, this->max_mireds_)) -
+                                          this->min_mireds_];
+  }
+  int mireds_from_temperature(int temperature) const {
+    return this->mireds_from_temperature_[std::max(TEMPERATURE_MIN, std::min(temperature, TEMPERATURE_MAX))];
+  }
+};
+
+/** Linear curve over the full device ranges, used by products without a curve of their own */
+static const LightCurve &default_light_curve() {
+  static const LightCurve curve;
+  return curve;
+}
+
+}  // namespace awox_mesh
+}  // namespace esphome
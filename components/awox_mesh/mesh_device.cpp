@@ -5,12 +5,12 @@
 #include <math.h>
 #include "mesh_device.h"
 #include "device_info.h"
-#include <AES.h>
-#include <Crypto.h>
-#include <GCM.h>
+#include "mesh_protocol.h"
+#include "profiler.h"
 #include "esphome/core/application.h"
 #include "esphome/core/hal.h"
 #include "esphome/core/helpers.h"
+#include "esphome/components/json/json_util.h"
 #include "esphome/components/mqtt/mqtt_const.h"
 #include "esphome/components/mqtt/mqtt_component.h"
 
@@ -19,34 +19,14 @@ namespace awox_mesh {
 
 static const char *const TAG = "mesh_device";
 
-/** \fn static std::string encrypt(std::string key, std::string data)
- *  \brief Encrypts a n x 16-byte data string with a 16-byte key, using AES encryption.
- *  \param key : 16-byte encryption key.
- *  \param data : n x 16-byte data string
- *  \returns the encrypted data string.
- */
-static std::string encrypt(std::string key, std::string data) {
-  // ESP_LOGD(TAG, "encrypt [key: %s, data: %s] data length [%d]", TextToBinaryString(key).c_str(),
-  //          TextToBinaryString(data).c_str(), data.size());
+static const esp32_ble_tracker::ESPBTUUID INFO_SERVICE_UUID = esp32_ble_tracker::ESPBTUUID::from_raw(uuid_info_service);
+static const esp32_ble_tracker::ESPBTUUID NOTIFICATION_CHAR_UUID =
+    esp32_ble_tracker::ESPBTUUID::from_raw(uuid_notification_char);
+static const esp32_ble_tracker::ESPBTUUID COMMAND_CHAR_UUID = esp32_ble_tracker::ESPBTUUID::from_raw(uuid_command_char);
+static const esp32_ble_tracker::ESPBTUUID PAIR_CHAR_UUID = esp32_ble_tracker::ESPBTUUID::from_raw(uuid_pair_char);
 
-  std::reverse(key.begin(), key.end());
-  std::reverse(data.begin(), data.end());
-
-  unsigned char buffer[16];
-  auto aes128 = AES128();
-
-  if (!aes128.setKey((uint8_t *) key.c_str(), key.size())) {
-    ESP_LOGE(TAG, "Failed to set key");
-  };
-  aes128.encryptBlock(buffer, (uint8_t *) data.c_str());
-
-  std::string result = std::string((char *) buffer, 16);
-
-  std::reverse(result.begin(), result.end());
-  // ESP_LOGD(TAG, "encrypted [%s]", TextToBinaryString(result).c_str());
-
-  return result;
-}
+/** Notifications the protocol engine handles in one go */
+static const int NOTIFICATION_BATCH = 16;
 
 static std::string int_as_hex_string(unsigned char hex1, unsigned char hex2, unsigned char hex3) {
   char value[6];
@@ -74,11 +54,54 @@ static std::string get_device_mac(unsigned char part3, unsigned char part4, unsi
   return std::string((char *) value, 17);
 }
 
-static int convert_value_to_available_range(int value, int min_from, int max_from, int min_to, int max_to) {
-  float normalized = (float) (value - min_from) / (float) (max_from - min_from);
-  int new_value = std::min((int) round((normalized * (float) (max_to - min_to)) + min_to), max_to);
+/** Curve of the product, the default one while the MAC report (with the product id) is not yet received */
+static const LightCurve &get_light_curve(const Device *device) {
+  return device->device_info != nullptr ? device->device_info->get_curve() : default_light_curve();
+}
+
+static bool is_light_command(int command) {
+  return command == C_POWER || command == C_COLOR || command == C_COLOR_BRIGHTNESS || command == C_WHITE_BRIGHTNESS ||
+         command == C_WHITE_TEMPERATURE || command == C_SEQUENCE_FADE_DURATION;
+}
+
+static uint32_t desired_retry_delay(int attempts) { return 2000 << std::min(attempts, 4); }
+
+void MeshDevice::setup() {
+  esp32_ble_client::BLEClientBase::setup();
+
+  this->restore_packet_count();
+
+  if (this->use_protocol_task) {
+    // ESPHome runs loop() on core 1, the protocol engine on core 0
+    if (xTaskCreatePinnedToCore(MeshDevice::protocol_task, "awox_mesh", 4096, this, 5, &this->protocol_task_handle,
+                                0) != pdPASS) {
+      ESP_LOGE(TAG, "Failed to start protocol task, decoding in loop");
+      this->protocol_task_handle = nullptr;
+      this->use_protocol_task = false;
+    }
+  }
+
+  global_mqtt_client->subscribe_json(
+      this->get_topic_prefix_() + "/mesh/batch_command",
+      [this](const std::string &topic, JsonObject root) { this->process_batch_command(root); });
+
+  if (this->packet_trace.is_enabled()) {
+    global_mqtt_client->subscribe(this->get_topic_prefix_() + "/mesh/trace/dump",
+                                  [this](const std::string &topic, const std::string &payload) {
+                                    if (payload == "dump") {
+                                      this->publish_packet_trace();
+                                    } else if (payload == "clear") {
+                                      this->packet_trace.clear();
+                                    } else {
+                                      ESP_LOGW(TAG, "Unknown packet trace request '%s'", payload.c_str());
+                                    }
+                                  });
+  }
 
-  return std::max(new_value, min_to);
+  this->set_interval("queue_diagnostics", 60000, [this]() {
+    this->publish_queue_diagnostics();
+    this->publish_latency_diagnostics();
+  });
 }
 
 void MeshDevice::on_shutdown() {
@@ -92,18 +115,92 @@ void MeshDevice::on_shutdown() {
 void MeshDevice::loop() {
   esp32_ble_client::BLEClientBase::loop();
 
-  if (this->connected() && !this->command_queue.empty() && this->last_send_command < esphome::millis() - 180) {
+  if (this->disconnected.exchange(false)) {
+    this->reset_session();
+  }
+
+  // Set after the session, so a session established here is also copied below
+  const bool established = this->session_established.exchange(false);
+  if (this->session_changed.exchange(false)) {
+    std::lock_guard<std::mutex> lock(this->session_lock);
+    this->session_key = this->shared_session_key;
+    this->reverse_address = this->shared_reverse_address;
+  }
+  if (established) {
+    this->request_status();
+  }
+  this->metrics.connects = this->connects.load();
+
+  this->process_notifications();
+
+  this->update_connection_parameters();
+
+  if (this->connection_parameters_updated.exchange(false)) {
+    this->publish_connection_diagnostics();
+  }
+
+  if (this->connected() && !this->session_key.empty() && esphome::millis() - this->last_rssi_request > 5000) {
+    this->last_rssi_request = esphome::millis();
+    esp_ble_gap_read_rssi(this->get_remote_bda());
+  }
+
+  // Nothing stale is sent after an outage, expired light commands are resent from the desired state
+  this->command_queue.expire(esphome::millis(),
+                             [this](const QueuedCommand &item) { this->report_dropped_command(item, "expired"); });
+
+  QueuedCommand item;
+  if (this->connected() && !this->session_key.empty() && esphome::millis() - this->last_send_command > 180 &&
+      this->command_queue.pop(esphome::millis(), item)) {
     ESP_LOGV(TAG, "Send command, time since last command: %d", esphome::millis() - this->last_send_command);
     this->last_send_command = esphome::millis();
-    QueuedCommand item = this->command_queue.front();
-    ESP_LOGV(TAG, "Send command %d, for dest: %d", item.command, item.dest);
-    this->command_queue.pop_front();
+    ESP_LOGV(TAG, "Send command %d, for dest: %d, priority: %d", item.command, item.dest, item.priority);
     ESP_LOGV(TAG, "remove item from queue");
-    this->write_command(item.command, item.data, item.dest, false);
+    int packet_count = this->packet_count;
+    if (this->write_command(item.command, item.get_data(), item.dest, false)) {
+      this->metrics.commands_sent++;
+      this->latency_tracer.written(item, packet_count, this->last_send_command, esphome::millis());
+      if (item.command == C_REQUEST_STATUS && item.dest != 0xffff) {
+        this->status_poller.sent(item.dest, esphome::millis());
+      }
+    } else if (item.command == C_REQUEST_STATUS) {
+      this->status_poller.dropped(item.dest);
+    }
+    if (is_light_command(item.command)) {
+      for (auto *device : this->devices_) {
+        if ((item.dest == 0xffff || item.dest == device->mesh_id) && !device->desired.is_empty()) {
+          device->desired_sent_at = this->last_send_command;
+        }
+      }
+    }
+    if (item.command == C_SEQUENCE_FADE_DURATION) {
+      uint32_t duration = static_cast<unsigned char>(item.data[0]) | (static_cast<unsigned char>(item.data[1]) << 8) |
+                          (static_cast<unsigned char>(item.data[2]) << 16) |
+                          (static_cast<unsigned char>(item.data[3]) << 24);
+      for (auto *device : this->devices_) {
+        if (item.dest == 0xffff || item.dest == device->mesh_id) {
+          device->fade_duration = duration;
+        }
+      }
+    }
+    if (item.received_at > 0) {
+      this->receive_to_send.add(esphome::millis() - item.received_at);
+    }
+  }
+
+  this->latency_tracer.expire(esphome::millis(), [](int dest, int packet_count) {
+    ESP_LOGD(TAG, "[%d] No status report after packet %04X", dest, packet_count);
+  });
+
+  if (!this->dropped_commands.empty() && esphome::millis() - this->last_dropped_publish > 1000) {
+    this->publish_dropped_commands();
+  }
+
+  if (this->connected() && !this->session_key.empty()) {
+    this->step_hub_transitions();
   }
 
   while (!this->delayed_availability_publish.empty()) {
-    if (this->delayed_availability_publish.front().time > esphome::millis() - 3000) {
+    if (esphome::millis() - this->delayed_availability_publish.front().time < 3000) {
       break;
     }
 
@@ -117,9 +214,51 @@ void MeshDevice::loop() {
     }
   }
 
+  if (this->status_sweep_started > 0 &&
+      (esphome::millis() - this->last_status_report > 1500 || esphome::millis() - this->status_sweep_started > 10000)) {
+    ESP_LOGD(TAG, "Status sweep finished after %d ms", esphome::millis() - this->status_sweep_started);
+    if (this->last_status_report == this->status_sweep_started) {
+      ESP_LOGW(TAG, "No reply to status request");
+      this->unanswered_status_sweeps++;
+    } else {
+      this->unanswered_status_sweeps = 0;
+    }
+    this->status_sweep_started = 0;
+    if (this->state_snapshot.is_enabled()) {
+      this->publish_state_snapshot();
+    }
+  } else if (this->state_snapshot.is_due(esphome::millis())) {
+    this->publish_state_snapshot();
+  }
+
+  for (auto *device : this->devices_) {
+    if (device->desired.is_empty() || this->session_key.empty() || this->status_sweep_started > 0 ||
+        this->has_queued_light_command(device->mesh_id) || !this->is_responsible(device)) {
+      continue;
+    }
+    if (device->desired_sent_at == 0) {
+      ESP_LOGD(TAG, "[%d] Resend unconfirmed state", device->mesh_id);
+      this->reconcile(device, PRIORITY_AUTOMATION);
+    } else if (esphome::millis() - device->desired_sent_at > desired_retry_delay(device->desired_attempts)) {
+      if (device->desired_attempts >= 5) {
+        ESP_LOGW(TAG, "[%d] State not confirmed after %d attempts, giving up", device->mesh_id,
+                 device->desired_attempts);
+        device->desired = {};
+        this->publish_state(device);
+        continue;
+      }
+      ESP_LOGD(TAG, "[%d] State not confirmed, retry %d", device->mesh_id, device->desired_attempts);
+      this->reconcile(device, PRIORITY_AUTOMATION);
+    }
+  }
+
+  if (this->connected() && !this->session_key.empty()) {
+    this->poll_status();
+  }
+
   for (auto *device : this->devices_) {
     if (!device->send_discovery && device->device_info_requested > 0 &&
-        device->device_info_requested < esphome::millis() - 5000) {
+        esphome::millis() - device->device_info_requested > 5000) {
       ESP_LOGD(TAG, "Request info again for %d", device->mesh_id);
       this->request_device_info(device);
     }
@@ -143,10 +282,24 @@ bool MeshDevice::gattc_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t g
       if (param->disconnect.reason > 0) {
         this->set_address(0);
       }
+      {
+        std::lock_guard<std::mutex> lock(this->session_lock);
+        this->shared_session_key.clear();
+      }
+      this->session_changed.store(true);
+      this->protocol_engine.set_session("", "");
+      // The rest is owned by loop(), this callback may run in the BLE task
+      this->disconnected.store(true);
       break;
     }
     case ESP_GATTC_SEARCH_CMPL_EVT:
     case ESP_GATTC_OPEN_EVT: {
+      if (event == ESP_GATTC_OPEN_EVT) {
+        this->connect_timing.open = esphome::millis();
+        if (param->open.status == ESP_GATT_OK) {
+          this->connects++;
+        }
+      }
       if (this->state_ == esp32_ble_tracker::ClientState::ESTABLISHED) {
         ESP_LOGI(TAG, "Connected....");
         this->setup_connection();
@@ -159,15 +312,23 @@ bool MeshDevice::gattc_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t g
         ESP_LOGW(TAG, "Notification received from different connection, skipped");
         break;
       }
-      if (param->notify.handle != this->notification_char->handle) {
+      if (param->notify.handle != this->handles.notification) {
         ESP_LOGW(TAG, "Unknown notification received from handle %d: %s", param->notify.handle,
                  TextToBinaryString(std::string((char *) param->notify.value, param->notify.value_len)).c_str());
         break;
       }
-      std::string notification = std::string((char *) param->notify.value, param->notify.value_len);
-      std::string packet = this->decrypt_packet(notification);
-      ESP_LOGV(TAG, "Notification received: %s", TextToBinaryString(packet).c_str());
-      this->handle_packet(packet);
+      this->protocol_engine.push_notification(param->notify.value, param->notify.value_len, esphome::millis());
+      if (this->protocol_task_handle != nullptr) {
+        xTaskNotifyGive(this->protocol_task_handle);
+      }
+      break;
+    }
+
+    case ESP_GATTC_REG_FOR_NOTIFY_EVT: {
+      if (param->reg_for_notify.handle == this->handles.notification &&
+          param->reg_for_notify.status == ESP_GATT_OK) {
+        this->connect_timing.notify = esphome::millis();
+      }
       break;
     }
 
@@ -178,16 +339,18 @@ bool MeshDevice::gattc_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t g
         ESP_LOGW(TAG, "Error reading char at handle %d, status=%d", param->read.handle, param->read.status);
         break;
       }
-      if (param->read.handle == this->pair_char->handle) {
+      if (param->read.handle == this->handles.pair) {
         if (param->read.value[0] == 0xd) {
           ESP_LOGI(TAG, "Response OK, let go");
-          this->generate_session_key(this->random_key,
-                                     std::string((char *) param->read.value, param->read.value_len).substr(1, 9));
+          this->connect_timing.pair = esphome::millis();
+          std::string session_key = this->generate_session_key(
+              this->random_key, std::string((char *) param->read.value, param->read.value_len).substr(1, 9));
 
           ESP_LOGI(TAG, "[%d] [%s] session key %s", this->get_conn_id(), this->address_str_.c_str(),
-                   TextToBinaryString(this->session_key).c_str());
+                   TextToBinaryString(session_key).c_str());
 
-          this->request_status();
+          // The status request writes a packet, that is up to loop()
+          this->session_established.store(true);
 
           break;
         } else if (param->read.value[0] == 0xe) {
@@ -199,6 +362,7 @@ bool MeshDevice::gattc_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t g
 
         ESP_LOGI(TAG, "[%d] [%s] response %s", this->get_conn_id(), this->address_str_.c_str(),
                  TextToBinaryString(std::string((char *) param->read.value, param->read.value_len)).c_str());
+        this->node_handles.erase(this->address_);
         this->disconnect();
         this->set_address(0);
       }
@@ -209,207 +373,354 @@ bool MeshDevice::gattc_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t g
   return true;
 }
 
-void MeshDevice::setup_connection() {
-  this->notification_char = this->get_characteristic(esp32_ble_tracker::ESPBTUUID::from_raw(uuid_info_service),
-                                                     esp32_ble_tracker::ESPBTUUID::from_raw(uuid_notification_char));
-  this->command_char = this->get_characteristic(esp32_ble_tracker::ESPBTUUID::from_raw(uuid_info_service),
-                                                esp32_ble_tracker::ESPBTUUID::from_raw(uuid_command_char));
-  this->pair_char = this->get_characteristic(esp32_ble_tracker::ESPBTUUID::from_raw(uuid_info_service),
-                                             esp32_ble_tracker::ESPBTUUID::from_raw(uuid_pair_char));
+void MeshDevice::gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) {
+  esp32_ble_client::BLEClientBase::gap_event_handler(event, param);
 
-  unsigned char key[8];
-  esp_fill_random(key, 8);
-  this->random_key = std::string((char *) key).substr(0, 8);
-  std::string enc_data = this->key_encrypt(this->random_key);
-  std::string packet = '\x0c' + this->random_key + enc_data.substr(0, 8);
-  this->pair_char->write_value((uint8_t *) packet.data(), packet.size());
+  switch (event) {
+    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT: {
+      if (memcmp(param->update_conn_params.bda, this->get_remote_bda(), 6) != 0) {
+        break;
+      }
+      if (param->update_conn_params.status != ESP_BT_STATUS_SUCCESS) {
+        ESP_LOGW(TAG, "[%d] [%s] Connection parameter update failed, status=%d", this->get_conn_id(),
+                 this->address_str_.c_str(), param->update_conn_params.status);
+        break;
+      }
+      this->negotiated_interval = param->update_conn_params.conn_int;
+      this->negotiated_latency = param->update_conn_params.latency;
+      this->negotiated_timeout = param->update_conn_params.timeout;
+      ESP_LOGI(TAG, "[%d] [%s] Connection parameters: interval %.2f ms, latency %d, timeout %d ms",
+               this->get_conn_id(), this->address_str_.c_str(), this->negotiated_interval * 1.25f,
+               this->negotiated_latency, this->negotiated_timeout * 10);
+      // Published from loop(), this callback may run in the BLE task
+      this->connection_parameters_updated.store(true);
+      break;
+    }
+    case ESP_GAP_BLE_READ_RSSI_COMPLETE_EVT: {
+      if (memcmp(param->read_rssi_cmpl.remote_addr, this->get_remote_bda(), 6) != 0 ||
+          param->read_rssi_cmpl.status != ESP_BT_STATUS_SUCCESS) {
+        break;
+      }
+      this->link_rssi = param->read_rssi_cmpl.rssi;
+      ESP_LOGV(TAG, "[%d] [%s] RSSI %d dB", this->get_conn_id(), this->address_str_.c_str(),
+               param->read_rssi_cmpl.rssi);
+      break;
+    }
+    default:
+      break;
+  }
+}
 
-  esp_err_t status = esp_ble_gattc_read_char(this->get_gattc_if(), this->get_conn_id(), this->pair_char->handle,
-                                             ESP_GATT_AUTH_REQ_NONE);
+void MeshDevice::reset_session() {
+  this->conn_params_mode = -1;
+  this->link_rssi = 0;
+  this->consecutive_write_failures = 0;
+  this->unanswered_status_sweeps = 0;
+  this->latency_tracer.clear();
+  this->status_poller.clear();
 
-  if (status != ESP_OK) {
-    ESP_LOGW(TAG, "[%d] [%s] esp_ble_gattc_read_char failed, error=%d", this->get_conn_id(), this->address_str_.c_str(),
-             status);
+  // Queued light packets are stale after a reconnect, the desired state is resent instead
+  this->command_queue.remove_if([](const QueuedCommand &_f) { return is_light_command(_f.command); });
+  for (auto *device : this->devices_) {
+    device->desired_sent_at = 0;
+    device->desired_attempts = 0;
   }
+}
 
-  ESP_LOGD(TAG, "Listen for notifications");
-  status =
-      esp_ble_gattc_register_for_notify(this->get_gattc_if(), this->get_remote_bda(), this->notification_char->handle);
-  if (status) {
-    ESP_LOGW(TAG, "[%d] [%s] esp_ble_gattc_register_for_notify failed, status=%d", this->get_conn_id(),
-             this->address_str_.c_str(), status);
+void MeshDevice::update_connection_parameters() {
+  if (!this->conn_params_enabled || !this->connected() || this->session_key.empty()) {
+    return;
   }
-  ESP_LOGD(TAG, "Enable notifications");
-  uint16_t notify_en = 1;
-  this->notification_char->write_value((uint8_t *) &notify_en, sizeof(notify_en));
+
+  const uint32_t now = esphome::millis();
+  if (!this->command_queue.empty() || this->status_sweep_started > 0) {
+    this->last_busy = now;
+  }
+
+  bool fast = now - this->last_busy < this->conn_params_idle_delay;
+  if (this->conn_params_mode == (fast ? 1 : 0) || now - this->conn_params_requested_at < 1000) {
+    return;
+  }
+
+  this->request_connection_parameters(fast);
 }
 
-std::string MeshDevice::combine_name_and_password() const {
-  std::string data;
-  ESP_LOGD(TAG, "combine mesh name + password: %s:%s", this->mesh_name.c_str(), this->mesh_password.c_str());
-  std::string mesh_name = this->mesh_name;
-  std::string mesh_password = this->mesh_password;
-  mesh_name.append(16 - mesh_name.size(), 0);
-  mesh_password.append(16 - mesh_password.size(), 0);
+void MeshDevice::request_connection_parameters(bool fast) {
+  esp_ble_conn_update_params_t params = {};
+  memcpy(params.bda, this->get_remote_bda(), sizeof(esp_bd_addr_t));
+  params.min_int = fast ? this->conn_params_fast_interval : this->conn_params_idle_interval;
+  params.max_int = params.min_int;
+  params.latency = fast ? 0 : this->conn_params_idle_latency;
+  params.timeout = this->conn_params_timeout;
+
+  ESP_LOGD(TAG, "[%d] [%s] Request %s connection interval %.2f ms", this->get_conn_id(), this->address_str_.c_str(),
+           fast ? "fast" : "idle", params.min_int * 1.25f);
+
+  this->conn_params_requested_at = esphome::millis();
+  this->conn_params_mode = fast ? 1 : 0;
 
-  for (int i = 0; i < 16; i++) {
-    data.push_back(mesh_name[i] ^ mesh_password[i]);
+  esp_err_t status = esp_ble_gap_update_conn_params(&params);
+  if (status != ESP_OK) {
+    ESP_LOGW(TAG, "[%d] [%s] esp_ble_gap_update_conn_params failed, error=%d", this->get_conn_id(),
+             this->address_str_.c_str(), status);
   }
+}
 
-  return data;
+void MeshDevice::publish_connection_diagnostics() {
+  global_mqtt_client->publish_json(
+      this->get_topic_prefix_() + "/mesh/diagnostics/connection",
+      [this](JsonObject root) {
+        root["node"] = this->address_str_;
+        root["interval"] = this->negotiated_interval * 1.25f;
+        root["latency"] = this->negotiated_latency;
+        root["timeout"] = this->negotiated_timeout * 10;
+        root["mode"] = this->conn_params_mode == 1 ? "fast" : "idle";
+      },
+      0, true);
 }
 
-void MeshDevice::generate_session_key(const std::string &data1, const std::string &data2) {
-  std::string key = this->combine_name_and_password();
+void MeshDevice::protocol_task(void *arg) {
+  auto *mesh_device = static_cast<MeshDevice *>(arg);
+  while (true) {
+    // Woken up by the notification callback, the timeout is a safety net
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(50));
+    while (mesh_device->protocol_engine.process(NOTIFICATION_BATCH) > 0) {
+    }
+  }
+}
 
-  this->session_key = encrypt(key, data1.substr(0, 8) + data2.substr(0, 8));
+void MeshDevice::process_notifications() {
+  if (this->session_key.empty()) {
+    // Left over from a previous session
+    this->protocol_engine.clear();
+    return;
+  }
+
+  if (!this->use_protocol_task) {
+    // Bounded batch per loop so a burst does not block the rest of the loop
+    this->protocol_engine.process(NOTIFICATION_BATCH);
+  }
+
+  DecodedNotification decoded;
+  while (this->protocol_engine.pop(decoded)) {
+    std::string packet = std::string((char *) decoded.packet.data, decoded.packet.length);
+    ESP_LOGV(TAG, "Notification received: %s", TextToBinaryString(packet).c_str());
+    this->packet_trace.record(TRACE_RX, packet, decoded.packet.received_at);
+    if (decoded.duplicate) {
+      ESP_LOGV(TAG, "[%d] Relayed duplicate dropped", decoded.report.mesh_id);
+      this->metrics.duplicates++;
+      continue;
+    }
+    this->metrics.notifications_decoded++;
+    if (decoded.report.type == REPORT_UNKNOWN) {
+      this->metrics.unknown_reports++;
+      ESP_LOGW(TAG, "Unknown report, dev [%d]: command %02X => %s", decoded.report.mesh_id, decoded.report.opcode,
+               TextToBinaryString(packet).c_str());
+      continue;
+    }
+    this->handle_report(decoded.report, decoded.changed, decoded.packet.received_at);
+  }
+  // Counted by the engine, in the BLE callback or the protocol task
+  this->metrics.notifications_received = this->protocol_engine.get_received();
+  this->metrics.mac_failures = this->protocol_engine.get_mac_failures();
+  this->metrics.failures = this->protocol_engine.get_malformed();
+
+  uint32_t overflows = this->protocol_engine.get_overflows();
+  if (overflows != this->reported_overflows) {
+    ESP_LOGW(TAG, "Notification buffer full, %d notifications dropped (max %d waiting)",
+             overflows - this->reported_overflows, this->protocol_engine.get_high_water_mark());
+    this->reported_overflows = overflows;
+  }
 }
 
-std::string MeshDevice::key_encrypt(std::string &key) const {
-  std::string data = this->combine_name_and_password();
-  std::string result;
-  std::string e_key = key;
-  e_key.append(16 - e_key.size(), 0);
+void MeshDevice::connect() {
+  this->connect_timing = {};
+  this->connect_timing.started = esphome::millis();
+  esp32_ble_client::BLEClientBase::connect();
+}
+
+bool MeshDevice::resolve_handles() {
+  auto cached = this->node_handles.find(this->address_);
+  if (cached != this->node_handles.end()) {
+    ESP_LOGV(TAG, "[%d] [%s] Using cached handles", this->get_conn_id(), this->address_str_.c_str());
+    this->handles = cached->second;
+    return true;
+  }
+
+  auto *notification_char = this->get_characteristic(INFO_SERVICE_UUID, NOTIFICATION_CHAR_UUID);
+  auto *command_char = this->get_characteristic(INFO_SERVICE_UUID, COMMAND_CHAR_UUID);
+  auto *pair_char = this->get_characteristic(INFO_SERVICE_UUID, PAIR_CHAR_UUID);
+  if (notification_char == nullptr || command_char == nullptr || pair_char == nullptr) {
+    return false;
+  }
 
-  return encrypt(e_key, data);
+  this->handles.notification = notification_char->handle;
+  this->handles.command = command_char->handle;
+  this->handles.pair = pair_char->handle;
+  this->node_handles[this->address_] = this->handles;
+  return true;
 }
 
-std::string MeshDevice::encrypt_packet(std::string &packet) const {
-  std::string auth_nonce = this->reverse_address.substr(0, 4) + '\1' + packet.substr(0, 3) + '\x0f';
-  auth_nonce.append(7, 0);
-  std::string authenticator;
+esp_err_t MeshDevice::write_char(uint16_t handle, uint8_t *data, uint16_t length) {
+  return esp_ble_gattc_write_char(this->get_gattc_if(), this->get_conn_id(), handle, length, data,
+                                  ESP_GATT_WRITE_TYPE_NO_RSP, ESP_GATT_AUTH_REQ_NONE);
+}
 
-  authenticator = encrypt(this->session_key, auth_nonce);
+void MeshDevice::setup_connection() {
+  this->connect_timing.services = esphome::millis();
 
-  for (int i = 0; i < 15; i++)
-    authenticator[i] ^= packet[i + 5];
+  if (!this->resolve_handles()) {
+    ESP_LOGE(TAG, "[%d] [%s] Mesh characteristics not found", this->get_conn_id(), this->address_str_.c_str());
+    this->disconnect();
+    this->set_address(0);
+    return;
+  }
 
-  std::string mac;
+  // Notification registration is local to the BLE stack, start it first so it completes while the pair request is
+  // on its way.
+  ESP_LOGD(TAG, "Listen for notifications");
+  esp_err_t status =
+      esp_ble_gattc_register_for_notify(this->get_gattc_if(), this->get_remote_bda(), this->handles.notification);
+  if (status) {
+    ESP_LOGW(TAG, "[%d] [%s] esp_ble_gattc_register_for_notify failed, status=%d", this->get_conn_id(),
+             this->address_str_.c_str(), status);
+  }
 
-  mac = encrypt(this->session_key, authenticator);
+  unsigned char key[8];
+  esp_fill_random(key, 8);
+  this->random_key = std::string((char *) key).substr(0, 8);
+  std::string enc_data = this->key_encrypt(this->random_key);
+  std::string packet = '\x0c' + this->random_key + enc_data.substr(0, 8);
+  this->write_char(this->handles.pair, (uint8_t *) packet.data(), packet.size());
 
-  for (int i = 0; i < 2; i++)
-    packet[i + 3] = mac[i];
+  status = esp_ble_gattc_read_char(this->get_gattc_if(), this->get_conn_id(), this->handles.pair,
+                                   ESP_GATT_AUTH_REQ_NONE);
 
-  std::string iv = '\0' + this->reverse_address.substr(0, 4) + '\1' + packet.substr(0, 3);
-  iv.append(7, 0);
+  if (status != ESP_OK) {
+    ESP_LOGW(TAG, "[%d] [%s] esp_ble_gattc_read_char failed, error=%d", this->get_conn_id(), this->address_str_.c_str(),
+             status);
+  }
 
-  std::string buffer;
-  buffer = encrypt(this->session_key, iv);
+  // Queued behind the pair read, no need to wait for its response
+  ESP_LOGD(TAG, "Enable notifications");
+  uint16_t notify_en = 1;
+  this->write_char(this->handles.notification, (uint8_t *) &notify_en, sizeof(notify_en));
+}
 
-  for (int i = 0; i < 15; i++)
-    packet[i + 5] ^= buffer[i];
+void MeshDevice::publish_connect_timing() {
+  const ConnectTiming &timing = this->connect_timing;
+  auto since_start = [&timing](uint32_t moment) -> int { return moment > 0 ? moment - timing.started : -1; };
 
-  return packet;
+  ESP_LOGI(TAG, "[%d] [%s] Connect timing: open %d ms, services %d ms, pair %d ms, notify %d ms, first status %d ms",
+           this->get_conn_id(), this->address_str_.c_str(), since_start(timing.open), since_start(timing.services),
+           since_start(timing.pair), since_start(timing.notify), since_start(timing.first_status));
+
+  global_mqtt_client->publish_json(
+      this->get_topic_prefix_() + "/mesh/diagnostics/connect",
+      [this, since_start, &timing](JsonObject root) {
+        root["node"] = this->address_str_;
+        root["open"] = since_start(timing.open);
+        root["services"] = since_start(timing.services);
+        root["pair"] = since_start(timing.pair);
+        root["notify"] = since_start(timing.notify);
+        root["first_status"] = since_start(timing.first_status);
+      },
+      0, true);
 }
 
-std::string MeshDevice::decrypt_packet(std::string &packet) const {
-  std::string iv = '\0' + this->reverse_address.substr(0, 3) + packet.substr(0, 5);
-  iv.append(7, 0);
+std::string MeshDevice::combine_name_and_password() const {
+  ESP_LOGD(TAG, "combine mesh name + password: %s:%s", this->mesh_name.c_str(), this->mesh_password.c_str());
+  return awox_mesh::combine_name_and_password(this->mesh_name, this->mesh_password);
+}
 
-  std::string result;
+std::string MeshDevice::generate_session_key(const std::string &data1, const std::string &data2) {
+  std::string session_key = awox_mesh::generate_session_key(this->mesh_name, this->mesh_password, data1, data2);
 
-  result = encrypt(this->session_key, iv);
+  std::lock_guard<std::mutex> lock(this->session_lock);
+  this->shared_session_key = session_key;
+  this->protocol_engine.set_session(session_key, this->shared_reverse_address);
+  this->session_changed.store(true);
+  return session_key;
+}
 
-  for (int i = 0; i < packet.size() - 7; i++)
-    packet[i + 7] ^= result[i];
+std::string MeshDevice::key_encrypt(std::string &key) const {
+  return awox_mesh::key_encrypt(this->mesh_name, this->mesh_password, key);
+}
 
-  return packet;
+std::string MeshDevice::encrypt_packet(std::string &packet) const {
+  return awox_mesh::encrypt_packet(this->session_key, this->reverse_address, packet);
 }
 
 void MeshDevice::set_disconnect_callback(std::function<void()> &&f) { this->disconnect_callback = std::move(f); }
 
-void MeshDevice::handle_packet(std::string &packet) {
-  int mesh_id, mode;
-  bool online, state, color_mode, transition_mode;
-  unsigned char white_brightness, temperature, color_brightness, R, G, B;
-
-  if (static_cast<unsigned char>(packet[7]) == COMMAND_ONLINE_STATUS_REPORT) {  // DC
-    mesh_id = (static_cast<unsigned char>(packet[19]) * 256) + static_cast<unsigned char>(packet[10]);
-    mode = static_cast<unsigned char>(packet[12]);
-    online = packet[11] > 0;
-    state = (mode & 1) == 1;
-    color_mode = ((mode >> 1) & 1) == 1;
-    transition_mode = ((mode >> 2) & 1) == 1;
-
-    white_brightness = packet[13];
-    temperature = packet[14];
-    color_brightness = packet[15];
-
-    R = packet[16];
-    G = packet[17];
-    B = packet[18];
-
-    ESP_LOGD(TAG,
-             "online status report: mesh: %d, on: %d, color_mode: %d, transition_mode: %d, w_b: %d, temp: %d, "
-             "c_b: %d, rgb: %02X%02X%02X ",
-             mesh_id, state, color_mode, transition_mode, white_brightness, temperature, color_brightness, R, G, B);
-
-  } else if (static_cast<unsigned char>(packet[7]) == COMMAND_STATUS_REPORT) {  // DB
-    mode = static_cast<unsigned char>(packet[10]);
-    mesh_id = (static_cast<unsigned char>(packet[4]) * 256) + static_cast<unsigned char>(packet[3]);
-    online = true;
-    state = (mode & 1) == 1;
-    color_mode = ((mode >> 1) & 1) == 1;
-    transition_mode = ((mode >> 2) & 1) == 1;
-
-    white_brightness = packet[11];
-    temperature = packet[12];
-    color_brightness = packet[13];
-
-    R = packet[14];
-    G = packet[15];
-    B = packet[16];
-
-    ESP_LOGD(TAG,
-             "status report: mesh: %d, on: %d, color_mode: %d, transition_mode: %d, w_b: %d, temp: %d, "
-             "c_b: %d, rgb: %02X%02X%02X ",
-             mesh_id, state, color_mode, transition_mode, white_brightness, temperature, color_brightness, R, G, B);
-
-  } else if (static_cast<unsigned char>(packet[7]) == 0xD8 && !packet[10]) {
-    mesh_id = (static_cast<unsigned char>(packet[4]) * 256) + static_cast<unsigned char>(packet[3]);
+void MeshDevice::handle_report(const MeshReport &report, bool changed, uint32_t received_at) {
+  AWOX_PROFILE("handle_report");
+  int mesh_id = report.mesh_id;
 
+  if (report.type == REPORT_MAC) {
     Device *device = this->get_device(mesh_id);
-    device->mac = get_device_mac(static_cast<unsigned char>(packet[16]), static_cast<unsigned char>(packet[15]),
-                                 static_cast<unsigned char>(packet[14]), static_cast<unsigned char>(packet[13]));
-    device->device_info = this->device_info_resolver->get_by_product_id(
-        get_product_code(static_cast<unsigned char>(packet[11]), static_cast<unsigned char>(packet[12])));
+    device->mac = get_device_mac(report.mac[3], report.mac[2], report.mac[1], report.mac[0]);
+    device->device_info =
+        this->device_info_resolver->get_by_product_id(get_product_code(report.product[0], report.product[1]));
 
-    ESP_LOGD(TAG, "MAC report, dev [%d]: productID: %02X mac: %s => %s", mesh_id, device->device_info->get_product_id(),
-             device->mac.c_str(), TextToBinaryString(packet).c_str());
+    ESP_LOGD(TAG, "MAC report, dev [%d]: productID: %02X mac: %s", mesh_id, device->device_info->get_product_id(),
+             device->mac.c_str());
 
     this->send_discovery(device);
     return;
-
-  } else {
-    ESP_LOGW(TAG, "Unknown report, dev [%d]: command %02X => %s", mesh_id, static_cast<unsigned char>(packet[7]),
-             TextToBinaryString(packet).c_str());
-
-    return;
   }
 
+  ESP_LOGD(TAG,
+           "%s: mesh: %d, on: %d, color_mode: %d, transition_mode: %d, w_b: %d, temp: %d, c_b: %d, rgb: %02X%02X%02X ",
+           report.opcode == COMMAND_ONLINE_STATUS_REPORT ? "online status report" : "status report", mesh_id,
+           report.state, report.color_mode, report.transition_mode, report.white_brightness, report.temperature,
+           report.color_brightness, report.R, report.G, report.B);
+
   Device *device = this->get_device(mesh_id);
   bool online_changed = false;
 
-  if (device->online != online) {
+  if (device->online != report.online) {
     online_changed = true;
   }
-  device->online = online;
-  device->state = state;
-  device->color_mode = color_mode;
-  device->transition_mode = transition_mode;
+  // The optimistic state that was published may change with a confirmation
+  bool pending = !device->desired.is_empty();
+  device->online = report.online;
+  device->state = report.state;
+  device->color_mode = report.color_mode;
+  device->transition_mode = report.transition_mode;
+  if (report.transition_mode && !device->native_transition) {
+    ESP_LOGD(TAG, "[%d] Reports a transition mode, using native fades", mesh_id);
+    device->native_transition = true;
+  }
 
-  device->white_brightness = white_brightness;
-  device->temperature = temperature;
-  device->color_brightness = color_brightness;
+  device->white_brightness = report.white_brightness;
+  device->temperature = report.temperature;
+  device->color_brightness = report.color_brightness;
 
-  device->R = R;
-  device->G = G;
-  device->B = B;
+  device->R = report.R;
+  device->G = report.G;
+  device->B = report.B;
   device->last_online = esphome::millis();
+  this->last_status_report = device->last_online;
+
+  if (this->connect_timing.started > 0 && this->connect_timing.first_status == 0) {
+    this->connect_timing.first_status = device->last_online;
+    this->publish_connect_timing();
+  }
 
   ESP_LOGI(TAG, this->device_state_as_string(device).c_str());
-  this->publish_state(device);
+  // A reply to a status request tells nothing about when a command took effect
+  bool solicited = report.opcode == COMMAND_STATUS_REPORT &&
+                   (this->status_sweep_started > 0 || this->status_poller.is_in_flight(mesh_id));
+  if (!solicited) {
+    this->latency_tracer.reported(mesh_id, received_at);
+  }
+  this->status_poller.answered(mesh_id);
+  this->confirm_desired(device);
+  // Repeated reports of the same state only refresh the last seen time
+  if (changed || online_changed || pending) {
+    this->publish_state(device);
+  }
 
   if (online_changed) {
     this->publish_availability(device, true);
@@ -446,8 +757,15 @@ std::string MeshDevice::get_discovery_topic_(const MQTTDiscoveryInfo &discovery_
          str_sanitize(device->mac) + "/config";
 }
 
+std::string MeshDevice::get_topic_prefix_() const {
+  if (this->topic_namespace.empty()) {
+    return global_mqtt_client->get_topic_prefix();
+  }
+  return global_mqtt_client->get_topic_prefix() + "/" + this->topic_namespace;
+}
+
 std::string MeshDevice::get_mqtt_topic_for_(Device *device, const std::string &suffix) const {
-  return global_mqtt_client->get_topic_prefix() + "/" + std::to_string(device->mesh_id) + "/" + suffix;
+  return this->get_topic_prefix_() + "/" + std::to_string(device->mesh_id) + "/" + suffix;
 }
 
 void MeshDevice::publish_availability(Device *device, bool delayed) {
@@ -461,26 +779,98 @@ void MeshDevice::publish_availability(Device *device, bool delayed) {
     return;
   }
 
+  if (!this->is_leader()) {
+    return;
+  }
+
   const std::string message = device->online ? "online" : "offline";
   ESP_LOGI(TAG, "Publish online/offline for %d - %s", device->mesh_id, message.c_str());
   global_mqtt_client->publish(this->get_mqtt_topic_for_(device, "availability"), message, 0, true);
+  this->metrics.publishes++;
+
+  this->update_state_snapshot(device);
+}
+
+void MeshDevice::on_leadership_changed(bool leader) {
+  ESP_LOGI(TAG, "%s", leader ? "Took over as cluster leader" : "No longer cluster leader");
+  if (!leader) {
+    return;
+  }
+
+  // Discovery and state may be stale or point to the availability of the previous leader
+  for (auto *device : this->devices_) {
+    device->discovery_hash = 0;
+    if (device->send_discovery) {
+      this->publish_discovery(device);
+    }
+    this->publish_availability(device, false);
+    this->publish_state(device);
+  }
+  this->publish_state_snapshot();
+}
+
+bool MeshDevice::is_leader() const { return this->cluster == nullptr || this->cluster->is_leader(); }
+
+bool MeshDevice::is_responsible(Device *device) const {
+  return this->cluster == nullptr || this->cluster->is_responsible(device->mac, esphome::millis());
+}
+
+void MeshDevice::count_devices(int &online, int &offline, int &undiscovered) const {
+  online = 0;
+  offline = 0;
+  undiscovered = 0;
+  for (auto *device : this->devices_) {
+    if (device->online) {
+      online++;
+    } else {
+      offline++;
+    }
+    if (device->mac == "") {
+      undiscovered++;
+    }
+  }
+}
+
+void MeshDevice::update_state_snapshot(Device *device) {
+  if (this->state_snapshot.update(device) && this->is_leader()) {
+    this->state_snapshot.publish_delta(this->get_topic_prefix_() + "/mesh/state/delta", device->mesh_id);
+  }
 }
 
-void MeshDevice::publish_state(Device *device) {
+void MeshDevice::publish_state_snapshot() {
+  if (!this->is_leader()) {
+    return;
+  }
+  this->state_snapshot.publish_snapshot(this->get_topic_prefix_() + "/mesh/state");
+}
+
+void MeshDevice::publish_state(Device *reported) {
+  AWOX_PROFILE("publish_state");
+  if (!this->is_leader()) {
+    return;
+  }
+  // Publish the reported state with the not yet confirmed attributes applied, like an optimistic light
+  Device state = *reported;
+  Device *device = &state;
+  this->apply_light_command(device, reported->desired);
+
+  const LightCurve &curve = get_light_curve(device);
+
+  this->metrics.publishes++;
   global_mqtt_client->publish_json(
       this->get_mqtt_topic_for_(device, "state"),
-      [this, device](JsonObject root) {
+      [this, device, &curve](JsonObject root) {
         root["state"] = device->state ? "ON" : "OFF";
 
         root["color_mode"] = "color_temp";
 
-        root["brightness"] = convert_value_to_available_range(device->white_brightness, 1, 0x7f, 0, 255);
+        root["brightness"] = curve.brightness_from_white(device->white_brightness);
 
         if (device->color_mode) {
           root["color_mode"] = "rgb";
-          root["brightness"] = convert_value_to_available_range(device->color_brightness, 0xa, 0x64, 0, 255);
+          root["brightness"] = curve.brightness_from_color(device->color_brightness);
         } else {
-          root["color_temp"] = convert_value_to_available_range(device->temperature, 0, 0x7f, 153, 370);
+          root["color_temp"] = curve.mireds_from_temperature(device->temperature);
         }
         JsonObject color = root.createNestedObject("color");
         color["r"] = device->R;
@@ -488,143 +878,221 @@ void MeshDevice::publish_state(Device *device) {
         color["b"] = device->B;
       },
       0, true);
+
+  // The snapshot only holds what the mesh confirmed, attributes still being retried are not in it
+  this->update_state_snapshot(reported);
 }
 
 void MeshDevice::send_discovery(Device *device) {
+  AWOX_PROFILE("send_discovery");
   if (device->mac == "") {
     ESP_LOGW(TAG, "'%s': Can not yet send discovery, mac address not known...",
              std::to_string(device->mesh_id).c_str());
     return;
   }
-  ESP_LOGD(TAG, "'%s': Sending discovery...", std::to_string(device->mesh_id).c_str());
-  const MQTTDiscoveryInfo &discovery_info = global_mqtt_client->get_discovery_info();
   device->send_discovery = true;
 
-  global_mqtt_client->publish_json(
-      this->get_discovery_topic_(discovery_info, device),
-      [this, device, discovery_info](JsonObject root) {
-        root["schema"] = "json";
+  // In a cluster only the leader publishes the discovery, every hub listens for commands
+  if (this->is_leader()) {
+    this->publish_discovery(device);
+  }
 
-        // Entity
-        root[MQTT_NAME] = device->device_info->get_name();
-        root[MQTT_UNIQUE_ID] = "awox-" + device->mac + "-" + device->device_info->get_component_type();
+  // MAC reports repeat on every info sweep, the subscription is only needed once
+  if (!device->command_subscribed) {
+    device->command_subscribed = true;
+    global_mqtt_client->subscribe_json(
+        this->get_mqtt_topic_for_(device, "command"),
+        [this, device](const std::string &topic, JsonObject root) { this->process_incomming_command(device, root); });
+  }
+}
 
-        if (device->device_info->get_icon() != "") {
-          root[MQTT_ICON] = device->device_info->get_icon();
-        }
+void MeshDevice::publish_discovery(Device *device) {
+  const MQTTDiscoveryInfo &discovery_info = global_mqtt_client->get_discovery_info();
 
-        // State and command topic
-        root[MQTT_STATE_TOPIC] = this->get_mqtt_topic_for_(device, "state");
-        root[MQTT_COMMAND_TOPIC] = this->get_mqtt_topic_for_(device, "command");
-
-        // Availavility topics
-        JsonArray availability = root.createNestedArray(MQTT_AVAILABILITY);
-        auto availability_topic_1 = availability.createNestedObject();
-        availability_topic_1[MQTT_TOPIC] = this->get_mqtt_topic_for_(device, "availability");
-        auto availability_topic_2 = availability.createNestedObject();
-        availability_topic_2[MQTT_TOPIC] = global_mqtt_client->get_topic_prefix() + "/status";
-        root[MQTT_AVAILABILITY_MODE] = "all";
-
-        // Features
-        root[MQTT_COLOR_MODE] = true;
-
-        if (device->device_info->has_feature(FEATURE_WHITE_BRIGHTNESS) ||
-            device->device_info->has_feature(FEATURE_COLOR_BRIGHTNESS)) {
-          root["brightness"] = true;
-          root["brightness_scale"] = 255;
-        }
+  const std::string device_topic = discovery_info.prefix + "/device/awox-" + str_sanitize(device->mac) + "/config";
+  const std::string entity_topic = this->get_discovery_topic_(discovery_info, device);
+  const std::string &topic = this->compact_discovery ? device_topic : entity_topic;
+  std::string payload = json::build_json([this, device](JsonObject root) { this->build_discovery_(device, root); });
 
-        JsonArray color_modes = root.createNestedArray("supported_color_modes");
+  // Home Assistant reloads the entity on every discovery message, identical ones are not sent again
+  uint32_t hash = fnv1_hash(topic + payload);
+  if (hash == device->discovery_hash) {
+    ESP_LOGV(TAG, "'%d': Discovery unchanged", device->mesh_id);
+    return;
+  }
 
-        if (device->device_info->has_feature(FEATURE_COLOR)) {
-          color_modes.add("rgb");
-        }
+  // A retained config of the other format, from before compact_discovery was switched, would keep a second entity.
+  // It is removed before the new config, Home Assistant would refuse the new one while the unique id is still taken.
+  if (discovery_info.retain && !device->other_discovery_cleared) {
+    const std::string &other_topic = this->compact_discovery ? entity_topic : device_topic;
+    this->metrics.publishes++;
+    device->other_discovery_cleared = global_mqtt_client->publish(other_topic, std::string(), 0, true);
+  }
 
-        if (device->device_info->has_feature(FEATURE_WHITE_TEMPERATURE)) {
-          color_modes.add("color_temp");
+  ESP_LOGD(TAG, "'%d': Sending discovery (%d bytes)...", device->mesh_id, payload.size());
+  this->metrics.publishes++;
+  if (global_mqtt_client->publish(topic, payload, 0, discovery_info.retain)) {
+    device->discovery_hash = hash;
+  }
+}
 
-          root[MQTT_MIN_MIREDS] = 153;
-          root[MQTT_MAX_MIREDS] = 370;
-        }
+void MeshDevice::build_discovery_(Device *device, JsonObject root) {
+  // Compact: device based discovery with a base topic and the abbreviations ESPHome does not use itself
+  const bool compact = this->compact_discovery;
+  const std::string unique_id = "awox-" + device->mac + "-" + device->device_info->get_component_type();
+
+  JsonObject entity = root;
+  if (compact) {
+    root["~"] = this->get_topic_prefix_() + "/" + std::to_string(device->mesh_id);
+    JsonObject origin = root.createNestedObject("o");
+    origin[MQTT_NAME] = "awox_mesh";
+    entity = root.createNestedObject("cmps").createNestedObject(unique_id);
+    entity["p"] = device->device_info->get_component_type();
+  }
 
-        // brightness should always be used alone
-        // https://developers.home-assistant.io/docs/core/entity/light/#color-modes
-        if (color_modes.size() == 0 && device->device_info->has_feature(FEATURE_WHITE_BRIGHTNESS)) {
-          color_modes.add("brightness");
-        }
+  entity["schema"] = "json";
 
-        if (color_modes.size() == 0) {
-          color_modes.add("onoff");
-        }
+  // Entity
+  entity[MQTT_NAME] = device->device_info->get_name();
+  entity[MQTT_UNIQUE_ID] = unique_id;
 
-        // Device
-        JsonObject device_info = root.createNestedObject(MQTT_DEVICE);
+  if (device->device_info->get_icon() != "") {
+    entity[MQTT_ICON] = device->device_info->get_icon();
+  }
 
-        JsonArray identifiers = device_info.createNestedArray(MQTT_DEVICE_IDENTIFIERS);
-        identifiers.add("esp-awox-mesh-" + std::to_string(device->mesh_id));
-        identifiers.add(device->mac);
+  // State and command topic
+  entity[MQTT_STATE_TOPIC] = compact ? "~/state" : this->get_mqtt_topic_for_(device, "state");
+  entity[MQTT_COMMAND_TOPIC] = compact ? "~/command" : this->get_mqtt_topic_for_(device, "command");
+
+  // Availavility topics
+  JsonArray availability = entity.createNestedArray(MQTT_AVAILABILITY);
+  auto availability_topic_1 = availability.createNestedObject();
+  availability_topic_1[MQTT_TOPIC] = compact ? "~/availability" : this->get_mqtt_topic_for_(device, "availability");
+  auto availability_topic_2 = availability.createNestedObject();
+  availability_topic_2[MQTT_TOPIC] = global_mqtt_client->get_availability().topic;
+  entity[MQTT_AVAILABILITY_MODE] = "all";
+
+  // Features
+  entity[MQTT_COLOR_MODE] = true;
+
+  if (device->device_info->has_feature(FEATURE_WHITE_BRIGHTNESS) ||
+      device->device_info->has_feature(FEATURE_COLOR_BRIGHTNESS)) {
+    entity["brightness"] = true;
+    entity[compact ? "bri_scl" : "brightness_scale"] = 255;
+  }
 
-        device_info[MQTT_DEVICE_NAME] = root[MQTT_NAME];
-        device_info[MQTT_DEVICE_MODEL] = device->device_info->get_model();
-        device_info[MQTT_DEVICE_MANUFACTURER] = device->device_info->get_manufacturer();
-        device_info["via_device"] = get_mac_address();
-      },
-      0, discovery_info.retain);
+  JsonArray color_modes = entity.createNestedArray(compact ? "sup_clrm" : "supported_color_modes");
 
-  global_mqtt_client->subscribe_json(
-      this->get_mqtt_topic_for_(device, "command"),
-      [this, device](const std::string &topic, JsonObject root) { this->process_incomming_command(device, root); });
+  if (device->device_info->has_feature(FEATURE_COLOR)) {
+    color_modes.add("rgb");
+  }
+
+  if (device->device_info->has_feature(FEATURE_WHITE_TEMPERATURE)) {
+    color_modes.add("color_temp");
+
+    entity[MQTT_MIN_MIREDS] = device->device_info->get_curve().get_min_mireds();
+    entity[MQTT_MAX_MIREDS] = device->device_info->get_curve().get_max_mireds();
+  }
+
+  // brightness should always be used alone
+  // https://developers.home-assistant.io/docs/core/entity/light/#color-modes
+  if (color_modes.size() == 0 && device->device_info->has_feature(FEATURE_WHITE_BRIGHTNESS)) {
+    color_modes.add("brightness");
+  }
+
+  if (color_modes.size() == 0) {
+    color_modes.add("onoff");
+  }
+
+  if (device->device_info->has_feature(FEATURE_WHITE_BRIGHTNESS) ||
+      device->device_info->has_feature(FEATURE_COLOR_BRIGHTNESS)) {
+    entity["effect"] = true;
+    JsonArray effects = entity.createNestedArray(compact ? "fx_list" : "effect_list");
+    effects.add("fade_on");
+    effects.add("fade_off");
+  }
+
+  // Device
+  JsonObject device_info = root.createNestedObject(MQTT_DEVICE);
+
+  JsonArray identifiers = device_info.createNestedArray(MQTT_DEVICE_IDENTIFIERS);
+  if (this->topic_namespace.empty()) {
+    identifiers.add("esp-awox-mesh-" + std::to_string(device->mesh_id));
+  } else {
+    identifiers.add("esp-awox-mesh-" + this->topic_namespace + "-" + std::to_string(device->mesh_id));
+  }
+  identifiers.add(device->mac);
+
+  device_info[MQTT_DEVICE_NAME] = device->device_info->get_name();
+  device_info[MQTT_DEVICE_MODEL] = device->device_info->get_model();
+  device_info[MQTT_DEVICE_MANUFACTURER] = device->device_info->get_manufacturer();
+  device_info["via_device"] = get_mac_address();
 }
 
-void MeshDevice::process_incomming_command(Device *device, JsonObject root) {
-  ESP_LOGV(TAG, "[%d] Process command", device->mesh_id);
-  bool state_set = false;
+static QueuedCommand make_queued_command(int command, const std::string &data, int dest) {
+  QueuedCommand item = {};
+  item.set_data(data);
+  item.command = command;
+  item.dest = dest;
+  return item;
+}
+
+LightCommand MeshDevice::parse_light_command(Device *device, JsonObject root) {
+  LightCommand command = {};
+  const LightCurve &curve = get_light_curve(device);
+
   if (root.containsKey("color")) {
     JsonObject color = root["color"];
 
-    state_set = true;
-    device->state = true;
-    device->R = (int) color["r"];
-    device->G = (int) color["g"];
-    device->B = (int) color["b"];
+    command.has_color = true;
+    command.R = (int) color["r"];
+    command.G = (int) color["g"];
+    command.B = (int) color["b"];
 
     ESP_LOGD(TAG, "[%d] Process command color %d %d %d", device->mesh_id, (int) color["r"], (int) color["g"],
              (int) color["b"]);
-
-    this->set_color(device->mesh_id, (int) color["r"], (int) color["g"], (int) color["b"]);
   }
 
   if (root.containsKey("brightness") && !root.containsKey("color_temp") &&
       (root.containsKey("color") || device->color_mode)) {
-    int brightness = convert_value_to_available_range((int) root["brightness"], 0, 255, 0xa, 0x64);
-
-    state_set = true;
-    device->state = true;
-    device->color_brightness = brightness;
+    command.has_color_brightness = true;
+    command.color_brightness = curve.color_from_brightness((int) root["brightness"]);
 
     ESP_LOGD(TAG, "[%d] Process command color_brightness %d", device->mesh_id, (int) root["brightness"]);
-    this->set_color_brightness(device->mesh_id, brightness);
 
   } else if (root.containsKey("brightness")) {
-    int brightness = convert_value_to_available_range((int) root["brightness"], 0, 255, 1, 0x7f);
-
-    state_set = true;
-    device->state = true;
-    device->white_brightness = brightness;
+    command.has_white_brightness = true;
+    command.white_brightness = curve.white_from_brightness((int) root["brightness"]);
 
     ESP_LOGD(TAG, "[%d] Process command white_brightness %d", device->mesh_id, (int) root["brightness"]);
-    this->set_white_brightness(device->mesh_id, brightness);
   }
 
   if (root.containsKey("color_temp")) {
-    int temperature = convert_value_to_available_range((int) root["color_temp"], 153, 370, 0, 0x7f);
-
-    state_set = true;
-    device->state = true;
-    device->temperature = temperature;
+    command.has_temperature = true;
+    command.temperature = curve.temperature_from_mireds((int) root["color_temp"]);
 
     ESP_LOGD(TAG, "[%d] Process command color_temp %d", device->mesh_id, (int) root["color_temp"]);
-    this->set_white_temperature(device->mesh_id, temperature);
+  }
+
+  if (root.containsKey("transition")) {
+    command.has_transition = true;
+    command.transition = (uint32_t) ((float) root["transition"] * 1000);
+
+    ESP_LOGD(TAG, "[%d] Process command transition %d ms", device->mesh_id, command.transition);
+  }
+
+  if (root.containsKey("effect")) {
+    std::string effect = root["effect"].as<std::string>();
+    if (effect == "fade_on" || effect == "fade_off") {
+      command.has_state = true;
+      command.state = effect == "fade_on";
+      if (!command.has_transition) {
+        command.has_transition = true;
+        command.transition = this->effect_transition;
+      }
+    }
+
+    ESP_LOGD(TAG, "[%d] Process command effect %s", device->mesh_id, effect.c_str());
   }
 
   if (root.containsKey("state")) {
@@ -632,69 +1100,646 @@ void MeshDevice::process_incomming_command(Device *device, JsonObject root) {
     auto val = parse_on_off(root["state"]);
     switch (val) {
       case PARSE_ON:
-        device->state = true;
-        if (!state_set) {
-          this->set_state(device->mesh_id, true);
-        }
+        command.has_state = true;
+        command.state = true;
         break;
       case PARSE_OFF:
-        device->state = false;
-        this->set_state(device->mesh_id, false);
+        command.has_state = true;
+        command.state = false;
         break;
       case PARSE_TOGGLE:
-        device->state = !device->state;
-        this->set_state(device->mesh_id, device->state);
+        command.has_state = true;
+        command.state = device->desired.has_state ? !device->desired.state : !device->state;
         break;
       case PARSE_NONE:
         break;
     }
   }
 
+  return command;
+}
+
+std::vector<QueuedCommand> MeshDevice::compile_light_command(Device *device, const LightCommand &command,
+                                                             bool skip_known) const {
+  std::vector<QueuedCommand> commands;
+  // Only trust the known state when the device reported it
+  bool known = skip_known && device->online;
+  int dest = device->mesh_id;
+
+  if (command.has_color &&
+      !(known && device->color_mode && device->R == command.R && device->G == command.G && device->B == command.B)) {
+    commands.push_back(make_queued_command(
+        C_COLOR,
+        {0x04, static_cast<char>(command.R), static_cast<char>(command.G), static_cast<char>(command.B)}, dest));
+  }
+
+  if (command.has_color_brightness &&
+      !(known && device->color_mode && device->color_brightness == command.color_brightness)) {
+    commands.push_back(
+        make_queued_command(C_COLOR_BRIGHTNESS, {static_cast<char>(command.color_brightness)}, dest));
+  }
+
+  if (command.has_white_brightness &&
+      !(known && !device->color_mode && device->white_brightness == command.white_brightness)) {
+    commands.push_back(
+        make_queued_command(C_WHITE_BRIGHTNESS, {static_cast<char>(command.white_brightness)}, dest));
+  }
+
+  if (command.has_temperature && !(known && !device->color_mode && device->temperature == command.temperature)) {
+    commands.push_back(make_queued_command(C_WHITE_TEMPERATURE, {static_cast<char>(command.temperature)}, dest));
+  }
+
+  // Color, brightness and temperature commands turn the light on by themselves
+  bool turn_on = command.has_state ? command.state : command.sets_attributes();
+
+  if (command.has_state && !command.state) {
+    if (!(known && !device->state)) {
+      commands.push_back(make_queued_command(C_POWER, {0, 0, 0}, dest));
+    }
+  } else if (turn_on && commands.empty() && !(known && device->state)) {
+    commands.push_back(make_queued_command(C_POWER, {1, 0, 0}, dest));
+  }
+
+  // The fade duration is a setting of the device, it is only written when it changes so a fade costs one packet extra.
+  // Experimental: 0xf6 is documented for the color sequences, the 4 byte little-endian ms encoding and its effect on
+  // plain changes are not confirmed against a device.
+  uint32_t fade_duration = command.has_transition ? command.transition : 0;
+  if (!commands.empty() && this->has_native_transition(device) && fade_duration != device->fade_duration) {
+    commands.insert(commands.begin(),
+                    make_queued_command(C_SEQUENCE_FADE_DURATION,
+                                        {static_cast<char>(fade_duration & 0xff),
+                                         static_cast<char>((fade_duration >> 8) & 0xff),
+                                         static_cast<char>((fade_duration >> 16) & 0xff),
+                                         static_cast<char>((fade_duration >> 24) & 0xff)},
+                                        dest));
+  }
+
+  return commands;
+}
+
+void MeshDevice::apply_light_command(Device *device, const LightCommand &command) {
+  if (command.has_color) {
+    device->R = command.R;
+    device->G = command.G;
+    device->B = command.B;
+  }
+  if (command.has_color_brightness) {
+    device->color_brightness = command.color_brightness;
+  }
+  if (command.has_white_brightness) {
+    device->white_brightness = command.white_brightness;
+  }
+  if (command.has_temperature) {
+    device->temperature = command.temperature;
+  }
+
+  if (command.has_state) {
+    device->state = command.state;
+  } else if (command.sets_attributes()) {
+    device->state = true;
+  }
+}
+
+void MeshDevice::process_incomming_command(Device *device, JsonObject root) {
+  AWOX_PROFILE("process_incomming_command");
+  const uint32_t received_at = esphome::millis();
+  ESP_LOGV(TAG, "[%d] Process command", device->mesh_id);
+  LightCommand command = this->parse_light_command(device, root);
+  const int uncomposed = command.uncomposed_packets();
+
+  // A new command ends the transition in progress, its queued steps are superseded by the new packets
+  HubTransition &transition = device->hub_transition;
+  if (transition.active) {
+    this->remove_transition_steps(device);
+    transition.active = false;
+  }
+
+  if (command.has_color_brightness || command.has_white_brightness) {
+    transition.restore = 0;
+  } else if (transition.restore > 0 && !device->state &&
+             (command.has_state ? command.state : command.sets_attributes())) {
+    // A hub fade out leaves the light at its lowest brightness, it comes back at the brightness it had before
+    if (transition.restore_color) {
+      command.has_color_brightness = true;
+      command.color_brightness = transition.restore;
+    } else {
+      command.has_white_brightness = true;
+      command.white_brightness = transition.restore;
+    }
+    transition.restore = 0;
+  }
+
+  if (command.has_transition && !this->has_native_transition(device) && this->is_responsible(device) &&
+      this->start_hub_transition(device, command)) {
+    return;
+  }
+
+  device->desired.merge(command);
+  device->desired_attempts = 0;
+  if (this->is_responsible(device)) {
+    this->composed_commands++;
+    this->composed_packets += this->reconcile(device, PRIORITY_INTERACTIVE, received_at, COMMAND_TTL_INTERACTIVE);
+    this->uncomposed_packets += uncomposed;
+  }
+
   this->publish_state(device);
 }
 
+bool MeshDevice::has_native_transition(Device *device) const {
+  switch (this->transition_support) {
+    case TRANSITION_NATIVE:
+      return true;
+    case TRANSITION_HUB:
+      return false;
+    default:
+      return device->native_transition;
+  }
+}
+
+bool MeshDevice::start_hub_transition(Device *device, const LightCommand &command) {
+  HubTransition &transition = device->hub_transition;
+  bool color =
+      command.has_color_brightness || (!command.has_white_brightness && (command.has_color || device->color_mode));
+  int min = color ? COLOR_BRIGHTNESS_MIN : WHITE_BRIGHTNESS_MIN;
+  int current = color ? device->color_brightness : device->white_brightness;
+
+  int from = device->state ? current : min;
+  int to;
+  if (command.has_state && !command.state) {
+    if (!device->state) {
+      return false;
+    }
+    to = min;
+  } else if (command.has_color_brightness) {
+    to = command.color_brightness;
+  } else if (command.has_white_brightness) {
+    to = command.white_brightness;
+  } else if (!device->state) {
+    to = current;
+  } else {
+    return false;
+  }
+
+  // Packets leave the queue at most every 180 ms, steps closer together would only pile up
+  int steps = std::min({this->transition_max_steps, (int) (command.transition / 250), std::abs(to - from)});
+  if (steps < 2) {
+    return false;
+  }
+
+  transition.active = true;
+  transition.color = color;
+  transition.from = from;
+  transition.to = to;
+  transition.steps = steps;
+  transition.step = 0;
+  transition.started = esphome::millis();
+  transition.duration = command.transition;
+  transition.target = command;
+  transition.target.has_transition = false;
+  if (command.has_state && !command.state) {
+    transition.restore = current;
+    transition.restore_color = color;
+  }
+
+  ESP_LOGD(TAG, "[%d] Step brightness from %d to %d in %d steps over %d ms", device->mesh_id, from, to, steps,
+           command.transition);
+  return true;
+}
+
+void MeshDevice::remove_transition_steps(Device *device) {
+  const int mesh_id = device->mesh_id;
+  this->command_queue.remove_if(
+      [mesh_id](const QueuedCommand &_f) { return _f.dest == mesh_id && is_light_command(_f.command); });
+}
+
+void MeshDevice::step_hub_transitions() {
+  for (auto *device : this->devices_) {
+    HubTransition &transition = device->hub_transition;
+    if (!transition.active ||
+        esphome::millis() - transition.started < transition.duration * transition.step / transition.steps) {
+      continue;
+    }
+    transition.step++;
+
+    if (transition.step < transition.steps) {
+      char value = static_cast<char>(transition.from +
+                                     (transition.to - transition.from) * transition.step / transition.steps);
+      this->queue_light_commands(
+          {make_queued_command(transition.color ? C_COLOR_BRIGHTNESS : C_WHITE_BRIGHTNESS, {value}, device->mesh_id)},
+          PRIORITY_AUTOMATION);
+      continue;
+    }
+
+    // Last step: the target goes through the desired state so it is confirmed and retried like any command.
+    // Steps still queued would arrive after it, and it keeps their priority so it can not overtake them either.
+    transition.active = false;
+    this->remove_transition_steps(device);
+    device->desired.merge(transition.target);
+    device->desired_attempts = 0;
+    this->reconcile(device, PRIORITY_AUTOMATION);
+    this->publish_state(device);
+  }
+}
+
+int MeshDevice::reconcile(Device *device, CommandPriority priority, uint32_t received_at, uint32_t ttl) {
+  std::vector<QueuedCommand> commands = this->compile_light_command(device, device->desired, true);
+  if (commands.empty()) {
+    ESP_LOGV(TAG, "[%d] Reported state already matches desired state", device->mesh_id);
+    device->desired = {};
+    return 0;
+  }
+
+  ESP_LOGD(TAG, "[%d] Command composed into %d packets", device->mesh_id, commands.size());
+  for (auto &item : commands) {
+    item.received_at = received_at;
+  }
+  this->queue_light_commands(commands, priority, ttl);
+  device->desired_sent_at = esphome::millis();
+  device->desired_attempts++;
+  return commands.size();
+}
+
+void MeshDevice::confirm_desired(Device *device) {
+  LightCommand &desired = device->desired;
+  if (desired.is_empty()) {
+    return;
+  }
+
+  if (desired.has_state && desired.state == device->state) {
+    desired.has_state = false;
+  }
+  if (desired.has_color && desired.R == device->R && desired.G == device->G && desired.B == device->B) {
+    desired.has_color = false;
+  }
+  if (desired.has_color_brightness && desired.color_brightness == device->color_brightness) {
+    desired.has_color_brightness = false;
+  }
+  if (desired.has_white_brightness && desired.white_brightness == device->white_brightness) {
+    desired.has_white_brightness = false;
+  }
+  if (desired.has_temperature && desired.temperature == device->temperature) {
+    desired.has_temperature = false;
+  }
+
+  if (desired.is_empty()) {
+    ESP_LOGD(TAG, "[%d] Desired state confirmed after %d attempts", device->mesh_id, device->desired_attempts);
+    device->desired_attempts = 0;
+    device->desired_sent_at = 0;
+  }
+}
+
+bool MeshDevice::has_queued_light_command(int dest) const {
+  return this->command_queue.any_of([dest](const QueuedCommand &_f) {
+    return (_f.dest == dest || _f.dest == 0xffff) && is_light_command(_f.command);
+  });
+}
+
+void MeshDevice::process_batch_command(JsonObject root) {
+  // Every hub of a cluster takes the desired state of all targets, like for single commands, and sends and retries
+  // the packets of the lights it is responsible for
+  struct PlannedCommand {
+    QueuedCommand command;
+    std::vector<int> dests;
+  };
+
+  std::vector<PlannedCommand> plan;
+  std::vector<Device *> targeted;
+  int planned_devices = 0;
+  int requested = 0;
+  const uint32_t received_at = esphome::millis();
+
+  for (JsonObject entry : root["commands"].as<JsonArray>()) {
+    std::vector<Device *> targets;
+    if (entry["targets"].is<const char *>()) {
+      // "all"
+      targets = this->devices_;
+    } else {
+      for (JsonVariant target : entry["targets"].as<JsonArray>()) {
+        Device *device = this->find_device(target.as<int>());
+        if (device == nullptr) {
+          ESP_LOGW(TAG, "Batch command for unknown mesh_id %d skipped", target.as<int>());
+          continue;
+        }
+        targets.push_back(device);
+      }
+    }
+
+    for (auto *device : targets) {
+      LightCommand command = this->parse_light_command(device, entry);
+      device->desired.merge(command);
+      if (std::find(targeted.begin(), targeted.end(), device) == targeted.end()) {
+        targeted.push_back(device);
+      }
+      if (!this->is_responsible(device)) {
+        // Sent by the hub that owns the light, resent from here once the ownership moves
+        device->desired_attempts = 0;
+        device->desired_sent_at = 0;
+        continue;
+      }
+
+      // What a single command message per light would have cost, before leaving out and merging packets
+      requested += command.uncomposed_packets();
+      device->desired_attempts = 1;
+      device->desired_sent_at = esphome::millis();
+
+      for (auto &item : this->compile_light_command(device, device->desired, true)) {
+        item.received_at = received_at;
+        auto found = std::find_if(plan.begin(), plan.end(), [&item](const PlannedCommand &_f) {
+          return _f.command.command == item.command && _f.command.same_data(item);
+        });
+        if (found == plan.end()) {
+          plan.push_back({item, {item.dest}});
+        } else {
+          found->dests.push_back(item.dest);
+        }
+      }
+    }
+  }
+  for (auto *device : targeted) {
+    if (this->is_responsible(device)) {
+      planned_devices++;
+    }
+  }
+
+  // Power commands go last so a "state: OFF" is not undone by a brightness command for the same light, the scheduler
+  // serves the destinations in turns so they are also held back until the other packets of the batch are sent
+  std::stable_sort(plan.begin(), plan.end(), [](const PlannedCommand &a, const PlannedCommand &b) {
+    return a.command.command != C_POWER && b.command.command == C_POWER;
+  });
+  this->last_batch = this->last_batch == 0xffff ? 1 : this->last_batch + 1;
+  for (auto &planned : plan) {
+    planned.command.batch = this->last_batch;
+    planned.command.after_batch = planned.command.command == C_POWER;
+  }
+
+  int sent = 0;
+  for (auto &planned : plan) {
+    std::sort(planned.dests.begin(), planned.dests.end());
+    planned.dests.erase(std::unique(planned.dests.begin(), planned.dests.end()), planned.dests.end());
+
+    if (planned.dests.size() > 1 && planned.dests.size() == this->devices_.size()) {
+      planned.command.dest = 0xffff;
+      this->queue_light_commands({planned.command}, PRIORITY_AUTOMATION);
+      sent++;
+      continue;
+    }
+    for (int dest : planned.dests) {
+      planned.command.dest = dest;
+      this->queue_light_commands({planned.command}, PRIORITY_AUTOMATION);
+      sent++;
+    }
+  }
+
+  ESP_LOGI(TAG, "Batch command for %d devices: %d packets instead of %d", planned_devices, sent, requested);
+
+  for (auto *device : targeted) {
+    this->publish_state(device);
+  }
+
+  // In a cluster every hub reports its own share, the leader also when it had nothing to send
+  if (planned_devices == 0 && !this->is_leader()) {
+    return;
+  }
+  global_mqtt_client->publish_json(
+      this->get_topic_prefix_() + "/mesh/batch_command/result",
+      [this, planned_devices, requested, sent](JsonObject root) {
+        if (this->cluster != nullptr) {
+          root["hub"] = this->cluster->get_hub_id();
+        }
+        root["devices"] = planned_devices;
+        root["requested"] = requested;
+        root["sent"] = sent;
+        root["saved"] = requested - sent;
+      },
+      0, false);
+}
+
 std::string MeshDevice::build_packet(int dest, int command, const std::string &data) {
-  /* Telink mesh packets take the following form:
- bytes 0-1   : packet counter
- bytes 2-4   : not used (=0)
- bytes 5-6   : mesh ID
- bytes 7     : command code
- bytes 8-9   : vendor code
- bytes 10-20 : command data
-
-All multi-byte elements are in little-endian form.
-Packet counter runs between 1 and 0xffff.
-*/
   ESP_LOGV(TAG, "command: %d, data: %s, dest: %d", command, TextToBinaryString(data).c_str(), dest);
-  std::string packet;
-  packet.resize(20, 0);
-  packet[0] = this->packet_count & 0xff;
-  packet[1] = (this->packet_count++ >> 8) & 0xff;
-  packet[5] = dest & 0xff;
-  packet[6] = (dest >> 8) & 0xff;
-  packet[7] = command & 0xff;
-  packet[8] = 0x60;  // this->vendor & 0xff;
-  packet[9] = 0x01;  //(this->vendor >> 8) & 0xff;
-  for (int i = 0; i < data.size(); i++)
-    packet[i + 10] = data[i];
-
-  // ESP_LOGI(TAG, "[%d] [%s] packet (packet_count+dest+command) %s", this->get_conn_id(), this->address_str_.c_str(),
-  //          TextToBinaryString(packet).c_str());
+  std::string packet = awox_mesh::build_packet(this->packet_count++, dest, command, data);
+  this->packet_trace.record(TRACE_TX, packet, esphome::millis());
 
   std::string enc_packet = this->encrypt_packet(packet);
 
   if (this->packet_count > 0xffff)
     this->packet_count = 1;
 
+  if (this->packet_count == this->packet_count_reserved) {
+    this->reserve_packet_count_window();
+  }
+
   return enc_packet;
 }
 
-void MeshDevice::queue_command(int command, const std::string &data, int dest) {
+void MeshDevice::restore_packet_count() {
+  this->packet_count_pref =
+      global_preferences->make_preference<uint32_t>(fnv1_hash("awox_mesh_packet_count_" + this->mesh_name), true);
+
+  uint32_t stored;
+  if (this->packet_count_pref.load(&stored) && stored >= 1 && stored <= 0xffff) {
+    this->packet_count = stored;
+  }
+  ESP_LOGD(TAG, "Packet counter resumes at %d", this->packet_count);
+  this->reserve_packet_count_window();
+}
+
+void MeshDevice::reserve_packet_count_window() {
+  // The counter runs from 1 to 0xffff
+  uint32_t reserved = (this->packet_count - 1 + PACKET_COUNT_WINDOW) % 0xffff + 1;
+  this->packet_count_reserved = reserved;
+  this->packet_count_pref.save(&reserved);
+  // Written right away, a reboot before the regular flash write would reuse the counters of this window
+  global_preferences->sync();
+}
+
+void MeshDevice::queue_command(int command, const std::string &data, int dest, CommandPriority priority,
+                               uint32_t ttl) {
   QueuedCommand item = {};
-  item.data = data;
+  item.set_data(data);
   item.command = command;
   item.dest = dest;
-  this->command_queue.push_back(item);
+  item.queued_at = esphome::millis();
+  item.ttl = ttl;
+  item.priority = priority;
+  this->admit_command(item);
+}
+
+void MeshDevice::queue_light_commands(const std::vector<QueuedCommand> &commands, CommandPriority priority,
+                                      uint32_t ttl) {
+  for (auto item : commands) {
+    this->command_queue.remove_if([&item](const QueuedCommand &_f) {
+      return _f.dest == item.dest && _f.command == item.command && is_light_command(_f.command);
+    });
+    item.queued_at = esphome::millis();
+    item.ttl = ttl;
+    item.priority = priority;
+    this->admit_command(item);
+  }
+}
+
+bool MeshDevice::admit_command(const QueuedCommand &item) {
+  QueuedCommand dropped;
+  switch (this->command_queue.push(item, &dropped)) {
+    case ADMITTED:
+      return true;
+    case ADMITTED_DROPPED:
+      this->report_dropped_command(dropped, "dropped");
+      return true;
+    case REJECTED:
+      break;
+  }
+
+  Device *device = this->find_device(item.dest);
+  if (this->command_queue.get_policy() == ADMISSION_RECONCILE && is_light_command(item.command) &&
+      device != nullptr && !device->desired.is_empty()) {
+    // The queued packets of the light make way for the fewest packets that reach its desired state
+    ESP_LOGW(TAG, "[%d] Command queue full, queue the desired state instead", item.dest);
+    this->command_queue.remove_if([&item](const QueuedCommand &_f) {
+      return _f.dest == item.dest && is_light_command(_f.command);
+    });
+    std::vector<QueuedCommand> packets = this->compile_light_command(device, device->desired, true);
+    size_t rejected = 0;
+    for (auto packet : packets) {
+      packet.queued_at = item.queued_at;
+      packet.ttl = item.ttl;
+      packet.priority = item.priority;
+      if (this->command_queue.push(packet, &dropped) == REJECTED) {
+        this->report_dropped_command(packet, "rejected");
+        rejected++;
+      }
+    }
+    // Nothing of the light made it into the queue, the caller sees the command rejected
+    return packets.empty() || rejected < packets.size();
+  }
+
+  ESP_LOGW(TAG, "[%d] Command queue full, command %02X rejected", item.dest, item.command);
+  this->report_dropped_command(item, "rejected");
+  return false;
+}
+
+void MeshDevice::report_dropped_command(const QueuedCommand &item, const char *reason) {
+  ESP_LOGD(TAG, "[%d] Command %02X %s after %d ms in the queue", item.dest, item.command, reason,
+           esphome::millis() - item.queued_at);
+  this->dropped_commands_total++;
+  if (item.command == C_REQUEST_STATUS) {
+    this->status_poller.dropped(item.dest);
+  }
+  if (this->dropped_commands.size() < 16) {
+    this->dropped_commands.push_back({item.command, item.dest, item.priority, esphome::millis() - item.queued_at,
+                                      reason});
+  }
+}
+
+void MeshDevice::publish_dropped_commands() {
+  this->last_dropped_publish = esphome::millis();
+  global_mqtt_client->publish_json(
+      this->get_topic_prefix_() + "/mesh/diagnostics/dropped",
+      [this](JsonObject root) {
+        root["total"] = this->dropped_commands_total;
+        JsonArray commands = root.createNestedArray("commands");
+        for (auto &dropped : this->dropped_commands) {
+          JsonObject command = commands.createNestedObject();
+          command["reason"] = dropped.reason;
+          command["dest"] = dropped.dest;
+          command["command"] = dropped.command;
+          command["priority"] = (int) dropped.priority;
+          command["age"] = dropped.age;
+        }
+      },
+      0, false);
+  this->dropped_commands.clear();
+}
+
+void MeshDevice::publish_queue_diagnostics() {
+  static const char *const names[COMMAND_PRIORITY_COUNT] = {"interactive", "automation", "background"};
+
+  for (int i = 0; i < COMMAND_PRIORITY_COUNT; i++) {
+    LatencyStats &stats = this->command_queue.get_delay_stats(static_cast<CommandPriority>(i));
+    ESP_LOGD(TAG, "Queue delay %s: queued %d, p50 %d ms, p95 %d ms, p99 %d ms, max %d ms", names[i],
+             this->command_queue.size(static_cast<CommandPriority>(i)), stats.percentile(50), stats.percentile(95),
+             stats.percentile(99), stats.max());
+  }
+
+  global_mqtt_client->publish_json(
+      this->get_topic_prefix_() + "/mesh/diagnostics/queue",
+      [this](JsonObject root) {
+        for (int i = 0; i < COMMAND_PRIORITY_COUNT; i++) {
+          CommandPriority priority = static_cast<CommandPriority>(i);
+          LatencyStats &stats = this->command_queue.get_delay_stats(priority);
+          JsonObject delay = root.createNestedObject(names[i]);
+          delay["queued"] = this->command_queue.size(priority);
+          delay["p50"] = stats.percentile(50);
+          delay["p95"] = stats.percentile(95);
+          delay["p99"] = stats.percentile(99);
+          delay["max"] = stats.max();
+        }
+        if (this->status_poller.is_enabled()) {
+          JsonObject polling = root.createNestedObject("polling");
+          polling["sent"] = this->status_poller.get_sent();
+          polling["unanswered"] = this->status_poller.get_unanswered();
+        }
+      },
+      0, false);
+
+  // Percentiles and max per publish interval
+  for (int i = 0; i < COMMAND_PRIORITY_COUNT; i++) {
+    this->command_queue.get_delay_stats(static_cast<CommandPriority>(i)).reset();
+  }
+}
+
+void MeshDevice::publish_packet_trace() {
+  std::string dump = this->packet_trace.dump();
+  ESP_LOGI(TAG, "Dump packet trace, %d packets", dump.size() / sizeof(TraceRecord));
+  global_mqtt_client->publish(this->get_topic_prefix_() + "/mesh/trace", dump.data(), dump.size(), 0,
+                              false);
+}
+
+void MeshDevice::publish_latency_diagnostics() {
+  static const char *const names[TRACE_STAGE_COUNT] = {"receive", "queue", "write", "report", "total"};
+
+  for (int i = 0; i < TRACE_STAGE_COUNT; i++) {
+    LatencyStats &stats = this->latency_tracer.get_stage_stats(static_cast<TraceStage>(i));
+    ESP_LOGD(TAG, "Command latency %s: p50 %d ms, p95 %d ms, p99 %d ms, max %d ms", names[i], stats.percentile(50),
+             stats.percentile(95), stats.percentile(99), stats.max());
+  }
+
+  global_mqtt_client->publish_json(
+      this->get_topic_prefix_() + "/mesh/diagnostics/latency",
+      [this](JsonObject root) {
+        JsonObject stages = root.createNestedObject("stages");
+        for (int i = 0; i < TRACE_STAGE_COUNT; i++) {
+          LatencyStats &stats = this->latency_tracer.get_stage_stats(static_cast<TraceStage>(i));
+          JsonObject stage = stages.createNestedObject(names[i]);
+          stage["p50"] = stats.percentile(50);
+          stage["p95"] = stats.percentile(95);
+          stage["p99"] = stats.percentile(99);
+          stage["max"] = stats.max();
+        }
+        JsonObject destinations = root.createNestedObject("destinations");
+        for (auto &destination : this->latency_tracer.get_destination_stats()) {
+          JsonObject stats = destinations.createNestedObject(std::to_string(destination.first));
+          stats["count"] = destination.second.count();
+          stats["p50"] = destination.second.percentile(50);
+          stats["p95"] = destination.second.percentile(95);
+          stats["p99"] = destination.second.percentile(99);
+        }
+        root["unconfirmed"] = this->latency_tracer.get_unconfirmed();
+        JsonObject composition = root.createNestedObject("composition");
+        composition["commands"] = this->composed_commands;
+        composition["packets"] = this->composed_packets;
+        composition["uncomposed_packets"] = this->uncomposed_packets;
+        composition["receive_to_send_p95"] = this->receive_to_send.percentile(95);
+        JsonObject loss = root.createNestedObject("loss");
+        for (bool after_boot : {true, false}) {
+          JsonObject phase = loss.createNestedObject(after_boot ? "after_boot" : "steady");
+          uint32_t written = this->latency_tracer.get_written(after_boot);
+          uint32_t lost = this->latency_tracer.get_lost(after_boot);
+          phase["written"] = written;
+          phase["lost"] = lost;
+          phase["rate"] = written > 0 ? (float) lost / written : 0.0f;
+        }
+      },
+      0, false);
 }
 
 bool MeshDevice::write_command(int command, const std::string &data, int dest, bool withResponse) {
@@ -702,18 +1747,64 @@ bool MeshDevice::write_command(int command, const std::string &data, int dest, b
            TextToBinaryString(data).c_str());
   std::string packet = this->build_packet(dest, command, data);
   // todo: withResponse
-  auto status = this->command_char->write_value((uint8_t *) packet.data(), packet.size());
-  // todo: check write return value
-  return status ? false : true;
+  auto status = this->write_char(this->handles.command, (uint8_t *) packet.data(), packet.size());
+  if (status) {
+    ESP_LOGW(TAG, "[%d] [%s] write_command failed, error=%d", this->get_conn_id(), this->address_str_.c_str(), status);
+    this->consecutive_write_failures++;
+    return false;
+  }
+  this->consecutive_write_failures = 0;
+  return true;
+}
+
+void MeshDevice::poll_status() {
+  // Interactive commands go first, the poll waits for the queue to drain
+  if (!this->is_leader() || this->status_sweep_started > 0 || this->command_queue.size(PRIORITY_INTERACTIVE) > 0 ||
+      !this->status_poller.is_due(esphome::millis(), this->devices_.size())) {
+    return;
+  }
+
+  const uint32_t now = esphome::millis();
+  const uint32_t period = this->status_poller.get_period();
+  Device *stalest = nullptr;
+  for (auto *device : this->devices_) {
+    // Offline devices do not answer, they come back with an online status report of the mesh.
+    // A device that did not answer its last poll waits a period, so it can not starve the others.
+    if (!device->online || (device->last_online > 0 && now - device->last_online < period) ||
+        (device->last_polled > 0 && now - device->last_polled < period) ||
+        this->status_poller.is_pending(device->mesh_id)) {
+      continue;
+    }
+    if (stalest == nullptr || device->last_online < stalest->last_online) {
+      stalest = device;
+    }
+  }
+  if (stalest == nullptr) {
+    return;
+  }
+
+  ESP_LOGV(TAG, "[%d] Poll status, last heard %d ms ago", stalest->mesh_id, now - stalest->last_online);
+  stalest->last_polled = now;
+  this->status_poller.queued(stalest->mesh_id, now);
+  this->queue_command(C_REQUEST_STATUS, {0x10}, stalest->mesh_id, PRIORITY_BACKGROUND, COMMAND_TTL_BACKGROUND);
 }
 
 void MeshDevice::request_status() {
   if (this->connected()) {
     ESP_LOGD(TAG, "[%d] [%s] request status update", this->get_conn_id(), this->address_str_.c_str());
+    this->status_sweep_started = esphome::millis();
+    this->last_status_report = this->status_sweep_started;
     this->write_command(C_REQUEST_STATUS, {0x10}, 0xffff);
   }
 }
 
+Device *MeshDevice::find_device(int mesh_id) {
+  auto found = std::find_if(this->devices_.begin(), this->devices_.end(),
+                            [mesh_id](const Device *_f) { return _f->mesh_id == mesh_id; });
+
+  return found != this->devices_.end() ? *found : nullptr;
+}
+
 Device *MeshDevice::get_device(int mesh_id) {
   ESP_LOGVV(TAG, "get device %d", mesh_id);
 
@@ -765,12 +1856,18 @@ bool MeshDevice::set_white_temperature(int dest, int temp) {
 
 bool MeshDevice::request_device_info(Device *device) {
   device->device_info_requested = esphome::millis();
-  this->queue_command(COMMAND_DEVICE_INFO_QUERY, {0x10, 0x00}, device->mesh_id);
+  // Asked again every few seconds until the device answers, a query still waiting in the queue is superseded
+  const int mesh_id = device->mesh_id;
+  this->command_queue.remove_if([mesh_id](const QueuedCommand &_f) {
+    return _f.dest == mesh_id && _f.command == COMMAND_DEVICE_INFO_QUERY;
+  });
+  this->queue_command(COMMAND_DEVICE_INFO_QUERY, {0x10, 0x00}, device->mesh_id, PRIORITY_BACKGROUND,
+                      COMMAND_TTL_BACKGROUND);
   return true;
 }
 
 bool MeshDevice::request_device_version(int dest) {
-  this->queue_command(COMMAND_DEVICE_INFO_QUERY, {0x10, 0x02}, dest);
+  this->queue_command(COMMAND_DEVICE_INFO_QUERY, {0x10, 0x02}, dest, PRIORITY_BACKGROUND, COMMAND_TTL_BACKGROUND);
   return true;
 }
 
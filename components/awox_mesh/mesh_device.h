@@ -1,15 +1,30 @@
 #pragma once
 
 #ifdef USE_ESP32
+#include <atomic>
 #include <cstring>
 #include <bitset>
+#include <map>
+#include <mutex>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include "esphome/core/component.h"
 #include "esphome/core/defines.h"
 #include "esphome/core/log.h"
+#include "esphome/core/preferences.h"
 #include "esphome/components/esp32_ble_client/ble_client_base.h"
 #include "esphome/components/esp32_ble_tracker/esp32_ble_tracker.h"
 #include "esphome/components/mqtt/mqtt_client.h"
 #include "device_info.h"
+#include "state_snapshot.h"
+#include "command_scheduler.h"
+#include "spsc_ring.h"
+#include "mesh_metrics.h"
+#include "latency_tracer.h"
+#include "packet_trace.h"
+#include "hub_cluster.h"
+#include "protocol_engine.h"
+#include "status_poller.h"
 
 namespace esphome {
 namespace awox_mesh {
@@ -34,11 +49,15 @@ static std::string uuid_pair_char = "00010203-0405-0607-0809-0a0b0c0d1914";
 #define C_COLOR_BRIGHTNESS 0xf2
 #define C_WHITE_BRIGHTNESS 0xf1
 #define C_WHITE_TEMPERATURE 0xf0
+#define C_SEQUENCE_FADE_DURATION 0xf6
 #define COMMAND_ADDRESS 0xE0
 #define COMMAND_ADDRESS_REPORT 0xE1
 #define COMMAND_DEVICE_INFO_QUERY 0xEA
 #define COMMAND_DEVICE_INFO_REPORT 0xEB
 
+/** Packet counter values reserved per flash write */
+#define PACKET_COUNT_WINDOW 4096
+
 static std::string TextToBinaryString(std::string words) {
   std::string binaryString = "";
   for (char &_char : words) {
@@ -47,99 +66,496 @@ static std::string TextToBinaryString(std::string words) {
   return binaryString;
 }
 
+/**
+ * How light transitions are played.
+ */
+enum TransitionSupport {
+  /**
+   * Native fades for devices that reported a transition mode, hub stepping for the others.
+   * The transition mode bit does not prove the firmware applies the fade duration (0xf6, documented for the color
+   * sequences) to plain brightness changes.
+   */
+  TRANSITION_AUTO = 0,
+  /** Always let the devices fade by themselves */
+  TRANSITION_NATIVE = 1,
+  /** Always step the brightness from the hub */
+  TRANSITION_HUB = 2,
+};
+
+/**
+ * Attributes requested for a single light, already converted to the device ranges.
+ */
+struct LightCommand {
+  bool has_state = false;
+  bool state = false;
+
+  bool has_color = false;
+  unsigned char R = 0;
+  unsigned char G = 0;
+  unsigned char B = 0;
+
+  bool has_color_brightness = false;
+  unsigned char color_brightness = 0;
+
+  bool has_white_brightness = false;
+  unsigned char white_brightness = 0;
+
+  bool has_temperature = false;
+  unsigned char temperature = 0;
+
+  /** Transition length in ms, only meaningful together with other attributes */
+  bool has_transition = false;
+  uint32_t transition = 0;
+
+  bool sets_attributes() const {
+    return this->has_color || this->has_color_brightness || this->has_white_brightness || this->has_temperature;
+  }
+
+  bool is_empty() const { return !this->has_state && !this->sets_attributes(); }
+
+  /**
+   * Packets the command took before commands were composed: one per attribute, plus a power packet unless an
+   * attribute already turned the light on.
+   */
+  int uncomposed_packets() const {
+    int packets = this->has_color + this->has_color_brightness + this->has_white_brightness + this->has_temperature;
+    if (this->has_state && (!this->state || packets == 0)) {
+      packets++;
+    }
+    return packets;
+  }
+
+  void merge(const LightCommand &other) {
+    // The device is either in color or in white mode, the latest command decides which
+    if (other.has_color || other.has_color_brightness) {
+      this->has_temperature = false;
+      this->has_white_brightness = false;
+    }
+    if (other.has_temperature || other.has_white_brightness) {
+      this->has_color = false;
+      this->has_color_brightness = false;
+    }
+    if (other.has_color) {
+      this->has_color = true;
+      this->R = other.R;
+      this->G = other.G;
+      this->B = other.B;
+    }
+    if (other.has_color_brightness) {
+      this->has_color_brightness = true;
+      this->color_brightness = other.color_brightness;
+    }
+    if (other.has_white_brightness) {
+      this->has_white_brightness = true;
+      this->white_brightness = other.white_brightness;
+    }
+    if (other.has_temperature) {
+      this->has_temperature = true;
+      this->temperature = other.temperature;
+    }
+    // The latest command decides how the change is played
+    this->has_transition = other.has_transition;
+    this->transition = other.transition;
+    if (other.has_state) {
+      this->has_state = true;
+      this->state = other.state;
+    } else if (other.sets_attributes()) {
+      // color, brightness and temperature turn the light on
+      this->has_state = true;
+      this->state = true;
+    }
+  }
+};
+
+/**
+ * Transition stepped by the hub for a device that can not fade by itself.
+ * Only the brightness is stepped, the other attributes are applied with the last step.
+ */
+struct HubTransition {
+  bool active = false;
+  /** Steps the color brightness instead of the white brightness */
+  bool color = false;
+  int from = 0;
+  int to = 0;
+  int steps = 0;
+  int step = 0;
+  uint32_t started = 0;
+  uint32_t duration = 0;
+  /** Desired state once the transition ends */
+  LightCommand target;
+  /** Brightness before a fade out, the light is turned back on at it */
+  int restore = 0;
+  bool restore_color = false;
+};
+
 struct Device {
   int mesh_id;
   bool send_discovery = false;
+  bool command_subscribed = false;
+  /** Hash of the last discovery topic and payload published, 0 when none */
+  uint32_t discovery_hash = 0;
+  /** Set once the retained config of the discovery format not in use was removed */
+  bool other_discovery_cleared = false;
   uint32_t last_online = 0;
+  /** Last status poll queued for the device, 0 when never polled */
+  uint32_t last_polled = 0;
   uint32_t device_info_requested = 0;
-  bool online;
+  bool online = false;
 
   std::string mac = "";
 
-  DeviceInfo *device_info;
+  DeviceInfo *device_info = nullptr;
 
   bool state = false;
   bool color_mode = false;
   bool transition_mode = false;
+  /** Set once the device reported a transition mode, its firmware fades by itself */
+  bool native_transition = false;
+  /** Fade duration in ms last written to the device */
+  uint32_t fade_duration = 0;
   unsigned char white_brightness;
   unsigned char temperature;
   unsigned char color_brightness;
   unsigned char R;
   unsigned char G;
   unsigned char B;
+
+  /**
+   * Requested attributes that are not yet confirmed by a status report of the device.
+   */
+  LightCommand desired;
+  uint32_t desired_sent_at = 0;
+  int desired_attempts = 0;
+
+  HubTransition hub_transition;
 };
 
-struct PublishOnlineStatus {
-  Device *device;
-  bool online;
-  uint32_t time;
+/**
+ * GATT handles of the mesh characteristics, cached per node so reconnecting skips the lookups.
+ */
+struct NodeHandles {
+  uint16_t notification = 0;
+  uint16_t command = 0;
+  uint16_t pair = 0;
+};
+
+/**
+ * Moments (millis) the phases of the last connection attempt completed.
+ */
+struct ConnectTiming {
+  uint32_t started = 0;
+  uint32_t open = 0;
+  uint32_t services = 0;
+  uint32_t pair = 0;
+  uint32_t notify = 0;
+  uint32_t first_status = 0;
 };
 
-struct QueuedCommand {
+/**
+ * A command that left the queue without being sent, kept until it is published.
+ */
+struct DroppedCommand {
   int command;
-  std::string data;
   int dest;
+  CommandPriority priority;
+  /** Time spent in the queue (ms) */
+  uint32_t age;
+  /** "dropped", "rejected" or "expired" */
+  const char *reason;
+};
+
+struct PublishOnlineStatus {
+  Device *device;
+  bool online;
+  uint32_t time;
 };
 
 class MeshDevice : public esp32_ble_client::BLEClientBase {
   /**
    * Packet counter used to tag transmitted packets.
+   * Nodes drop packets with a counter they saw recently, so the counter does not restart at boot: windows of
+   * PACKET_COUNT_WINDOW values are reserved in flash and the next boot resumes after the reserved window.
    */
   int packet_count = 1;
+  int packet_count_reserved = 0;
+  ESPPreferenceObject packet_count_pref;
+
+  void restore_packet_count();
+
+  void reserve_packet_count_window();
   uint32_t last_send_command = 0;
 
   DeviceInfoResolver *device_info_resolver = new DeviceInfoResolver();
 
   std::vector<Device *> devices_{};
   std::deque<PublishOnlineStatus> delayed_availability_publish{};
-  std::deque<QueuedCommand> command_queue{};
+  CommandScheduler command_queue{};
+
+  /**
+   * Notifications are only copied in the BLE callback. The protocol engine decrypts, filters and decodes them, loop()
+   * applies the reports to the devices and publishes what changed.
+   */
+  ProtocolEngine protocol_engine{};
+  uint32_t reported_overflows = 0;
+
+  MeshMetrics metrics{};
+
+  void process_notifications();
+
+  /**
+   * Optional protocol task on the other core that runs the protocol engine, without it loop() runs it.
+   */
+  bool use_protocol_task = false;
+  TaskHandle_t protocol_task_handle = nullptr;
+  /**
+   * Session as set by the BLE callbacks, which may run in another task. Guarded by session_lock, loop() copies it into
+   * session_key and reverse_address when session_changed is set.
+   */
+  std::mutex session_lock;
+  std::string shared_session_key;
+  std::string shared_reverse_address;
+  std::atomic<bool> session_changed{false};
+  /** Set by the pairing callback, loop() sends the first status request of the session */
+  std::atomic<bool> session_established{false};
+  /** Counted in the BLE callback, copied into metrics by loop() */
+  std::atomic<uint32_t> connects{0};
+
+  static void protocol_task(void *arg);
+
+  /**
+   * Connection parameters, intervals in units of 1.25 ms and timeout in units of 10 ms as used by the BLE stack.
+   */
+  bool conn_params_enabled = false;
+  uint16_t conn_params_fast_interval = 6;
+  uint16_t conn_params_idle_interval = 80;
+  uint16_t conn_params_idle_latency = 0;
+  uint16_t conn_params_timeout = 400;
+  uint32_t conn_params_idle_delay = 2000;
+  /** -1 unknown (node default), 0 idle, 1 fast */
+  int conn_params_mode = -1;
+  uint32_t conn_params_requested_at = 0;
+  uint32_t last_busy = 0;
+
+  uint16_t negotiated_interval = 0;
+  uint16_t negotiated_latency = 0;
+  uint16_t negotiated_timeout = 0;
+  /** Set by the BLE callback once the negotiated parameters are stored */
+  std::atomic<bool> connection_parameters_updated{false};
+
+  void update_connection_parameters();
+
+  /**
+   * Link quality of the connected node, used by AwoxMesh to decide on a handover.
+   */
+  /** Written by the RSSI read callback */
+  std::atomic<int> link_rssi{0};
+  uint32_t last_rssi_request = 0;
+  int consecutive_write_failures = 0;
+  int unanswered_status_sweeps = 0;
+
+  void request_connection_parameters(bool fast);
+
+  void publish_connection_diagnostics();
+
+  StateSnapshot state_snapshot{};
+  uint32_t status_sweep_started = 0;
+  uint32_t last_status_report = 0;
+
+  StatusPoller status_poller{};
+
+  /**
+   * Requests the status of the device heard from the longest ago, when the poll budget allows it.
+   */
+  void poll_status();
 
   std::function<void()> disconnect_callback;
 
+  /**
+   * Set by the disconnect event, the state of the session is reset at the start of the next loop().
+   */
+  std::atomic<bool> disconnected{false};
+
+  void reset_session();
+
   std::string mesh_name = "";
   std::string mesh_password = "";
+  std::string topic_namespace = "";
   std::string random_key;
+  /** Owned by loop(), see shared_session_key */
   std::string session_key;
-
   std::string reverse_address;
 
-  esp32_ble_client::BLECharacteristic *notification_char;
-  esp32_ble_client::BLECharacteristic *command_char;
-  esp32_ble_client::BLECharacteristic *pair_char;
+  NodeHandles handles{};
+  std::map<uint64_t, NodeHandles> node_handles{};
+
+  ConnectTiming connect_timing{};
 
   void setup_connection();
 
+  bool resolve_handles();
+
+  esp_err_t write_char(uint16_t handle, uint8_t *data, uint16_t length);
+
+  void publish_connect_timing();
+
   std::string combine_name_and_password() const;
 
-  void generate_session_key(const std::string &data1, const std::string &data2);
+  /** BLE callback side. \returns the new session key. */
+  std::string generate_session_key(const std::string &data1, const std::string &data2);
 
   std::string key_encrypt(std::string &key) const;
 
   std::string encrypt_packet(std::string &packet) const;
 
-  std::string decrypt_packet(std::string &packet) const;
-
   std::string build_packet(int dest, int command, const std::string &data);
 
-  void handle_packet(std::string &packet);
+  void handle_report(const MeshReport &report, bool changed, uint32_t received_at);
 
   Device *get_device(int dest);
 
+  Device *find_device(int mesh_id);
+
   std::string device_state_as_string(Device *device);
 
   std::string get_discovery_topic_(const esphome::mqtt::MQTTDiscoveryInfo &discovery_info, Device *device) const;
 
+  /**
+   * Topic prefix of this mesh, the MQTT topic prefix with the namespace of the mesh appended when set.
+   */
+  std::string get_topic_prefix_() const;
+
   std::string get_mqtt_topic_for_(Device *device, const std::string &suffix) const;
 
+  /**
+   * Handles a device of which the MAC is known: publishes its discovery and listens for commands.
+   */
   void send_discovery(Device *device);
 
+  /**
+   * Publishes the discovery of the device when it differs from the last one published.
+   */
+  void publish_discovery(Device *device);
+
+  /** One device based message with abbreviated keys instead of one message per entity */
+  bool compact_discovery = false;
+
+  void build_discovery_(Device *device, JsonObject root);
+
+  /**
+   * Cluster of hubs on the same mesh, null when this is the only hub.
+   * Only the leader publishes and sweeps, commands are sent by the hub responsible for the destination.
+   */
+  HubCluster *cluster = nullptr;
+
+  bool is_leader() const;
+
+  bool is_responsible(Device *device) const;
+
   void publish_state(Device *device);
 
   void publish_availability(Device *device, bool delayed);
 
+  void publish_state_snapshot();
+
+  void update_state_snapshot(Device *device);
+
+  LightCommand parse_light_command(Device *device, JsonObject root);
+
+  /**
+   * Translates a light command into the packets to send.
+   * With skip_known set, attributes that already match the reported state of the device are left out.
+   */
+  std::vector<QueuedCommand> compile_light_command(Device *device, const LightCommand &command,
+                                                   bool skip_known) const;
+
+  void apply_light_command(Device *device, const LightCommand &command);
+
   void process_incomming_command(Device *device, JsonObject root);
 
-  void queue_command(int command, const std::string &data, int dest = 0);
+  /**
+   * Transitions: played by the device with a fade duration packet, or stepped by the hub within a step budget.
+   */
+  TransitionSupport transition_support = TRANSITION_HUB;
+  int transition_max_steps = 8;
+  uint32_t effect_transition = 1000;
+
+  bool has_native_transition(Device *device) const;
+
+  /**
+   * Starts stepping the brightness towards the command from the hub.
+   * \returns false when the command has nothing to step, it is then applied at once.
+   */
+  bool start_hub_transition(Device *device, const LightCommand &command);
+
+  void step_hub_transitions();
+  /** Drops the queued light packets of a device whose hub transition was cancelled or finished */
+  void remove_transition_steps(Device *device);
+
+  /**
+   * Queue the packets for the desired attributes that differ from the reported state.
+   * \param received_at : time the command was received on MQTT, 0 for retries.
+   * \param ttl : time to live of the packets in the queue, 0 for the default of the queue.
+   * \returns the number of packets queued.
+   */
+  int reconcile(Device *device, CommandPriority priority, uint32_t received_at = 0, uint32_t ttl = 0);
+
+  /**
+   * Drop the desired attributes that the last status report of the device confirms.
+   */
+  void confirm_desired(Device *device);
+
+  bool has_queued_light_command(int dest) const;
+
+  void process_batch_command(JsonObject root);
+
+  /** Id of the last batch message, tags its packets in the queue */
+  uint16_t last_batch = 0;
+
+  void queue_command(int command, const std::string &data, int dest = 0,
+                     CommandPriority priority = PRIORITY_INTERACTIVE, uint32_t ttl = 0);
+
+  /**
+   * Queue the packets composed for one light command.
+   * Packets still waiting in the queue for the same destination and opcode are dropped, they are superseded.
+   */
+  void queue_light_commands(const std::vector<QueuedCommand> &commands, CommandPriority priority, uint32_t ttl = 0);
+
+  /**
+   * Pushes a command, a full queue is handled according to the admission policy.
+   * \returns false when the command is rejected.
+   */
+  bool admit_command(const QueuedCommand &item);
+
+  /**
+   * Rejected, dropped and expired commands, published on <prefix>/mesh/diagnostics/dropped at most once a second.
+   */
+  std::vector<DroppedCommand> dropped_commands{};
+  uint32_t dropped_commands_total = 0;
+  uint32_t last_dropped_publish = 0;
+
+  void report_dropped_command(const QueuedCommand &item, const char *reason);
+
+  void publish_dropped_commands();
+
+  void publish_queue_diagnostics();
+
+  LatencyTracer latency_tracer{};
+
+  /**
+   * Commands from the command topics and the packets they took, against what they took before composition.
+   */
+  uint32_t composed_commands = 0;
+  uint32_t composed_packets = 0;
+  uint32_t uncomposed_packets = 0;
+  /** Command received on MQTT until one of its packets is written */
+  LatencyStats receive_to_send{};
+
+  void publish_latency_diagnostics();
+
+  PacketTrace packet_trace{};
+
+  /** Publishes the recorded packets on <prefix>/mesh/trace. */
+  void publish_packet_trace();
 
   virtual void set_state(esp32_ble_tracker::ClientState st) override {
     this->state_ = st;
@@ -196,19 +612,69 @@ class MeshDevice : public esp32_ble_client::BLEClientBase {
     ESP_LOGI("MeshDevice", "password: %s", mesh_password.c_str());
     this->mesh_password = mesh_password;
   }
+  void set_cluster(HubCluster *cluster) { this->cluster = cluster; }
+  void on_leadership_changed(bool leader);
+  void set_topic_namespace(const std::string &topic_namespace) { this->topic_namespace = topic_namespace; }
+  const std::string &get_mesh_name() const { return this->mesh_name; }
+  void set_state_snapshot_interval(uint32_t interval) { this->state_snapshot.set_interval(interval); }
+  void set_state_snapshot_deltas(bool deltas) { this->state_snapshot.set_deltas(deltas); }
+  void set_state_snapshot_format(SnapshotFormat format) { this->state_snapshot.set_format(format); }
+  void set_connection_parameters(uint16_t fast_interval, uint16_t idle_interval, uint16_t idle_latency,
+                                 uint16_t timeout, uint32_t idle_delay) {
+    this->conn_params_enabled = true;
+    this->conn_params_fast_interval = fast_interval;
+    this->conn_params_idle_interval = idle_interval;
+    this->conn_params_idle_latency = idle_latency;
+    this->conn_params_timeout = timeout;
+    this->conn_params_idle_delay = idle_delay;
+  }
+
+  void setup() override;
 
   void loop() override;
 
+  void connect() override;
+
   void on_shutdown() override;
 
   bool gattc_event_handler(esp_gattc_cb_event_t event, esp_gatt_if_t gattc_if,
                            esp_ble_gattc_cb_param_t *param) override;
 
+  void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param) override;
+
+  void set_packet_trace_size(int size) { this->packet_trace.set_size(size); }
+
+  void set_command_queue(int capacity, AdmissionPolicy policy, uint32_t ttl) {
+    this->command_queue.set_capacity(capacity);
+    this->command_queue.set_policy(policy);
+    this->command_queue.set_ttl(ttl);
+  }
+
+  void set_light_curve(int product_id, float gamma, float min_level, int min_mireds, int max_mireds) {
+    this->device_info_resolver->set_curve(product_id, gamma, min_level, min_mireds, max_mireds);
+  }
+
+  void set_compact_discovery(bool compact_discovery) { this->compact_discovery = compact_discovery; }
+
+  void set_status_polling(uint32_t period, int in_flight) {
+    this->status_poller.set_period(period);
+    this->status_poller.set_in_flight_limit(in_flight);
+  }
+
+  void set_transitions(TransitionSupport support, int max_steps, uint32_t effect_transition) {
+    this->transition_support = support;
+    this->transition_max_steps = max_steps;
+    this->effect_transition = effect_transition;
+  }
+
+  void set_protocol_task(bool use_protocol_task) { this->use_protocol_task = use_protocol_task; }
+
   void set_address(uint64_t address) {
     BLEClientBase::set_address(address);
+    std::lock_guard<std::mutex> lock(this->session_lock);
 
     if (address == 0) {
-      this->reverse_address = "";
+      this->shared_reverse_address = "";
     } else {
       unsigned char buf[6];
       buf[0] = (address >> 0) & 0xff;
@@ -218,12 +684,35 @@ class MeshDevice : public esp32_ble_client::BLEClientBase {
       buf[4] = (address >> 32) & 0xff;
       buf[5] = (address >> 40) & 0xff;
 
-      this->reverse_address = std::string((char *) buf, 6);
+      this->shared_reverse_address = std::string((char *) buf, 6);
     }
+    this->session_changed.store(true);
   };
 
   void set_disconnect_callback(std::function<void()> &&f);
 
+  const MeshMetrics &get_metrics() const { return this->metrics; }
+
+  int get_queue_depth() const { return this->command_queue.size(); }
+
+  int get_queue_high_water_mark() const { return this->command_queue.get_high_water_mark(); }
+
+  /**
+   * Counts the known devices, undiscovered ones are those of which the MAC report is not yet received.
+   */
+  void count_devices(int &online, int &offline, int &undiscovered) const;
+
+  /** RSSI of the connected node, 0 when not yet known. */
+  int get_link_rssi() const { return this->link_rssi.load(); }
+
+  /**
+   * \returns true when the connected node is weak, writes fail or status requests go unanswered.
+   */
+  bool is_link_degraded(int rssi_threshold) const {
+    return (this->link_rssi != 0 && this->link_rssi < rssi_threshold) || this->consecutive_write_failures >= 3 ||
+           this->unanswered_status_sweeps > 0;
+  }
+
   bool write_command(int command, const std::string &data, int dest = 0, bool withResponse = false);
 
   void request_status();
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+namespace esphome {
+namespace awox_mesh {
+
+/**
+ * Counters of the mesh connection, only plain increments on the hot paths.
+ * They only grow, rates are derived by the reporter from the difference between two reads.
+ */
+struct MeshMetrics {
+  uint32_t commands_sent = 0;
+  /** Counted by the protocol engine as the BLE callback pushes them */
+  uint32_t notifications_received = 0;
+  uint32_t notifications_decoded = 0;
+  uint32_t unknown_reports = 0;
+  /** Notifications that could not be decrypted or parsed */
+  uint32_t failures = 0;
+  /** Notifications dropped on a MAC mismatch, counted where they are decrypted */
+  uint32_t mac_failures = 0;
+  /** Relayed copies of a notification that was already handled */
+  uint32_t duplicates = 0;
+  /** State, availability and discovery publishes */
+  uint32_t publishes = 0;
+  uint32_t connects = 0;
+
+  void add(const MeshMetrics &other) {
+    this->commands_sent += other.commands_sent;
+    this->notifications_received += other.notifications_received;
+    this->notifications_decoded += other.notifications_decoded;
+    this->unknown_reports += other.unknown_reports;
+    this->failures += other.failures;
+    this->mac_failures += other.mac_failures;
+    this->duplicates += other.duplicates;
+    this->publishes += other.publishes;
+    this->connects += other.connects;
+  }
+};
+
+enum MetricType {
+  METRIC_QUEUE_DEPTH = 0,
+  METRIC_QUEUE_HIGH_WATER,
+  METRIC_COMMANDS_RATE,
+  METRIC_NOTIFICATIONS_RATE,
+  METRIC_DECODED_RATE,
+  METRIC_UNKNOWN_REPORTS,
+  METRIC_FAILURES,
+  METRIC_PUBLISHES,
+  METRIC_DEVICES_ONLINE,
+  METRIC_DEVICES_OFFLINE,
+  METRIC_DEVICES_UNDISCOVERED,
+  METRIC_SCANNER_CANDIDATES,
+  METRIC_RECONNECTS,
+  METRIC_MAC_FAILURES,
+  METRIC_DUPLICATES,
+  METRIC_SCAN_DUTY,
+};
+
+#define METRIC_COUNT 16
+
+}  // namespace awox_mesh
+}  // namespace esphome
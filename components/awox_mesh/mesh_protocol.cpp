@@ -0,0 +1,212 @@
+#include <algorithm>
+
+#include <AES.h>
+#include <Crypto.h>
+
+#include "mesh_protocol.h"
+#include "profiler.h"
+#include "esphome/core/log.h"
+
+namespace esphome {
+namespace awox_mesh {
+
+static const char *const TAG = "mesh_protocol";
+
+/** \fn static std::string encrypt(std::string key, std::string data)
+ *  \brief Encrypts a n x 16-byte data string with a 16-byte key, using AES encryption.
+ *  \param key : 16-byte encryption key.
+ *  \param data : n x 16-byte data string
+ *  \returns the encrypted data string.
+ */
+static std::string encrypt(std::string key, std::string data) {
+  AWOX_PROFILE("encrypt");
+  std::reverse(key.begin(), key.end());
+  std::reverse(data.begin(), data.end());
+
+  unsigned char buffer[16];
+  auto aes128 = AES128();
+
+  if (!aes128.setKey((uint8_t *) key.c_str(), key.size())) {
+    ESP_LOGE(TAG, "Failed to set key");
+  }
+  aes128.encryptBlock(buffer, (uint8_t *) data.c_str());
+
+  std::string result = std::string((char *) buffer, 16);
+
+  std::reverse(result.begin(), result.end());
+
+  return result;
+}
+
+std::string combine_name_and_password(const std::string &mesh_name, const std::string &mesh_password) {
+  std::string data;
+  std::string name = mesh_name;
+  std::string password = mesh_password;
+  name.append(16 - name.size(), 0);
+  password.append(16 - password.size(), 0);
+
+  for (int i = 0; i < 16; i++) {
+    data.push_back(name[i] ^ password[i]);
+  }
+
+  return data;
+}
+
+std::string key_encrypt(const std::string &mesh_name, const std::string &mesh_password, const std::string &key) {
+  std::string data = combine_name_and_password(mesh_name, mesh_password);
+  std::string e_key = key;
+  e_key.append(16 - e_key.size(), 0);
+
+  return encrypt(e_key, data);
+}
+
+std::string generate_session_key(const std::string &mesh_name, const std::string &mesh_password,
+                                 const std::string &data1, const std::string &data2) {
+  std::string key = combine_name_and_password(mesh_name, mesh_password);
+
+  return encrypt(key, data1.substr(0, 8) + data2.substr(0, 8));
+}
+
+std::string build_packet(int packet_count, int dest, int command, const std::string &data) {
+  /* Telink mesh packets take the following form:
+ bytes 0-1   : packet counter
+ bytes 2-4   : not used (=0)
+ bytes 5-6   : mesh ID
+ bytes 7     : command code
+ bytes 8-9   : vendor code
+ bytes 10-20 : command data
+
+All multi-byte elements are in little-endian form.
+Packet counter runs between 1 and 0xffff.
+*/
+  std::string packet;
+  packet.resize(20, 0);
+  packet[0] = packet_count & 0xff;
+  packet[1] = (packet_count >> 8) & 0xff;
+  packet[5] = dest & 0xff;
+  packet[6] = (dest >> 8) & 0xff;
+  packet[7] = command & 0xff;
+  packet[8] = 0x60;  // vendor & 0xff;
+  packet[9] = 0x01;  // (vendor >> 8) & 0xff;
+  for (size_t i = 0; i < data.size(); i++)
+    packet[i + 10] = data[i];
+
+  return packet;
+}
+
+std::string encrypt_packet(const std::string &session_key, const std::string &reverse_address, std::string &packet) {
+  AWOX_PROFILE("encrypt_packet");
+  std::string auth_nonce = reverse_address.substr(0, 4) + '\1' + packet.substr(0, 3) + '\x0f';
+  auth_nonce.append(7, 0);
+  std::string authenticator;
+
+  authenticator = encrypt(session_key, auth_nonce);
+
+  for (int i = 0; i < 15; i++)
+    authenticator[i] ^= packet[i + 5];
+
+  std::string mac;
+
+  mac = encrypt(session_key, authenticator);
+
+  for (int i = 0; i < 2; i++)
+    packet[i + 3] = mac[i];
+
+  std::string iv = '\0' + reverse_address.substr(0, 4) + '\1' + packet.substr(0, 3);
+  iv.append(7, 0);
+
+  std::string buffer;
+  buffer = encrypt(session_key, iv);
+
+  for (int i = 0; i < 15; i++)
+    packet[i + 5] ^= buffer[i];
+
+  return packet;
+}
+
+std::string decrypt_packet(const std::string &session_key, const std::string &reverse_address, std::string &packet) {
+  AWOX_PROFILE("decrypt_packet");
+  std::string iv = '\0' + reverse_address.substr(0, 3) + packet.substr(0, 5);
+  iv.append(7, 0);
+
+  std::string result;
+
+  result = encrypt(session_key, iv);
+
+  for (size_t i = 0; i < packet.size() - 7; i++)
+    packet[i + 7] ^= result[i];
+
+  return packet;
+}
+
+bool check_packet_mac(const std::string &session_key, const std::string &reverse_address, const std::string &packet) {
+  AWOX_PROFILE("check_packet_mac");
+  if (packet.size() < 8 || packet.size() > 23) {
+    return false;
+  }
+  // Same nonce as the decryption, followed by the payload length
+  std::string auth_nonce = reverse_address.substr(0, 3) + packet.substr(0, 5) + static_cast<char>(packet.size() - 7);
+  auth_nonce.append(7, 0);
+
+  std::string authenticator;
+
+  authenticator = encrypt(session_key, auth_nonce);
+
+  for (size_t i = 0; i < packet.size() - 7; i++)
+    authenticator[i] ^= packet[i + 7];
+
+  std::string mac;
+
+  mac = encrypt(session_key, authenticator);
+
+  return mac[0] == packet[5] && mac[1] == packet[6];
+}
+
+bool parse_report(const std::string &packet, MeshReport &report) {
+  AWOX_PROFILE("parse_report");
+  if (packet.size() != 20) {
+    return false;
+  }
+  auto byte = [&packet](int i) { return static_cast<uint8_t>(packet[i]); };
+
+  report = {};
+  report.opcode = byte(7);
+  report.mesh_id = byte(4) * 256 + byte(3);
+
+  int offset;
+  if (report.opcode == 0xDC) {
+    report.mesh_id = byte(19) * 256 + byte(10);
+    report.online = packet[11] > 0;
+    offset = 12;
+  } else if (report.opcode == 0xDB) {
+    report.online = true;
+    offset = 10;
+  } else if (report.opcode == 0xD8 && byte(10) == 0) {
+    report.type = REPORT_MAC;
+    report.product[0] = byte(11);
+    report.product[1] = byte(12);
+    for (int i = 0; i < 4; i++) {
+      report.mac[i] = byte(13 + i);
+    }
+    return true;
+  } else {
+    report.type = REPORT_UNKNOWN;
+    return true;
+  }
+
+  int mode = byte(offset);
+  report.type = REPORT_STATUS;
+  report.state = (mode & 1) == 1;
+  report.color_mode = ((mode >> 1) & 1) == 1;
+  report.transition_mode = ((mode >> 2) & 1) == 1;
+  report.white_brightness = byte(offset + 1);
+  report.temperature = byte(offset + 2);
+  report.color_brightness = byte(offset + 3);
+  report.R = byte(offset + 4);
+  report.G = byte(offset + 5);
+  report.B = byte(offset + 6);
+  return true;
+}
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace esphome {
+namespace awox_mesh {
+
+/*
+ * Telink mesh pairing, session key and packet crypto.
+ * Only depends on the AES implementation of the Crypto library, so it can be shared with anything that needs to talk
+ * the mesh protocol outside of ESPHome.
+ */
+
+/** \fn std::string combine_name_and_password(const std::string &mesh_name, const std::string &mesh_password)
+ *  \brief XORs the mesh name and password, both zero padded to 16 bytes.
+ */
+std::string combine_name_and_password(const std::string &mesh_name, const std::string &mesh_password);
+
+/** \fn std::string key_encrypt(const std::string &mesh_name, const std::string &mesh_password, const std::string &key)
+ *  \brief Encrypts the combined mesh credentials with a (random) key, used in the pair request.
+ *  \param key : up to 16-byte key, zero padded.
+ */
+std::string key_encrypt(const std::string &mesh_name, const std::string &mesh_password, const std::string &key);
+
+/** \fn std::string generate_session_key(...)
+ *  \brief Derives the session key from the credentials, our random key and the random key of the node.
+ *  \param data1 : 8-byte random key sent in the pair request.
+ *  \param data2 : 8-byte random key from the pair response.
+ */
+std::string generate_session_key(const std::string &mesh_name, const std::string &mesh_password,
+                                 const std::string &data1, const std::string &data2);
+
+/** \fn std::string build_packet(int packet_count, int dest, int command, const std::string &data)
+ *  \brief Builds a plain 20-byte command packet.
+ */
+std::string build_packet(int packet_count, int dest, int command, const std::string &data);
+
+/** \fn std::string encrypt_packet(...)
+ *  \brief Adds the MAC to a command packet and encrypts it (in place).
+ *  \param reverse_address : address of the connected node, least significant byte first.
+ */
+std::string encrypt_packet(const std::string &session_key, const std::string &reverse_address, std::string &packet);
+
+/** \fn std::string decrypt_packet(...)
+ *  \brief Decrypts a notification (in place).
+ *  \param reverse_address : address of the connected node, least significant byte first.
+ */
+std::string decrypt_packet(const std::string &session_key, const std::string &reverse_address, std::string &packet);
+
+/** \fn bool check_packet_mac(...)
+ *  \brief Checks the 2-byte MAC (bytes 5-6) of a decrypted notification against its payload.
+ *  \param reverse_address : address of the connected node, least significant byte first.
+ */
+bool check_packet_mac(const std::string &session_key, const std::string &reverse_address, const std::string &packet);
+
+enum ReportType {
+  REPORT_UNKNOWN = 0,
+  /** Online status report (0xDC) or status report (0xDB) */
+  REPORT_STATUS,
+  /** MAC report (0xD8) */
+  REPORT_MAC,
+};
+
+/**
+ * A decoded notification.
+ */
+struct MeshReport {
+  ReportType type;
+  int opcode;
+  /** Node the report is about, an online status report can be relayed by another node */
+  int mesh_id;
+  bool online;
+  bool state;
+  bool color_mode;
+  bool transition_mode;
+  uint8_t white_brightness;
+  uint8_t temperature;
+  uint8_t color_brightness;
+  uint8_t R, G, B;
+  /** Product bytes of a MAC report */
+  uint8_t product[2];
+  /** Last 4 bytes of the MAC, as sent (least significant byte first) */
+  uint8_t mac[4];
+
+  /** Same light state and availability */
+  bool same_state(const MeshReport &other) const {
+    return this->online == other.online && this->state == other.state && this->color_mode == other.color_mode &&
+           this->transition_mode == other.transition_mode && this->white_brightness == other.white_brightness &&
+           this->temperature == other.temperature && this->color_brightness == other.color_brightness &&
+           this->R == other.R && this->G == other.G && this->B == other.B;
+  }
+};
+
+/** \fn bool parse_report(const std::string &packet, MeshReport &report)
+ *  \brief Decodes a decrypted 20-byte notification.
+ *  \returns false for a packet of another length, an unknown report is decoded as REPORT_UNKNOWN.
+ */
+bool parse_report(const std::string &packet, MeshReport &report);
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace awox_mesh {
+
+enum TraceDirection {
+  TRACE_RX = 0,
+  TRACE_TX = 1,
+};
+
+/**
+ * One traced packet, 28 bytes.
+ * A dump is a plain concatenation of these records, oldest first (multi-byte fields little-endian).
+ */
+struct TraceRecord {
+  uint32_t time;
+  uint8_t direction;
+  uint8_t opcode;
+  /** Source of received packets, destination of transmitted packets */
+  uint16_t mesh_id;
+  /** Plain (decrypted) packet */
+  uint8_t packet[20];
+} __attribute__((packed));
+
+/**
+ * Keeps the last packets in RAM, the oldest record is overwritten when full.
+ * Recording is a copy into a preallocated slot, nothing is formatted until the trace is dumped.
+ */
+class PacketTrace {
+  std::vector<TraceRecord> records_{};
+  uint32_t next_ = 0;
+  uint32_t count_ = 0;
+
+ public:
+  void set_size(int size) {
+    this->records_.resize(size);
+    this->next_ = 0;
+    this->count_ = 0;
+  }
+
+  bool is_enabled() const { return !this->records_.empty(); }
+
+  void record(TraceDirection direction, const std::string &packet, uint32_t now) {
+    if (this->records_.empty() || packet.size() < 8) {
+      return;
+    }
+
+    TraceRecord &record = this->records_[this->next_];
+    record.time = now;
+    record.direction = direction;
+    record.opcode = packet[7];
+    // rx: source in bytes 3-4, tx: destination in bytes 5-6
+    int offset = direction == TRACE_RX ? 3 : 5;
+    record.mesh_id = static_cast<uint8_t>(packet[offset]) | (static_cast<uint8_t>(packet[offset + 1]) << 8);
+    memset(record.packet, 0, sizeof(record.packet));
+    memcpy(record.packet, packet.data(), std::min(packet.size(), sizeof(record.packet)));
+
+    this->next_ = (this->next_ + 1) % this->records_.size();
+    this->count_ = std::min<uint32_t>(this->count_ + 1, this->records_.size());
+  }
+
+  /** \returns the recorded packets as binary records, oldest first. */
+  std::string dump() const {
+    std::string result;
+    if (this->count_ == 0) {
+      return result;
+    }
+    result.reserve(this->count_ * sizeof(TraceRecord));
+    uint32_t first = (this->next_ + this->records_.size() - this->count_) % this->records_.size();
+    for (uint32_t i = 0; i < this->count_; i++) {
+      const TraceRecord &record = this->records_[(first + i) % this->records_.size()];
+      result.append((const char *) &record, sizeof(TraceRecord));
+    }
+    return result;
+  }
+
+  void clear() {
+    this->next_ = 0;
+    this->count_ = 0;
+  }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,102 @@
+#pragma once
+
+/*
+ * Scoped profiling of the hot functions, only compiled in with the AWOX_MESH_PROFILING define (the `profiling` option).
+ * Without it AWOX_PROFILE() expands to nothing.
+ */
+
+#ifdef AWOX_MESH_PROFILING
+
+#include <atomic>
+#include <cstdint>
+
+#ifdef USE_ESP32
+#include "esphome/core/hal.h"
+#else
+#include <chrono>
+#endif
+
+namespace esphome {
+namespace awox_mesh {
+
+/** CPU cycles on the ESP32, nanoseconds of a monotonic clock on a host build. */
+inline uint32_t profile_ticks() {
+#ifdef USE_ESP32
+  return arch_get_cpu_cycle_count();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+/**
+ * Statistics of one profiled function.
+ * Sections add themselves to a global list on first use, the list is only ever prepended so reading it is safe.
+ * Updates from the protocol task and the loop may race, good enough for profiling.
+ */
+class ProfileSection {
+ public:
+  explicit ProfileSection(const char *name) : name(name) {
+    ProfileSection *head = first_().load();
+    do {
+      this->next = head;
+    } while (!first_().compare_exchange_weak(head, this));
+  }
+
+  void add(uint32_t ticks) {
+    this->count++;
+    this->total += ticks;
+    if (ticks < this->min) {
+      this->min = ticks;
+    }
+    if (ticks > this->max) {
+      this->max = ticks;
+    }
+  }
+
+  void reset() {
+    this->count = 0;
+    this->total = 0;
+    this->min = UINT32_MAX;
+    this->max = 0;
+  }
+
+  uint32_t avg() const { return this->count > 0 ? this->total / this->count : 0; }
+
+  static ProfileSection *first() { return first_().load(); }
+
+  const char *name;
+  uint32_t count = 0;
+  uint64_t total = 0;
+  uint32_t min = UINT32_MAX;
+  uint32_t max = 0;
+  ProfileSection *next = nullptr;
+
+ protected:
+  static std::atomic<ProfileSection *> &first_() {
+    static std::atomic<ProfileSection *> first{nullptr};
+    return first;
+  }
+};
+
+class ScopedProfile {
+  ProfileSection *section_;
+  uint32_t start_;
+
+ public:
+  explicit ScopedProfile(ProfileSection *section) : section_(section), start_(profile_ticks()) {}
+  ~ScopedProfile() { this->section_->add(profile_ticks() - this->start_); }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
+
+#define AWOX_PROFILE(name) \
+  static esphome::awox_mesh::ProfileSection _profile_section(name); \
+  esphome::awox_mesh::ScopedProfile _scoped_profile(&_profile_section)
+
+#else
+
+#define AWOX_PROFILE(name)
+
+#endif  // AWOX_MESH_PROFILING
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "mesh_protocol.h"
+#include "relay_filter.h"
+#include "spsc_ring.h"
+
+namespace esphome {
+namespace awox_mesh {
+
+/**
+ * A notification after the protocol engine, handed to loop().
+ */
+struct DecodedNotification {
+  /** Decrypted packet, for the packet trace */
+  RawNotification packet;
+  MeshReport report;
+  /** Relayed copy of a notification that was already handed over, only for the trace and the counters */
+  bool duplicate;
+  /** Status report that differs from the last one of the node, the rest only refreshes its last seen time */
+  bool changed;
+};
+
+/**
+ * Receive side of the mesh protocol: decryption, MAC check, relay filter, decoding and the last reported state of
+ * every node. Runs in the protocol task, or without one in loop() itself.
+ * The BLE callback pushes raw notifications, loop() pops decoded ones, both through lock-free rings. Only plain
+ * C++, the host tests run the same pipeline with a std::thread.
+ */
+class ProtocolEngine {
+  struct NodeState {
+    int mesh_id;
+    MeshReport report;
+  };
+
+  NotificationRing<32> notifications_{};
+  SpscRing<DecodedNotification, 32> decoded_{};
+
+  /** Session of the connection, set from loop() or the BLE callbacks */
+  std::mutex session_lock_;
+  std::string session_key_;
+  std::string reverse_address_;
+  uint32_t session_generation_ = 0;
+
+  /** Owned by the engine side */
+  uint32_t generation_ = 0;
+  RelayFilter relay_filter_{};
+  std::vector<NodeState> nodes_{};
+
+  std::atomic<uint32_t> received_{0};
+  std::atomic<uint32_t> mac_failures_{0};
+  std::atomic<uint32_t> malformed_{0};
+
+  bool update_node_(const MeshReport &report) {
+    for (auto &node : this->nodes_) {
+      if (node.mesh_id == report.mesh_id) {
+        bool changed = !node.report.same_state(report);
+        node.report = report;
+        return changed;
+      }
+    }
+    this->nodes_.push_back({report.mesh_id, report});
+    return true;
+  }
+
+ public:
+  /** BLE callback side. \returns false when the ring is full. */
+  bool push_notification(const uint8_t *data, uint16_t length, uint32_t received_at) {
+    this->received_.fetch_add(1, std::memory_order_relaxed);
+    return this->notifications_.push(data, length, received_at);
+  }
+
+  /** A new session, or none with an empty key. Relayed sequence numbers restart with it. */
+  void set_session(const std::string &session_key, const std::string &reverse_address) {
+    std::lock_guard<std::mutex> lock(this->session_lock_);
+    this->session_key_ = session_key;
+    this->reverse_address_ = reverse_address;
+    this->session_generation_++;
+  }
+
+  /**
+   * Engine side, the protocol task or loop().
+   * \param budget : most notifications handled in one call.
+   * \returns the number of notifications taken from the ring.
+   */
+  int process(int budget) {
+    std::string session_key;
+    std::string reverse_address;
+    uint32_t generation;
+    {
+      std::lock_guard<std::mutex> lock(this->session_lock_);
+      session_key = this->session_key_;
+      reverse_address = this->reverse_address_;
+      generation = this->session_generation_;
+    }
+    if (generation != this->generation_) {
+      this->generation_ = generation;
+      this->relay_filter_.clear();
+    }
+    if (session_key.empty()) {
+      // Left over from a previous session, can not be decrypted anymore
+      this->notifications_.clear();
+      return 0;
+    }
+
+    int processed = 0;
+    RawNotification raw;
+    // Stops while loop() is behind, the notifications wait in the ring they arrived in
+    while (processed < budget && !this->decoded_.full() && this->notifications_.pop(raw)) {
+      processed++;
+      std::string packet = std::string((char *) raw.data, raw.length);
+      decrypt_packet(session_key, reverse_address, packet);
+      if (!check_packet_mac(session_key, reverse_address, packet)) {
+        this->mac_failures_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      DecodedNotification decoded{};
+      decoded.packet = raw;
+      memcpy(decoded.packet.data, packet.data(), packet.size());
+      if (!parse_report(packet, decoded.report)) {
+        this->malformed_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      int source = (static_cast<uint8_t>(packet[4]) << 8) | static_cast<uint8_t>(packet[3]);
+      uint32_t sequence = (static_cast<uint8_t>(packet[2]) << 16) | (static_cast<uint8_t>(packet[1]) << 8) |
+                          static_cast<uint8_t>(packet[0]);
+      decoded.duplicate = this->relay_filter_.is_duplicate(source, sequence);
+      if (!decoded.duplicate && decoded.report.type == REPORT_STATUS) {
+        decoded.changed = this->update_node_(decoded.report);
+      }
+      this->decoded_.push(decoded);
+    }
+    return processed;
+  }
+
+  /** loop() side. */
+  bool pop(DecodedNotification &decoded) { return this->decoded_.pop(decoded); }
+
+  /** loop() side, drops the decoded notifications of a previous session. */
+  void clear() { this->decoded_.clear(); }
+
+  /** Notifications dropped on a full ring, on the way in or out. */
+  uint32_t get_overflows() const { return this->notifications_.get_overflows() + this->decoded_.get_overflows(); }
+  uint32_t get_high_water_mark() const { return this->notifications_.get_high_water_mark(); }
+  /** Notifications pushed by the BLE callback, dropped ones included. */
+  uint32_t get_received() const { return this->received_.load(std::memory_order_relaxed); }
+  uint32_t get_mac_failures() const { return this->mac_failures_.load(std::memory_order_relaxed); }
+  uint32_t get_malformed() const { return this->malformed_.load(std::memory_order_relaxed); }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
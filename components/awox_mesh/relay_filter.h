@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace awox_mesh {
+
+/**
+ * Recent (source, sequence number) pairs of the received notifications.
+ * Nodes relay reports through the mesh, the connected node can hand us the same packet more than once.
+ */
+class RelayFilter {
+  static constexpr int WINDOW = 8;
+
+  struct Source {
+    int mesh_id;
+    uint32_t sequences[WINDOW];
+    int count;
+    int next;
+  };
+
+  std::vector<Source> sources_{};
+
+ public:
+  /**
+   * Remembers the packet when it was not seen before.
+   * \param sequence : 24-bit sequence number of the source node.
+   * \returns true when the packet is one of the last WINDOW packets of the source.
+   */
+  bool is_duplicate(int mesh_id, uint32_t sequence) {
+    auto found = std::find_if(this->sources_.begin(), this->sources_.end(),
+                              [mesh_id](const Source &_f) { return _f.mesh_id == mesh_id; });
+    if (found == this->sources_.end()) {
+      this->sources_.push_back({mesh_id, {sequence}, 1, 1 % WINDOW});
+      return false;
+    }
+
+    if (std::find(found->sequences, found->sequences + found->count, sequence) != found->sequences + found->count) {
+      return true;
+    }
+    found->sequences[found->next] = sequence;
+    found->next = (found->next + 1) % WINDOW;
+    found->count = std::min(found->count + 1, WINDOW);
+    return false;
+  }
+
+  /** Sequence numbers restart with a new session. */
+  void clear() { this->sources_.clear(); }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,71 @@
+import esphome.codegen as cg
+import esphome.config_validation as cv
+from esphome.components import sensor
+from esphome.const import (
+    ENTITY_CATEGORY_DIAGNOSTIC,
+    STATE_CLASS_MEASUREMENT,
+    STATE_CLASS_TOTAL_INCREASING,
+    UNIT_PERCENT,
+)
+
+from . import Awox, CONF_AWOX_MESH_ID, awox_ns
+
+DEPENDENCIES = ["awox_mesh"]
+
+MetricType = awox_ns.enum("MetricType")
+
+UNIT_PER_SECOND = "/s"
+
+# config key => (metric, unit, accuracy, state class)
+METRICS = {
+    "queue_depth": (MetricType.METRIC_QUEUE_DEPTH, None, 0, STATE_CLASS_MEASUREMENT),
+    "queue_high_water": (MetricType.METRIC_QUEUE_HIGH_WATER, None, 0, STATE_CLASS_MEASUREMENT),
+    "commands_rate": (MetricType.METRIC_COMMANDS_RATE, UNIT_PER_SECOND, 2, STATE_CLASS_MEASUREMENT),
+    "notifications_rate": (MetricType.METRIC_NOTIFICATIONS_RATE, UNIT_PER_SECOND, 2, STATE_CLASS_MEASUREMENT),
+    "decoded_rate": (MetricType.METRIC_DECODED_RATE, UNIT_PER_SECOND, 2, STATE_CLASS_MEASUREMENT),
+    "unknown_reports": (MetricType.METRIC_UNKNOWN_REPORTS, None, 0, STATE_CLASS_TOTAL_INCREASING),
+    "failures": (MetricType.METRIC_FAILURES, None, 0, STATE_CLASS_TOTAL_INCREASING),
+    "publishes": (MetricType.METRIC_PUBLISHES, None, 0, STATE_CLASS_TOTAL_INCREASING),
+    "devices_online": (MetricType.METRIC_DEVICES_ONLINE, None, 0, STATE_CLASS_MEASUREMENT),
+    "devices_offline": (MetricType.METRIC_DEVICES_OFFLINE, None, 0, STATE_CLASS_MEASUREMENT),
+    "devices_undiscovered": (MetricType.METRIC_DEVICES_UNDISCOVERED, None, 0, STATE_CLASS_MEASUREMENT),
+    "scanner_candidates": (MetricType.METRIC_SCANNER_CANDIDATES, None, 0, STATE_CLASS_MEASUREMENT),
+    "reconnects": (MetricType.METRIC_RECONNECTS, None, 0, STATE_CLASS_TOTAL_INCREASING),
+    "mac_failures": (MetricType.METRIC_MAC_FAILURES, None, 0, STATE_CLASS_TOTAL_INCREASING),
+    "duplicates": (MetricType.METRIC_DUPLICATES, None, 0, STATE_CLASS_TOTAL_INCREASING),
+    "scan_duty": (MetricType.METRIC_SCAN_DUTY, UNIT_PERCENT, 0, STATE_CLASS_MEASUREMENT),
+}
+
+
+def metric_schema(unit, accuracy, state_class):
+    if unit is None:
+        return sensor.sensor_schema(
+            accuracy_decimals=accuracy,
+            state_class=state_class,
+            entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+        )
+    return sensor.sensor_schema(
+        unit_of_measurement=unit,
+        accuracy_decimals=accuracy,
+        state_class=state_class,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    )
+
+
+CONFIG_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(CONF_AWOX_MESH_ID): cv.use_id(Awox),
+        **{
+            cv.Optional(key): metric_schema(unit, accuracy, state_class)
+            for key, (_, unit, accuracy, state_class) in METRICS.items()
+        },
+    }
+)
+
+
+async def to_code(config):
+    hub = await cg.get_variable(config[CONF_AWOX_MESH_ID])
+    for key, (metric, _, _, _) in METRICS.items():
+        if key in config:
+            sens = await sensor.new_sensor(config[key])
+            cg.add(hub.set_metric_sensor(metric, sens))
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+namespace esphome {
+namespace awox_mesh {
+
+/**
+ * Lock-free single producer / single consumer ring.
+ * One side only pushes, the other only pops. One slot is kept free to tell full from empty.
+ */
+template<typename T, int SIZE> class SpscRing {
+  T slots_[SIZE];
+  std::atomic<uint32_t> head_{0};
+  std::atomic<uint32_t> tail_{0};
+
+  std::atomic<uint32_t> overflows_{0};
+  uint32_t high_water_mark_ = 0;
+
+ public:
+  /**
+   * Producer side.
+   * \returns false when the ring is full, the item is dropped and counted as overflow.
+   */
+  bool push(const T &item) {
+    uint32_t head = this->head_.load(std::memory_order_relaxed);
+    uint32_t next = (head + 1) % SIZE;
+    if (next == this->tail_.load(std::memory_order_acquire)) {
+      this->overflows_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    this->slots_[head] = item;
+    this->head_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * Consumer side.
+   * \returns false when the ring is empty.
+   */
+  bool pop(T &item) {
+    uint32_t tail = this->tail_.load(std::memory_order_relaxed);
+    uint32_t head = this->head_.load(std::memory_order_acquire);
+    if (tail == head) {
+      return false;
+    }
+
+    uint32_t used = (head + SIZE - tail) % SIZE;
+    if (used > this->high_water_mark_) {
+      this->high_water_mark_ = used;
+    }
+
+    item = this->slots_[tail];
+    this->tail_.store((tail + 1) % SIZE, std::memory_order_release);
+    return true;
+  }
+
+  /** Producer side, a push would fail. */
+  bool full() const {
+    return (this->head_.load(std::memory_order_relaxed) + 1) % SIZE == this->tail_.load(std::memory_order_acquire);
+  }
+
+  /** Consumer side, drops everything that is queued. */
+  void clear() { this->tail_.store(this->head_.load(std::memory_order_acquire), std::memory_order_release); }
+
+  uint32_t get_overflows() const { return this->overflows_.load(std::memory_order_relaxed); }
+
+  /** Most items waiting at once, as seen by the consumer. */
+  uint32_t get_high_water_mark() const { return this->high_water_mark_; }
+};
+
+#define NOTIFICATION_SIZE 20
+
+struct RawNotification {
+  uint8_t data[NOTIFICATION_SIZE];
+  uint8_t length;
+  /** Time (ms) the BLE callback received it */
+  uint32_t received_at;
+};
+
+template<int SIZE> class NotificationRing : public SpscRing<RawNotification, SIZE> {
+ public:
+  bool push(const uint8_t *data, uint16_t length, uint32_t received_at = 0) {
+    RawNotification notification;
+    notification.length = length > NOTIFICATION_SIZE ? NOTIFICATION_SIZE : length;
+    notification.received_at = received_at;
+    memcpy(notification.data, data, notification.length);
+    return SpscRing<RawNotification, SIZE>::push(notification);
+  }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
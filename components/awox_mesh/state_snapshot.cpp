@@ -0,0 +1,103 @@
+#ifdef USE_ESP32
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "state_snapshot.h"
+#include "mesh_device.h"
+#include "esphome/core/hal.h"
+#include "esphome/core/log.h"
+#include "esphome/components/mqtt/mqtt_client.h"
+
+namespace esphome {
+namespace awox_mesh {
+
+static const char *const TAG = "state_snapshot";
+
+PackedDeviceState *StateSnapshot::find_or_add_(int mesh_id) {
+  auto found = std::find_if(this->table_.begin(), this->table_.end(),
+                            [mesh_id](const PackedDeviceState &_f) { return _f.mesh_id == mesh_id; });
+  if (found != this->table_.end()) {
+    return &*found;
+  }
+
+  PackedDeviceState row = {};
+  row.mesh_id = mesh_id;
+  this->table_.push_back(row);
+  return &this->table_.back();
+}
+
+bool StateSnapshot::update(const Device *device) {
+  if (!this->enabled_) {
+    return false;
+  }
+
+  PackedDeviceState *row = this->find_or_add_(device->mesh_id);
+  PackedDeviceState before = *row;
+
+  row->flags = (device->online ? SNAPSHOT_FLAG_ONLINE : 0) | (device->state ? SNAPSHOT_FLAG_STATE : 0) |
+               (device->color_mode ? SNAPSHOT_FLAG_COLOR_MODE : 0) |
+               (device->transition_mode ? SNAPSHOT_FLAG_TRANSITION_MODE : 0);
+  row->white_brightness = device->white_brightness;
+  row->temperature = device->temperature;
+  row->color_brightness = device->color_brightness;
+  row->R = device->R;
+  row->G = device->G;
+  row->B = device->B;
+
+  return memcmp(&before, row, sizeof(PackedDeviceState)) != 0;
+}
+
+std::string StateSnapshot::row_as_json_(const PackedDeviceState &row) const {
+  // [mesh_id, online, state, color_mode, white_brightness, temperature, color_brightness, "RRGGBB", transition_mode]
+  char value[64];
+  int len = snprintf(value, sizeof(value), "[%d,%d,%d,%d,%d,%d,%d,\"%02X%02X%02X\",%d]", row.mesh_id,
+                     (row.flags & SNAPSHOT_FLAG_ONLINE) ? 1 : 0, (row.flags & SNAPSHOT_FLAG_STATE) ? 1 : 0,
+                     (row.flags & SNAPSHOT_FLAG_COLOR_MODE) ? 1 : 0, row.white_brightness, row.temperature,
+                     row.color_brightness, row.R, row.G, row.B, (row.flags & SNAPSHOT_FLAG_TRANSITION_MODE) ? 1 : 0);
+  return std::string(value, len);
+}
+
+void StateSnapshot::publish_snapshot(const std::string &topic) {
+  this->last_publish_ = esphome::millis();
+
+  if (this->format_ == SNAPSHOT_FORMAT_BINARY) {
+    ESP_LOGD(TAG, "Publish binary snapshot of %d devices", this->table_.size());
+    mqtt::global_mqtt_client->publish(topic, (const char *) this->table_.data(),
+                                      this->table_.size() * sizeof(PackedDeviceState), 0, true);
+    return;
+  }
+
+  std::string payload = "[";
+  payload.reserve(this->table_.size() * 42 + 2);
+  for (int i = 0; i < this->table_.size(); i++) {
+    if (i > 0) {
+      payload += ",";
+    }
+    payload += this->row_as_json_(this->table_[i]);
+  }
+  payload += "]";
+
+  ESP_LOGD(TAG, "Publish snapshot of %d devices (%d bytes)", this->table_.size(), payload.size());
+  mqtt::global_mqtt_client->publish(topic, payload, 0, true);
+}
+
+void StateSnapshot::publish_delta(const std::string &topic, int mesh_id) {
+  if (!this->deltas_) {
+    return;
+  }
+
+  PackedDeviceState *row = this->find_or_add_(mesh_id);
+
+  if (this->format_ == SNAPSHOT_FORMAT_BINARY) {
+    mqtt::global_mqtt_client->publish(topic, (const char *) row, sizeof(PackedDeviceState), 0, false);
+    return;
+  }
+
+  mqtt::global_mqtt_client->publish(topic, this->row_as_json_(*row), 0, false);
+}
+
+}  // namespace awox_mesh
+}  // namespace esphome
+
+#endif
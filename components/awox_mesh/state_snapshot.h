@@ -0,0 +1,77 @@
+#pragma once
+
+#ifdef USE_ESP32
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace awox_mesh {
+
+struct Device;
+
+#define SNAPSHOT_FLAG_ONLINE 0x01
+#define SNAPSHOT_FLAG_STATE 0x02
+#define SNAPSHOT_FLAG_COLOR_MODE 0x04
+#define SNAPSHOT_FLAG_TRANSITION_MODE 0x08
+
+/**
+ * One row of the aggregated state table, 9 bytes per device.
+ * The binary snapshot format is a plain concatenation of these rows (mesh_id little-endian).
+ */
+struct PackedDeviceState {
+  uint16_t mesh_id;
+  uint8_t flags;
+  uint8_t white_brightness;
+  uint8_t temperature;
+  uint8_t color_brightness;
+  uint8_t R;
+  uint8_t G;
+  uint8_t B;
+} __attribute__((packed));
+
+enum SnapshotFormat {
+  SNAPSHOT_FORMAT_JSON = 0,
+  SNAPSHOT_FORMAT_BINARY = 1,
+};
+
+class StateSnapshot {
+  std::vector<PackedDeviceState> table_{};
+
+  bool enabled_ = false;
+  bool deltas_ = false;
+  uint32_t interval_ = 60000;
+  SnapshotFormat format_ = SNAPSHOT_FORMAT_JSON;
+
+  uint32_t last_publish_ = 0;
+
+  PackedDeviceState *find_or_add_(int mesh_id);
+
+  std::string row_as_json_(const PackedDeviceState &row) const;
+
+ public:
+  void set_interval(uint32_t interval) {
+    this->enabled_ = true;
+    this->interval_ = interval;
+  }
+  void set_deltas(bool deltas) { this->deltas_ = deltas; }
+  void set_format(SnapshotFormat format) { this->format_ = format; }
+
+  bool is_enabled() const { return this->enabled_; }
+  bool is_due(uint32_t now) const { return this->enabled_ && now - this->last_publish_ > this->interval_; }
+
+  /**
+   * Copies the device state into the table.
+   * \returns true when the packed row changed.
+   */
+  bool update(const Device *device);
+
+  void publish_snapshot(const std::string &topic);
+
+  void publish_delta(const std::string &topic, int mesh_id);
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
+
+#endif
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace esphome {
+namespace awox_mesh {
+
+/**
+ * Paces the status requests to single devices so the mesh is refreshed over a period instead of in one broadcast
+ * that every node answers at the same moment.
+ * Only bookkeeping, which device to poll is decided by the caller.
+ */
+class StatusPoller {
+  struct Poll {
+    int mesh_id;
+    uint32_t sent_at;
+  };
+
+  bool enabled_ = false;
+  uint32_t period_ = 300000;
+  size_t in_flight_limit_ = 2;
+  uint32_t reply_timeout_ = 3000;
+
+  /** Requests in the command queue, not yet written */
+  std::vector<int> queued_{};
+  /** Requests written to the mesh, the reply timeout runs from the write */
+  std::vector<Poll> in_flight_{};
+  uint32_t last_poll_ = 0;
+
+  uint32_t sent_ = 0;
+  uint32_t unanswered_ = 0;
+
+ public:
+  void set_period(uint32_t period) {
+    this->enabled_ = true;
+    this->period_ = period;
+  }
+  void set_in_flight_limit(int limit) { this->in_flight_limit_ = std::max(limit, 1); }
+
+  bool is_enabled() const { return this->enabled_; }
+  uint32_t get_period() const { return this->period_; }
+
+  /**
+   * Gives up on requests that stayed unanswered and checks the budget.
+   * \param device_count : number of known devices, the polls are spread so each can be refreshed once per period.
+   * \returns true when another request can be sent.
+   */
+  bool is_due(uint32_t now, int device_count) {
+    if (!this->enabled_) {
+      return false;
+    }
+
+    auto expired = std::remove_if(this->in_flight_.begin(), this->in_flight_.end(), [this, now](const Poll &_f) {
+      return now - _f.sent_at > this->reply_timeout_;
+    });
+    this->unanswered_ += std::distance(expired, this->in_flight_.end());
+    this->in_flight_.erase(expired, this->in_flight_.end());
+
+    if (this->queued_.size() + this->in_flight_.size() >= this->in_flight_limit_) {
+      return false;
+    }
+    return now - this->last_poll_ >= this->period_ / std::max(device_count, 1);
+  }
+
+  /** A request to the device was written and waits for its reply. */
+  bool is_in_flight(int mesh_id) const {
+    return std::any_of(this->in_flight_.begin(), this->in_flight_.end(),
+                       [mesh_id](const Poll &_f) { return _f.mesh_id == mesh_id; });
+  }
+
+  /** A request to the device is queued or written. */
+  bool is_pending(int mesh_id) const {
+    return this->is_in_flight(mesh_id) ||
+           std::find(this->queued_.begin(), this->queued_.end(), mesh_id) != this->queued_.end();
+  }
+
+  /** A request was queued, the pacing counts from here. */
+  void queued(int mesh_id, uint32_t now) {
+    this->queued_.push_back(mesh_id);
+    this->last_poll_ = now;
+  }
+
+  /** The queue dropped a request before it was written. */
+  void dropped(int mesh_id) {
+    auto found = std::find(this->queued_.begin(), this->queued_.end(), mesh_id);
+    if (found != this->queued_.end()) {
+      this->queued_.erase(found);
+    }
+  }
+
+  /** A request left the queue and was written to the mesh. */
+  void sent(int mesh_id, uint32_t now) {
+    this->dropped(mesh_id);
+    this->in_flight_.push_back({mesh_id, now});
+    this->sent_++;
+  }
+
+  /** A status report of the device arrived, polled or not. */
+  void answered(int mesh_id) {
+    this->in_flight_.erase(std::remove_if(this->in_flight_.begin(), this->in_flight_.end(),
+                                          [mesh_id](const Poll &_f) { return _f.mesh_id == mesh_id; }),
+                           this->in_flight_.end());
+  }
+
+  /** Requests still open on a lost connection will not be answered anymore, queued ones go out after reconnecting. */
+  void clear() { this->in_flight_.clear(); }
+
+  uint32_t get_sent() const { return this->sent_; }
+  uint32_t get_unanswered() const { return this->unanswered_; }
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,103 @@
+#include "command_scheduler.h"
+#include "test_helpers.h"
+
+using namespace esphome::awox_mesh;
+
+static QueuedCommand command(int opcode, int dest, CommandPriority priority, uint32_t queued_at = 0) {
+  QueuedCommand item = {};
+  item.command = opcode;
+  item.dest = dest;
+  item.priority = priority;
+  item.queued_at = queued_at;
+  return item;
+}
+
+static void fill(CommandScheduler &queue, int count, int opcode, int dest, CommandPriority priority) {
+  QueuedCommand dropped;
+  for (int i = 0; i < count; i++) {
+    CHECK_EQUAL(ADMITTED, queue.push(command(opcode, dest, priority), &dropped));
+  }
+}
+
+/** A full queue only makes room by dropping a command that is not more important than the new one. */
+static void test_drop_oldest_priority() {
+  CommandScheduler queue;
+  queue.set_capacity(8);
+  queue.set_policy(ADMISSION_DROP_OLDEST);
+  QueuedCommand dropped = {};
+
+  // Interactive commands are not evicted by a status request
+  fill(queue, 8, 0xd0, 5, PRIORITY_INTERACTIVE);
+  CHECK_EQUAL(REJECTED, queue.push(command(0xda, 5, PRIORITY_BACKGROUND), &dropped));
+  CHECK_EQUAL(8, queue.size(PRIORITY_INTERACTIVE));
+
+  // Another interactive command for the same light replaces the oldest one
+  CHECK_EQUAL(ADMITTED_DROPPED, queue.push(command(0xf2, 5, PRIORITY_INTERACTIVE), &dropped));
+  CHECK_EQUAL(0xd0, dropped.command);
+  CHECK_EQUAL(8, queue.size());
+
+  // Nothing queued for another light to make room with
+  CHECK_EQUAL(REJECTED, queue.push(command(0xd0, 6, PRIORITY_INTERACTIVE), &dropped));
+}
+
+static void test_drop_lower_priority() {
+  CommandScheduler queue;
+  queue.set_capacity(8);
+  queue.set_policy(ADMISSION_DROP_OLDEST);
+  QueuedCommand dropped = {};
+
+  fill(queue, 2, 0xda, 5, PRIORITY_BACKGROUND);
+  fill(queue, 6, 0xd0, 5, PRIORITY_INTERACTIVE);
+  // The oldest command that may go is a status request, even with an older interactive one queued
+  CHECK_EQUAL(ADMITTED_DROPPED, queue.push(command(0xf2, 5, PRIORITY_AUTOMATION), &dropped));
+  CHECK_EQUAL(0xda, dropped.command);
+  CHECK_EQUAL(ADMITTED_DROPPED, queue.push(command(0xf2, 5, PRIORITY_AUTOMATION), &dropped));
+  CHECK_EQUAL(0xda, dropped.command);
+  // Same priority
+  CHECK_EQUAL(ADMITTED_DROPPED, queue.push(command(0xe2, 5, PRIORITY_AUTOMATION), &dropped));
+  CHECK_EQUAL(0xf2, dropped.command);
+  CHECK_EQUAL(PRIORITY_AUTOMATION, dropped.priority);
+  CHECK_EQUAL(0, queue.size(PRIORITY_BACKGROUND));
+  CHECK_EQUAL(6, queue.size(PRIORITY_INTERACTIVE));
+
+  CHECK_EQUAL(REJECTED, queue.push(command(0xda, 5, PRIORITY_BACKGROUND), &dropped));
+}
+
+static void test_ttl() {
+  CommandScheduler queue;
+  queue.set_ttl(30000);
+  QueuedCommand dropped;
+  QueuedCommand interactive = command(0xd0, 1, PRIORITY_INTERACTIVE, 1000);
+  interactive.ttl = COMMAND_TTL_INTERACTIVE;
+  QueuedCommand background = command(0xda, 1, PRIORITY_BACKGROUND, 1000);
+  background.ttl = COMMAND_TTL_BACKGROUND;
+  queue.push(interactive, &dropped);
+  queue.push(command(0xf2, 1, PRIORITY_AUTOMATION, 1000), &dropped);
+  queue.push(background, &dropped);
+
+  int expired = 0;
+  int last = 0;
+  auto on_expired = [&expired, &last](const QueuedCommand &item) {
+    expired++;
+    last = item.command;
+  };
+  queue.expire(1000 + COMMAND_TTL_INTERACTIVE, on_expired);
+  CHECK_EQUAL(0, expired);
+  queue.expire(1001 + COMMAND_TTL_INTERACTIVE, on_expired);
+  CHECK_EQUAL(1, expired);
+  CHECK_EQUAL(0xd0, last);
+  // The queue default
+  queue.expire(31001, on_expired);
+  CHECK_EQUAL(2, expired);
+  CHECK_EQUAL(0xf2, last);
+  queue.expire(1001 + COMMAND_TTL_BACKGROUND, on_expired);
+  CHECK_EQUAL(3, expired);
+  CHECK(queue.empty());
+}
+
+int main() {
+  test_drop_oldest_priority();
+  test_drop_lower_priority();
+  test_ttl();
+  return test_result();
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+/*
+ * Host stand-in for the Crypto library (rweather/Crypto), see AES.h.
+ */
@@ -0,0 +1,149 @@
+#include "hub_cluster.h"
+#include "test_helpers.h"
+
+using namespace esphome::awox_mesh;
+
+/*
+ * Two or three hubs driven with a fake clock, as AwoxMesh does from the MQTT callbacks and loop().
+ */
+
+static const uint32_t TIMEOUT = 6000;
+static const uint32_t HEARTBEAT = 2000;
+
+static HubCluster make_hub(const std::string &id) {
+  HubCluster hub;
+  hub.set_hub_id(id);
+  hub.set_timeout(TIMEOUT);
+  return hub;
+}
+
+static void join(HubCluster &hub, const std::string &peer_id, uint32_t now) {
+  ClusterPeer *peer = hub.get_peer(peer_id);
+  peer->status_topic = peer_id + "/status";
+  peer->status_offline_payload = "offline";
+  hub.on_heartbeat(peer_id, now);
+}
+
+static void test_election() {
+  HubCluster b = make_hub("hub-b");
+  CHECK(b.is_leader());
+  CHECK(b.get_peer("hub-b") == nullptr);
+
+  // A peer with a lower id takes over once its heartbeat arrives
+  uint32_t now = 1000;
+  join(b, "hub-a", now);
+  join(b, "hub-c", now);
+  CHECK(b.update(now));
+  CHECK_EQUAL(0, b.get_leader().compare("hub-a"));
+  CHECK(!b.is_leader());
+  CHECK(!b.update(now));
+
+  // Heartbeats keep it, a missed timeout hands the leadership back
+  for (now = 3000; now <= 20000; now += HEARTBEAT) {
+    b.on_heartbeat("hub-a", now);
+    b.on_heartbeat("hub-c", now);
+    CHECK(!b.update(now));
+  }
+  uint32_t last_heartbeat = now - HEARTBEAT;
+  CHECK(!b.update(last_heartbeat + TIMEOUT));
+  CHECK(b.update(last_heartbeat + TIMEOUT + 1));
+  CHECK(b.is_leader());
+
+  // A higher id never takes over
+  b.on_heartbeat("hub-c", now + TIMEOUT);
+  CHECK(!b.update(now + TIMEOUT));
+  CHECK(b.is_leader());
+}
+
+static void test_status_failover() {
+  HubCluster b = make_hub("hub-b");
+  uint32_t now = 1000;
+  join(b, "hub-a", now);
+  CHECK(b.update(now));
+  CHECK(!b.is_leader());
+
+  // The last will of the leader fails over right away, without waiting for the heartbeat timeout
+  now += 500;
+  b.on_status("hub-a/status", false);
+  CHECK(b.update(now));
+  CHECK(b.is_leader());
+
+  // Heartbeats alone do not bring an offline hub back
+  b.on_heartbeat("hub-a", now + HEARTBEAT);
+  CHECK(!b.update(now + HEARTBEAT));
+  CHECK(b.is_leader());
+
+  // Back online with a heartbeat in time
+  b.on_status("hub-a/status", true);
+  CHECK(b.update(now + HEARTBEAT));
+  CHECK(!b.is_leader());
+
+  // Status of an unknown topic changes nothing
+  b.on_status("hub-x/status", false);
+  CHECK(!b.update(now + HEARTBEAT));
+}
+
+static void test_proximity() {
+  const std::string near_a = "A4:C1:38:00:00:01";
+  const std::string near_b = "A4:C1:38:00:00:02";
+  const std::string unheard = "A4:C1:38:00:00:03";
+  HubCluster a = make_hub("hub-a");
+  HubCluster b = make_hub("hub-b");
+  uint32_t now = 1000;
+  join(a, "hub-b", now);
+  join(b, "hub-a", now);
+  a.update(now);
+  b.update(now);
+
+  CHECK(a.update_own_proximity({{near_a, -50}, {near_b, -90}}));
+  CHECK(b.update_own_proximity({{near_a, -80}, {near_b, -60}}));
+  // Each hub publishes its proximity, the other stores it in the peer
+  a.get_peer("hub-b")->proximity = b.get_own_proximity();
+  b.get_peer("hub-a")->proximity = a.get_own_proximity();
+
+  // Every node has exactly one owner, the leader takes the unknown ones
+  CHECK(a.is_responsible(near_a, now));
+  CHECK(!b.is_responsible(near_a, now));
+  CHECK(!a.is_responsible(near_b, now));
+  CHECK(b.is_responsible(near_b, now));
+  CHECK(a.is_responsible(unheard, now));
+  CHECK(!b.is_responsible(unheard, now));
+  CHECK(a.is_responsible("", now));
+  CHECK(!b.is_responsible("", now));
+
+  // Small RSSI moves are not republished, larger ones and new or lost nodes are
+  CHECK(!a.update_own_proximity({{near_a, -52}, {near_b, -88}}));
+  CHECK_EQUAL(-50, a.get_own_proximity().at(near_a));
+  CHECK(a.update_own_proximity({{near_a, -50}, {near_b, -50}}));
+  CHECK(a.update_own_proximity({{near_a, -50}, {near_b, -50}, {unheard, -70}}));
+  CHECK(a.update_own_proximity({{near_a, -50}, {near_b, -50}}));
+  CHECK(!a.update_own_proximity({{near_a, -50}, {near_b, -50}}));
+
+  // near_b moved closer to hub-a, once hub-b learns about it the ownership moves without waiting for an announce
+  b.get_peer("hub-a")->proximity = a.get_own_proximity();
+  CHECK(!b.is_responsible(near_b, now));
+  a.get_peer("hub-b")->proximity = b.get_own_proximity();
+  CHECK(a.is_responsible(near_b, now));
+
+  // Equal RSSI goes to the lowest id
+  CHECK(b.update_own_proximity({{near_a, -80}, {near_b, -50}}));
+  a.get_peer("hub-b")->proximity = b.get_own_proximity();
+  CHECK(a.is_responsible(near_b, now));
+  CHECK(!b.is_responsible(near_b, now));
+
+  // A hub that timed out loses its nodes to the survivor
+  now += TIMEOUT + 1;
+  a.on_heartbeat("hub-b", now);
+  b.update(now);
+  CHECK(b.is_leader());
+  CHECK(b.is_responsible(near_a, now));
+  CHECK(b.is_responsible(near_b, now));
+  CHECK(b.is_responsible(unheard, now));
+}
+
+int main() {
+  test_election();
+  test_status_failover();
+  test_proximity();
+  return test_result();
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "command_scheduler.h"
+#include "mesh_protocol.h"
+#include "mesh_simulator.h"
+#include "protocol_engine.h"
+
+namespace esphome {
+namespace awox_mesh {
+
+/** Last reported state of a node, what the hub publishes. */
+struct ReportedLight {
+  bool online = false;
+  SimulatedLight light;
+  /** MAC report received */
+  bool has_mac = false;
+  uint8_t product_id = 0;
+  int reports = 0;
+  /** Reports the engine flagged as changed, what loop() publishes */
+  int changes = 0;
+};
+
+/**
+ * The send and receive path of MeshDevice without ESPHome around it: pairing, the command scheduler with the send
+ * interval of loop(), packet crypto and the protocol engine, run inline like loop() does without the protocol task.
+ */
+class HubHarness {
+ public:
+  static constexpr uint32_t SEND_INTERVAL = 180;
+
+  HubHarness(MeshSimulator &mesh, const std::string &mesh_name, const std::string &mesh_password,
+             uint64_t node_address)
+      : mesh_(mesh), mesh_name_(mesh_name), mesh_password_(mesh_password) {
+    for (int i = 0; i < 6; i++) {
+      this->reverse_address_.push_back((node_address >> (8 * i)) & 0xff);
+    }
+  }
+
+  bool pair() {
+    std::string random_key = "\x11\x22\x33\x44\x55\x66\x77\x88";
+    std::string enc_data = key_encrypt(this->mesh_name_, this->mesh_password_, random_key);
+    this->mesh_.write_pair('\x0c' + random_key + enc_data.substr(0, 8));
+    std::string response = this->mesh_.read_pair();
+    if (response.empty() || response[0] != 0x0d) {
+      this->session_key_.clear();
+      return false;
+    }
+    this->session_key_ =
+        generate_session_key(this->mesh_name_, this->mesh_password_, random_key, response.substr(1, 9));
+    this->engine.set_session(this->session_key_, this->reverse_address_);
+    return true;
+  }
+
+  const std::string &get_session_key() const { return this->session_key_; }
+
+  AdmissionResult queue(int command, const std::string &data, int dest, CommandPriority priority, uint32_t now) {
+    QueuedCommand item{};
+    item.command = command;
+    item.set_data(data);
+    item.dest = dest;
+    item.priority = priority;
+    item.queued_at = now;
+    QueuedCommand dropped;
+    return this->scheduler.push(item, &dropped);
+  }
+
+  /** Writes the command directly, like write_command() outside of the queue. */
+  void write(int command, const std::string &data, int dest, uint32_t now) {
+    std::string packet = build_packet(this->packet_count_++, dest, command, data);
+    if (this->packet_count_ > 0xffff) {
+      this->packet_count_ = 1;
+    }
+    encrypt_packet(this->session_key_, this->reverse_address_, packet);
+    this->mesh_.write_command(packet, now);
+    this->written++;
+  }
+
+  /**
+   * One pass of loop(): the notifications that arrived, then at most one queued command per send interval.
+   * \param sent : receives the command that was written, when one was.
+   * \returns true when a command was written.
+   */
+  bool loop(uint32_t now, QueuedCommand *sent = nullptr) {
+    for (auto &notification : this->mesh_.take_notifications(now)) {
+      this->receive(notification, now);
+    }
+
+    QueuedCommand item;
+    if (this->session_key_.empty() || now - this->last_send_ < SEND_INTERVAL || !this->scheduler.pop(now, item)) {
+      return false;
+    }
+    this->last_send_ = now;
+    this->write(item.command, item.get_data(), item.dest, now);
+    if (sent != nullptr) {
+      *sent = item;
+    }
+    return true;
+  }
+
+  /** A notification from the BLE callback, handled right away like a woken protocol task. */
+  void receive(const std::string &notification, uint32_t now = 0) {
+    this->engine.push_notification((const uint8_t *) notification.data(), notification.size(), now);
+    this->engine.process(16);
+    this->mac_failures = this->engine.get_mac_failures();
+
+    DecodedNotification decoded;
+    while (this->engine.pop(decoded)) {
+      if (decoded.duplicate) {
+        this->duplicates++;
+        continue;
+      }
+      this->decoded++;
+      const MeshReport &report = decoded.report;
+      if (report.type == REPORT_UNKNOWN) {
+        this->unknown++;
+        continue;
+      }
+
+      ReportedLight &reported = this->registry[report.mesh_id];
+      if (report.type == REPORT_MAC) {
+        reported.has_mac = true;
+        reported.product_id = report.product[1];
+        continue;
+      }
+      reported.online = report.online;
+      reported.light = {report.state, report.color_mode, report.white_brightness, report.temperature,
+                        report.color_brightness, report.R, report.G, report.B};
+      reported.reports++;
+      reported.changes += decoded.changed;
+    }
+  }
+
+  CommandScheduler scheduler;
+  ProtocolEngine engine;
+  std::map<int, ReportedLight> registry;
+  int written = 0;
+  int decoded = 0;
+  int duplicates = 0;
+  int mac_failures = 0;
+  int unknown = 0;
+
+ protected:
+  MeshSimulator &mesh_;
+  std::string mesh_name_;
+  std::string mesh_password_;
+  std::string reverse_address_;
+  std::string session_key_;
+  int packet_count_ = 1;
+  uint32_t last_send_ = 0;
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
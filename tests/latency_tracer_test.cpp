@@ -0,0 +1,77 @@
+#include <vector>
+
+#include "latency_tracer.h"
+#include "test_helpers.h"
+
+using namespace esphome::awox_mesh;
+
+static QueuedCommand traced(int dest, uint32_t received_at) {
+  QueuedCommand command{};
+  command.command = 0xd0;
+  command.dest = dest;
+  command.received_at = received_at;
+  command.queued_at = received_at + 5;
+  return command;
+}
+
+static void test_report_after_write() {
+  LatencyTracer tracer;
+  tracer.written(traced(3, 100), 0x0101, 200, 210);
+
+  // Sent before the packet was written, or by another device
+  tracer.reported(3, 205);
+  tracer.reported(4, 300);
+  CHECK_EQUAL(0, tracer.get_stage_stats(TRACE_STAGE_TOTAL).count());
+
+  tracer.reported(3, 400);
+  CHECK_EQUAL(1, tracer.get_stage_stats(TRACE_STAGE_TOTAL).count());
+  CHECK_EQUAL(300, tracer.get_stage_stats(TRACE_STAGE_TOTAL).max());
+  CHECK_EQUAL(190, tracer.get_stage_stats(TRACE_STAGE_REPORT).max());
+  CHECK_EQUAL(1, tracer.get_destination_stats()[3].count());
+
+  // Completed once
+  tracer.reported(3, 500);
+  CHECK_EQUAL(1, tracer.get_stage_stats(TRACE_STAGE_TOTAL).count());
+}
+
+static void test_broadcast() {
+  LatencyTracer tracer;
+  tracer.written(traced(0xffff, 100), 0x0102, 150, 150);
+  tracer.written(traced(5, 100), 0x0103, 350, 350);
+
+  // Completes the broadcast, the packet to 5 was written after the report arrived
+  tracer.reported(5, 300);
+  CHECK_EQUAL(1, tracer.get_stage_stats(TRACE_STAGE_TOTAL).count());
+  tracer.reported(5, 360);
+  CHECK_EQUAL(2, tracer.get_stage_stats(TRACE_STAGE_TOTAL).count());
+}
+
+static void test_expire() {
+  LatencyTracer tracer;
+  tracer.written(traced(6, 100), 0x0201, 100, 100);
+  tracer.written(traced(7, 100), 0x0202, 100, 5000);
+  // Untraced commands (not from MQTT) are not followed
+  tracer.written(traced(8, 0), 0x0203, 100, 5000);
+
+  std::vector<int> lost;
+  tracer.expire(12000, [&lost](int dest, int packet_count) {
+    CHECK_EQUAL(6, dest);
+    lost.push_back(packet_count);
+  });
+  CHECK_EQUAL(1, lost.size());
+  CHECK_EQUAL(0x0201, lost[0]);
+  CHECK_EQUAL(1, tracer.get_unconfirmed());
+  CHECK_EQUAL(2, tracer.get_written(true));
+  CHECK_EQUAL(1, tracer.get_lost(true));
+
+  tracer.reported(7, 6000);
+  tracer.expire(20000, [](int, int) { CHECK(false); });
+  CHECK_EQUAL(1, tracer.get_unconfirmed());
+}
+
+int main() {
+  test_report_after_write();
+  test_broadcast();
+  test_expire();
+  return test_result();
+}
@@ -0,0 +1,184 @@
+#include <chrono>
+#include <cstdio>
+#include <deque>
+
+#include "hub_harness.h"
+#include "mesh_simulator.h"
+#include "test_helpers.h"
+
+using namespace esphome::awox_mesh;
+
+/*
+ * 500 nodes behind one connected node: a status sweep, a command and a device info query for every node, first over
+ * a clean radio and then with loss and relayed duplicates, unconfirmed commands are resent like reconcile() does.
+ */
+
+static const uint64_t NODE_ADDRESS = 0xA4C138000001;
+static const int NODES = 500;
+static const uint32_t TICK = 10;
+static const uint32_t CONFIRM_TIMEOUT = 2000;
+static const int MAX_ATTEMPTS = 5;
+
+struct Target {
+  SimulatedLight light;
+  int command;
+  std::string data;
+  uint32_t sent_at = 0;
+  int attempts = 0;
+  bool confirmed = false;
+};
+
+static bool matches(const SimulatedLight &reported, const SimulatedLight &target) {
+  if (reported.state != target.state) {
+    return false;
+  }
+  return !target.color_mode ||
+         (reported.color_mode && reported.R == target.R && reported.G == target.G && reported.B == target.B);
+}
+
+struct LoadResult {
+  uint32_t duration;
+  int confirmed;
+  int resent;
+  int queried;
+};
+
+static LoadResult run(MeshSimulator &mesh, HubHarness &hub, uint32_t seed) {
+  std::map<int, Target> targets;
+  // What does not fit in the queue waits here, like MQTT messages waiting for the loop
+  std::deque<std::pair<int, CommandPriority>> backlog;
+  for (int mesh_id = 1; mesh_id <= NODES; mesh_id++) {
+    Target &target = targets[mesh_id];
+    if (mesh_id % 2 == 0) {
+      target.light.state = (mesh_id / 2 + seed) % 2 == 0;
+      target.command = 0xd0;
+      target.data = std::string(1, target.light.state ? 1 : 0);
+    } else {
+      target.light = {true, true, 100, 50, 100, static_cast<uint8_t>(mesh_id), static_cast<uint8_t>(seed), 0x80};
+      target.command = 0xe2;
+      target.data = {0x04, static_cast<char>(target.light.R), static_cast<char>(target.light.G),
+                     static_cast<char>(target.light.B)};
+    }
+    backlog.push_back({mesh_id, PRIORITY_INTERACTIVE});
+    backlog.push_back({mesh_id, PRIORITY_BACKGROUND});
+  }
+
+  LoadResult result{};
+  uint32_t now = 0;
+  hub.queue(0xda, std::string(1, 0x10), 0xffff, PRIORITY_BACKGROUND, now);
+  while (now < 600000) {
+    while (!backlog.empty() && !hub.scheduler.full()) {
+      int mesh_id = backlog.front().first;
+      CommandPriority priority = backlog.front().second;
+      backlog.pop_front();
+      if (priority == PRIORITY_INTERACTIVE) {
+        hub.queue(targets[mesh_id].command, targets[mesh_id].data, mesh_id, priority, now);
+      } else {
+        hub.queue(0xea, std::string("\x10\x00", 2), mesh_id, priority, now);
+      }
+    }
+
+    bool interactive_waiting = hub.scheduler.size(PRIORITY_INTERACTIVE) > 0;
+    QueuedCommand sent;
+    if (hub.loop(now, &sent)) {
+      // Nothing of a lower class leaves while an interactive command waits
+      CHECK(!interactive_waiting || sent.priority == PRIORITY_INTERACTIVE);
+      if (sent.command == 0xea) {
+        result.queried++;
+      } else if (sent.dest != 0xffff) {
+        Target &target = targets[sent.dest];
+        target.sent_at = now;
+        target.attempts++;
+      }
+    }
+
+    bool done = backlog.empty() && hub.scheduler.empty();
+    for (auto &entry : targets) {
+      Target &target = entry.second;
+      if (target.confirmed) {
+        continue;
+      }
+      auto reported = hub.registry.find(entry.first);
+      if (reported != hub.registry.end() && target.sent_at > 0 && matches(reported->second.light, target.light)) {
+        target.confirmed = true;
+        result.confirmed++;
+        continue;
+      }
+      done = false;
+      if (target.sent_at > 0 && now - target.sent_at > CONFIRM_TIMEOUT && target.attempts < MAX_ATTEMPTS &&
+          !hub.scheduler.full() &&
+          !hub.scheduler.any_of([&entry](const QueuedCommand &item) { return item.dest == entry.first; })) {
+        hub.queue(target.command, target.data, entry.first, PRIORITY_AUTOMATION, now);
+        target.sent_at = 0;
+        result.resent++;
+      }
+    }
+    if (done && mesh.idle()) {
+      break;
+    }
+    now += TICK;
+  }
+  result.duration = now;
+  return result;
+}
+
+static void test_clean_radio() {
+  MeshSimulator mesh("load", "test", NODE_ADDRESS, 1);
+  for (int mesh_id = 1; mesh_id <= NODES; mesh_id++) {
+    mesh.add_node(mesh_id);
+  }
+  mesh.set_radio({0, 0, 0, 20, 40});
+  HubHarness hub(mesh, "load", "test", NODE_ADDRESS);
+  CHECK(hub.pair());
+
+  LoadResult result = run(mesh, hub, 1);
+  CHECK_EQUAL(NODES, result.confirmed);
+  CHECK_EQUAL(0, result.resent);
+  CHECK_EQUAL(NODES, result.queried);
+  CHECK_EQUAL(NODES, hub.registry.size());
+  int with_mac = 0;
+  for (auto &entry : hub.registry) {
+    with_mac += entry.second.has_mac;
+  }
+  CHECK_EQUAL(NODES, with_mac);
+  // One packet per send interval: the sweep, a command and a query per node
+  CHECK_EQUAL(2 * NODES + 1, hub.written);
+  CHECK(result.duration < (2 * NODES + 2) * HubHarness::SEND_INTERVAL + 1000);
+  CHECK_EQUAL(0, hub.mac_failures);
+  CHECK_EQUAL(0, hub.duplicates);
+  CHECK_EQUAL(0, hub.unknown);
+  CHECK_EQUAL(0, mesh.get_stats().commands_rejected);
+  printf("clean radio: %d packets in %u ms simulated\n", hub.written, result.duration);
+}
+
+static void test_lossy_radio() {
+  MeshSimulator mesh("load", "test", NODE_ADDRESS, 7);
+  for (int mesh_id = 1; mesh_id <= NODES; mesh_id++) {
+    mesh.add_node(mesh_id);
+  }
+  mesh.set_radio({0.05, 0.05, 0.2, 30, 120});
+  HubHarness hub(mesh, "load", "test", NODE_ADDRESS);
+  CHECK(hub.pair());
+
+  auto started = std::chrono::steady_clock::now();
+  LoadResult result = run(mesh, hub, 2);
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+
+  const SimulatorStats &stats = mesh.get_stats();
+  CHECK_EQUAL(NODES, result.confirmed);
+  CHECK(result.resent > 0);
+  CHECK_EQUAL(0, hub.mac_failures);
+  CHECK_EQUAL(0, stats.commands_rejected);
+  // Every relayed copy is caught by the relay filter and nothing else is
+  CHECK_EQUAL(stats.reports_duplicated, hub.duplicates);
+  CHECK_EQUAL(stats.reports_sent - stats.reports_lost, hub.decoded);
+  printf("lossy radio: %d packets, %d resent, %d reports (%d lost, %d duplicated) in %u ms simulated, %lld ms\n",
+         hub.written, result.resent, stats.reports_sent, stats.reports_lost, stats.reports_duplicated,
+         result.duration, (long long) elapsed.count());
+}
+
+int main() {
+  test_clean_radio();
+  test_lossy_radio();
+  return test_result();
+}
@@ -0,0 +1,283 @@
+#include <algorithm>
+
+#include <AES.h>
+
+#include "mesh_protocol.h"
+#include "mesh_simulator.h"
+
+namespace esphome {
+namespace awox_mesh {
+
+static const int OPCODE_REQUEST_STATUS = 0xda;
+static const int OPCODE_STATUS_REPORT = 0xdb;
+static const int OPCODE_ONLINE_STATUS_REPORT = 0xdc;
+static const int OPCODE_POWER = 0xd0;
+static const int OPCODE_COLOR = 0xe2;
+static const int OPCODE_COLOR_BRIGHTNESS = 0xf2;
+static const int OPCODE_WHITE_BRIGHTNESS = 0xf1;
+static const int OPCODE_WHITE_TEMPERATURE = 0xf0;
+static const int OPCODE_DEVICE_INFO_QUERY = 0xea;
+static const int OPCODE_MAC_REPORT = 0xd8;
+
+/** One AES block, the mesh uses both the key and the data least significant byte first. */
+static std::string block(std::string key, std::string data) {
+  std::reverse(key.begin(), key.end());
+  std::reverse(data.begin(), data.end());
+  uint8_t buffer[16];
+  AES128 aes128;
+  aes128.setKey((const uint8_t *) key.data(), key.size());
+  aes128.encryptBlock(buffer, (const uint8_t *) data.data());
+  std::string result((char *) buffer, 16);
+  std::reverse(result.begin(), result.end());
+  return result;
+}
+
+MeshSimulator::MeshSimulator(const std::string &mesh_name, const std::string &mesh_password, uint64_t node_address,
+                             uint32_t seed)
+    : mesh_name_(mesh_name), mesh_password_(mesh_password), random_(seed) {
+  for (int i = 0; i < 6; i++) {
+    this->reverse_address_.push_back((node_address >> (8 * i)) & 0xff);
+  }
+}
+
+SimulatedNode &MeshSimulator::add_node(int mesh_id, uint8_t product_id) {
+  SimulatedNode node{};
+  node.mesh_id = mesh_id;
+  node.product_id = product_id;
+  node.mac[0] = 0x10;
+  node.mac[1] = (mesh_id >> 8) & 0xff;
+  node.mac[2] = mesh_id & 0xff;
+  node.mac[3] = 0x42;
+  node.sequence = this->random_() & 0xffffff;
+  return this->nodes_[mesh_id] = node;
+}
+
+SimulatedNode *MeshSimulator::get_node(int mesh_id) {
+  auto found = this->nodes_.find(mesh_id);
+  return found != this->nodes_.end() ? &found->second : nullptr;
+}
+
+void MeshSimulator::write_pair(const std::string &value) {
+  this->session_key_.clear();
+  std::string random_key = value.substr(1, 8);
+  if (value.size() != 17 || value[0] != 0x0c ||
+      key_encrypt(this->mesh_name_, this->mesh_password_, random_key).substr(0, 8) != value.substr(9, 8)) {
+    this->pair_response_ = std::string(1, 0x0e);
+    return;
+  }
+
+  std::string node_key;
+  for (int i = 0; i < 8; i++) {
+    node_key.push_back(this->random_() & 0xff);
+  }
+  this->session_key_ = generate_session_key(this->mesh_name_, this->mesh_password_, random_key, node_key);
+  this->pair_response_ = '\x0d' + node_key;
+}
+
+bool MeshSimulator::decrypt_command(std::string &packet) const {
+  if (packet.size() != 20 || this->session_key_.empty()) {
+    return false;
+  }
+  std::string iv = '\0' + this->reverse_address_.substr(0, 4) + '\1' + packet.substr(0, 3);
+  iv.append(7, 0);
+  std::string stream = block(this->session_key_, iv);
+  for (int i = 0; i < 15; i++) {
+    packet[i + 5] ^= stream[i];
+  }
+
+  std::string nonce = this->reverse_address_.substr(0, 4) + '\1' + packet.substr(0, 3) + '\x0f';
+  nonce.append(7, 0);
+  std::string authenticator = block(this->session_key_, nonce);
+  for (int i = 0; i < 15; i++) {
+    authenticator[i] ^= packet[i + 5];
+  }
+  std::string mac = block(this->session_key_, authenticator);
+  return mac[0] == packet[3] && mac[1] == packet[4];
+}
+
+std::string MeshSimulator::encrypt_notification(int source, uint32_t sequence, int opcode,
+                                                const std::string &payload) const {
+  std::string packet(20, 0);
+  packet[0] = sequence & 0xff;
+  packet[1] = (sequence >> 8) & 0xff;
+  packet[2] = (sequence >> 16) & 0xff;
+  packet[3] = source & 0xff;
+  packet[4] = (source >> 8) & 0xff;
+  packet[7] = opcode;
+  packet[8] = 0x60;
+  packet[9] = 0x01;
+  std::copy(payload.begin(), payload.begin() + std::min<size_t>(payload.size(), 10), packet.begin() + 10);
+
+  std::string nonce = this->reverse_address_.substr(0, 3) + packet.substr(0, 5) + static_cast<char>(13);
+  nonce.append(7, 0);
+  std::string authenticator = block(this->session_key_, nonce);
+  for (int i = 0; i < 13; i++) {
+    authenticator[i] ^= packet[i + 7];
+  }
+  std::string mac = block(this->session_key_, authenticator);
+  packet[5] = mac[0];
+  packet[6] = mac[1];
+
+  std::string iv = '\0' + this->reverse_address_.substr(0, 3) + packet.substr(0, 5);
+  iv.append(7, 0);
+  std::string stream = block(this->session_key_, iv);
+  for (int i = 0; i < 13; i++) {
+    packet[i + 7] ^= stream[i];
+  }
+  return packet;
+}
+
+bool MeshSimulator::chance_(double probability) {
+  return probability > 0 && std::uniform_real_distribution<double>(0, 1)(this->random_) < probability;
+}
+
+uint32_t MeshSimulator::delay_() {
+  return this->radio_.latency + (this->radio_.jitter > 0 ? this->random_() % this->radio_.jitter : 0);
+}
+
+void MeshSimulator::write_command(const std::string &packet, uint32_t now) {
+  this->stats_.commands_written++;
+  std::string plain = packet;
+  if (!this->decrypt_command(plain)) {
+    this->stats_.commands_rejected++;
+    return;
+  }
+
+  int dest = static_cast<unsigned char>(plain[5]) | (static_cast<unsigned char>(plain[6]) << 8);
+  for (auto &entry : this->nodes_) {
+    if (dest != 0xffff && dest != entry.first) {
+      continue;
+    }
+    if (this->chance_(this->radio_.command_loss)) {
+      this->stats_.commands_lost++;
+      continue;
+    }
+    this->commands_.insert({now + this->delay_(), {entry.first, plain}});
+  }
+}
+
+std::vector<std::string> MeshSimulator::take_notifications(uint32_t now) {
+  // Commands that arrived may queue new reports, so deliver them first
+  while (!this->commands_.empty() && this->commands_.begin()->first <= now) {
+    auto arrived = this->commands_.begin()->first;
+    PendingCommand command = this->commands_.begin()->second;
+    this->commands_.erase(this->commands_.begin());
+    this->apply_(this->nodes_.at(command.mesh_id), command.packet, arrived);
+  }
+
+  std::vector<std::string> notifications;
+  while (!this->reports_.empty() && this->reports_.begin()->first <= now) {
+    notifications.push_back(this->reports_.begin()->second);
+    this->reports_.erase(this->reports_.begin());
+  }
+  return notifications;
+}
+
+void MeshSimulator::change_light(int mesh_id, const SimulatedLight &light, uint32_t now) {
+  SimulatedNode &node = this->nodes_.at(mesh_id);
+  node.light = light;
+  this->report_status_(node, OPCODE_ONLINE_STATUS_REPORT, now);
+}
+
+void MeshSimulator::apply_(SimulatedNode &node, const std::string &packet, uint32_t now) {
+  if (!node.online) {
+    return;
+  }
+  this->stats_.commands_applied++;
+  int opcode = static_cast<unsigned char>(packet[7]);
+  auto data = [&packet](int i) { return static_cast<uint8_t>(packet[10 + i]); };
+  SimulatedLight &light = node.light;
+
+  switch (opcode) {
+    case OPCODE_REQUEST_STATUS:
+      this->report_status_(node, OPCODE_STATUS_REPORT, now);
+      return;
+    case OPCODE_DEVICE_INFO_QUERY:
+      if (data(1) == 0x00) {
+        std::string payload(10, 0);
+        payload[2] = node.product_id;
+        for (int i = 0; i < 4; i++) {
+          payload[3 + i] = node.mac[3 - i];
+        }
+        this->send_(node, OPCODE_MAC_REPORT, payload, now);
+      }
+      return;
+    case OPCODE_POWER:
+      light.state = data(0) > 0;
+      break;
+    case OPCODE_COLOR:
+      light.state = true;
+      light.color_mode = true;
+      light.R = data(1);
+      light.G = data(2);
+      light.B = data(3);
+      break;
+    case OPCODE_COLOR_BRIGHTNESS:
+      light.state = true;
+      light.color_mode = true;
+      light.color_brightness = data(0);
+      break;
+    case OPCODE_WHITE_BRIGHTNESS:
+      light.state = true;
+      light.color_mode = false;
+      light.white_brightness = data(0);
+      break;
+    case OPCODE_WHITE_TEMPERATURE:
+      light.state = true;
+      light.color_mode = false;
+      light.temperature = data(0);
+      break;
+    default:
+      return;
+  }
+  this->report_status_(node, OPCODE_ONLINE_STATUS_REPORT, now);
+}
+
+void MeshSimulator::report_status_(SimulatedNode &node, int opcode, uint32_t now) {
+  const SimulatedLight &light = node.light;
+  uint8_t mode = (light.state ? 1 : 0) | (light.color_mode ? 2 : 0);
+  std::string payload(10, 0);
+  if (opcode == OPCODE_ONLINE_STATUS_REPORT) {
+    payload = {static_cast<char>(node.mesh_id & 0xff),
+               1,
+               static_cast<char>(mode),
+               static_cast<char>(light.white_brightness),
+               static_cast<char>(light.temperature),
+               static_cast<char>(light.color_brightness),
+               static_cast<char>(light.R),
+               static_cast<char>(light.G),
+               static_cast<char>(light.B),
+               static_cast<char>(node.mesh_id >> 8)};
+  } else {
+    payload = {static_cast<char>(mode),
+               static_cast<char>(light.white_brightness),
+               static_cast<char>(light.temperature),
+               static_cast<char>(light.color_brightness),
+               static_cast<char>(light.R),
+               static_cast<char>(light.G),
+               static_cast<char>(light.B),
+               0,
+               0,
+               0};
+  }
+  this->send_(node, opcode, payload, now);
+}
+
+void MeshSimulator::send_(SimulatedNode &node, int opcode, const std::string &payload, uint32_t now) {
+  node.sequence = (node.sequence + 1) & 0xffffff;
+  this->stats_.reports_sent++;
+  if (this->session_key_.empty() || this->chance_(this->radio_.report_loss)) {
+    this->stats_.reports_lost++;
+    return;
+  }
+  std::string notification = this->encrypt_notification(node.mesh_id, node.sequence, opcode, payload);
+  uint32_t arrival = now + this->delay_();
+  this->reports_.insert({arrival, notification});
+  if (this->chance_(this->radio_.relay_duplication)) {
+    this->stats_.reports_duplicated++;
+    this->reports_.insert({arrival + this->delay_(), notification});
+  }
+}
+
+}  // namespace awox_mesh
+}  // namespace esphome
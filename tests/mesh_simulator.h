@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace esphome {
+namespace awox_mesh {
+
+/*
+ * Simulated Telink mesh for the host tests.
+ * The connected node is reached through its pair and command characteristics and hands back the (encrypted)
+ * notifications of all nodes, with radio loss, latency and relayed duplicates on a fake clock.
+ * The node side of the packet crypto is written out here on purpose, it checks mesh_protocol.cpp instead of reusing it.
+ */
+
+/** Light state as the nodes report it. */
+struct SimulatedLight {
+  bool state = false;
+  bool color_mode = false;
+  uint8_t white_brightness = 100;
+  uint8_t temperature = 50;
+  uint8_t color_brightness = 100;
+  uint8_t R = 255, G = 255, B = 255;
+};
+
+struct SimulatedNode {
+  int mesh_id;
+  uint8_t product_id;
+  /** Last 4 bytes of the MAC, the first two are always A4:C1 */
+  uint8_t mac[4];
+  bool online = true;
+  SimulatedLight light;
+  /** 24-bit sequence number of the notifications of this node */
+  uint32_t sequence = 0;
+};
+
+struct RadioConfig {
+  /** Chance that a command does not reach a node */
+  double command_loss = 0;
+  /** Chance that a report does not reach the connected node */
+  double report_loss = 0;
+  /** Chance that the connected node hands over a report a second time */
+  double relay_duplication = 0;
+  /** Delay of one way through the mesh (ms) */
+  uint32_t latency = 20;
+  /** Random extra delay (ms) */
+  uint32_t jitter = 40;
+};
+
+struct SimulatorStats {
+  int commands_written = 0;
+  /** Commands with an invalid MAC, dropped by the connected node */
+  int commands_rejected = 0;
+  /** Deliveries of a command to a node that were lost */
+  int commands_lost = 0;
+  int commands_applied = 0;
+  int reports_sent = 0;
+  int reports_lost = 0;
+  int reports_duplicated = 0;
+};
+
+class MeshSimulator {
+ public:
+  MeshSimulator(const std::string &mesh_name, const std::string &mesh_password, uint64_t node_address,
+                uint32_t seed = 1);
+
+  SimulatedNode &add_node(int mesh_id, uint8_t product_id = 0x13);
+  SimulatedNode *get_node(int mesh_id);
+  void set_radio(const RadioConfig &radio) { this->radio_ = radio; }
+
+  /** Pair characteristic: 0x0c, our random key and the encrypted credentials. */
+  void write_pair(const std::string &value);
+  /** Pair characteristic: 0x0d and the random key of the node, or 0x0e when the credentials do not match. */
+  std::string read_pair() const { return this->pair_response_; }
+  /** Session key of the connected node, empty before a successful pairing. */
+  const std::string &get_session_key() const { return this->session_key_; }
+
+  /** Command characteristic, an encrypted 20-byte command packet. */
+  void write_command(const std::string &packet, uint32_t now);
+  /** Encrypted notifications the connected node sent up to now. */
+  std::vector<std::string> take_notifications(uint32_t now);
+  /** A change from outside, e.g. a wall switch or the app, reported like any other change. */
+  void change_light(int mesh_id, const SimulatedLight &light, uint32_t now);
+
+  /** Builds an encrypted notification the way the connected node does. */
+  std::string encrypt_notification(int source, uint32_t sequence, int opcode, const std::string &payload) const;
+  /** Decrypts a command packet and checks its MAC the way the connected node does. */
+  bool decrypt_command(std::string &packet) const;
+
+  const SimulatorStats &get_stats() const { return this->stats_; }
+  bool idle() const { return this->commands_.empty() && this->reports_.empty(); }
+
+ protected:
+  struct PendingCommand {
+    int mesh_id;
+    std::string packet;
+  };
+
+  bool chance_(double probability);
+  uint32_t delay_();
+  void apply_(SimulatedNode &node, const std::string &packet, uint32_t now);
+  void report_status_(SimulatedNode &node, int opcode, uint32_t now);
+  void send_(SimulatedNode &node, int opcode, const std::string &payload, uint32_t now);
+
+  std::string mesh_name_;
+  std::string mesh_password_;
+  /** Address of the connected node, least significant byte first */
+  std::string reverse_address_;
+  std::string session_key_;
+  std::string pair_response_;
+  RadioConfig radio_;
+  std::mt19937 random_;
+  std::map<int, SimulatedNode> nodes_;
+  /** Commands on their way to a node and notifications on their way to the connected node, by arrival time */
+  std::multimap<uint32_t, PendingCommand> commands_;
+  std::multimap<uint32_t, std::string> reports_;
+  SimulatorStats stats_;
+};
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,134 @@
+#include <AES.h>
+
+#include "hub_harness.h"
+#include "mesh_simulator.h"
+#include "test_helpers.h"
+
+using namespace esphome::awox_mesh;
+
+static const uint64_t NODE_ADDRESS = 0xA4C138123456;
+/** NODE_ADDRESS, least significant byte first */
+static const std::string REVERSE_ADDRESS("\x56\x34\x12\x38\xc1\xa4", 6);
+
+static void test_aes_vector() {
+  // FIPS-197 appendix C.1
+  const uint8_t key[16] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+                           0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+  const uint8_t input[16] = {0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+                             0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+  const uint8_t expected[16] = {0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+                                0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a};
+  uint8_t output[16];
+  AES128 aes128;
+  CHECK(aes128.setKey(key, 16));
+  CHECK(!aes128.setKey(key, 8));
+  aes128.encryptBlock(output, input);
+  CHECK(memcmp(output, expected, 16) == 0);
+}
+
+static void test_pairing() {
+  MeshSimulator mesh("mesh", "secret", NODE_ADDRESS);
+  HubHarness hub(mesh, "mesh", "secret", NODE_ADDRESS);
+  CHECK(hub.pair());
+  CHECK_EQUAL(16, hub.get_session_key().size());
+  CHECK(hub.get_session_key() == mesh.get_session_key());
+
+  HubHarness stranger(mesh, "mesh", "wrong", NODE_ADDRESS);
+  CHECK(!stranger.pair());
+  CHECK_EQUAL(0x0e, mesh.read_pair()[0]);
+  CHECK(mesh.get_session_key().empty());
+}
+
+static void test_command_crypto() {
+  MeshSimulator mesh("mesh", "secret", NODE_ADDRESS);
+  HubHarness hub(mesh, "mesh", "secret", NODE_ADDRESS);
+  CHECK(hub.pair());
+
+  std::string plain = build_packet(0x1234, 7, 0xd0, std::string(1, 1));
+  std::string packet = plain;
+  encrypt_packet(hub.get_session_key(), REVERSE_ADDRESS, packet);
+  CHECK(packet.substr(5) != plain.substr(5));
+
+  std::string received = packet;
+  CHECK(mesh.decrypt_command(received));
+  CHECK(received.substr(5) == plain.substr(5));
+
+  std::string tampered = packet;
+  tampered[12] ^= 0x01;
+  CHECK(!mesh.decrypt_command(tampered));
+
+  // A node with another address derives another nonce
+  MeshSimulator other("mesh", "secret", NODE_ADDRESS + 1);
+  HubHarness other_hub(other, "mesh", "secret", NODE_ADDRESS + 1);
+  CHECK(other_hub.pair());
+  received = packet;
+  CHECK(!other.decrypt_command(received));
+}
+
+static void test_notification_crypto() {
+  MeshSimulator mesh("mesh", "secret", NODE_ADDRESS);
+  HubHarness hub(mesh, "mesh", "secret", NODE_ADDRESS);
+  CHECK(hub.pair());
+
+  std::string payload = {3, 80, 20, 60, 0x10, 0x20, 0x30, 0, 0, 0};
+  hub.receive(mesh.encrypt_notification(9, 0x123456, 0xdb, payload));
+  CHECK_EQUAL(1, hub.decoded);
+  CHECK_EQUAL(0, hub.mac_failures);
+  CHECK(hub.registry[9].light.state);
+  CHECK(hub.registry[9].light.color_mode);
+  CHECK_EQUAL(80, hub.registry[9].light.white_brightness);
+  CHECK_EQUAL(0x20, hub.registry[9].light.G);
+
+  // The same packet relayed again
+  hub.receive(mesh.encrypt_notification(9, 0x123456, 0xdb, payload));
+  CHECK_EQUAL(1, hub.duplicates);
+
+  std::string tampered = mesh.encrypt_notification(9, 0x123457, 0xdb, payload);
+  tampered[15] ^= 0x80;
+  hub.receive(tampered);
+  CHECK_EQUAL(1, hub.mac_failures);
+  CHECK_EQUAL(1, hub.decoded);
+}
+
+static void test_round_trip() {
+  MeshSimulator mesh("mesh", "secret", NODE_ADDRESS);
+  mesh.add_node(1);
+  mesh.add_node(2, 0x15);
+  HubHarness hub(mesh, "mesh", "secret", NODE_ADDRESS);
+  CHECK(hub.pair());
+
+  hub.queue(0xda, std::string(1, 0x10), 0xffff, PRIORITY_BACKGROUND, 0);
+  hub.queue(0xe2, std::string("\x04\xff\x00\x80", 4), 2, PRIORITY_INTERACTIVE, 0);
+  hub.queue(0xea, std::string("\x10\x00", 2), 2, PRIORITY_BACKGROUND, 0);
+  for (uint32_t now = 0; now < 2000; now += 10) {
+    hub.loop(now);
+  }
+
+  CHECK_EQUAL(3, hub.written);
+  CHECK_EQUAL(0, hub.mac_failures);
+  CHECK_EQUAL(0, hub.unknown);
+  CHECK(hub.registry[1].online);
+  CHECK(!hub.registry[1].light.state);
+  CHECK(hub.registry[2].light.state);
+  CHECK(hub.registry[2].light.color_mode);
+  CHECK_EQUAL(0xff, hub.registry[2].light.R);
+  CHECK_EQUAL(0x80, hub.registry[2].light.B);
+  CHECK(hub.registry[2].has_mac);
+  CHECK_EQUAL(0x15, hub.registry[2].product_id);
+  CHECK(!hub.registry[1].has_mac);
+
+  // A change from the wall switch
+  mesh.change_light(1, {true, false, 40, 70, 100, 255, 255, 255}, 2000);
+  hub.loop(2500);
+  CHECK(hub.registry[1].light.state);
+  CHECK_EQUAL(40, hub.registry[1].light.white_brightness);
+}
+
+int main() {
+  test_aes_vector();
+  test_pairing();
+  test_command_crypto();
+  test_notification_crypto();
+  test_round_trip();
+  return test_result();
+}
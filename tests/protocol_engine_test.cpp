@@ -0,0 +1,189 @@
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "hub_harness.h"
+#include "mesh_simulator.h"
+#include "protocol_engine.h"
+#include "test_helpers.h"
+
+using namespace esphome::awox_mesh;
+
+static const uint64_t NODE_ADDRESS = 0xA4C138654321;
+static const std::string REVERSE_ADDRESS("\x21\x43\x65\x38\xc1\xa4", 6);
+
+static std::string status(uint8_t mode, uint8_t brightness) {
+  return {static_cast<char>(mode), static_cast<char>(brightness), 50, 100, 1, 2, 3, 0, 0, 0};
+}
+
+static void push(ProtocolEngine &engine, const std::string &notification) {
+  engine.push_notification((const uint8_t *) notification.data(), notification.size(), 0);
+}
+
+static void test_decode() {
+  MeshSimulator mesh("mesh", "secret", NODE_ADDRESS);
+  HubHarness hub(mesh, "mesh", "secret", NODE_ADDRESS);
+  CHECK(hub.pair());
+  ProtocolEngine engine;
+  DecodedNotification decoded;
+
+  // Nothing is decoded without a session
+  push(engine, mesh.encrypt_notification(4, 1, 0xdb, status(1, 80)));
+  CHECK_EQUAL(0, engine.process(16));
+  CHECK(!engine.pop(decoded));
+
+  engine.set_session(mesh.get_session_key(), REVERSE_ADDRESS);
+  push(engine, mesh.encrypt_notification(4, 1, 0xdb, status(1, 80)));
+  push(engine, mesh.encrypt_notification(4, 2, 0xdb, status(1, 80)));
+  push(engine, mesh.encrypt_notification(4, 2, 0xdb, status(1, 80)));
+  push(engine, mesh.encrypt_notification(4, 3, 0xdb, status(0, 80)));
+  push(engine, mesh.encrypt_notification(4, 4, 0xd8, std::string("\x00\x00\x13\x01\x02\x03\x04", 7)));
+  push(engine, mesh.encrypt_notification(4, 5, 0x77, ""));
+  CHECK_EQUAL(6, engine.process(16));
+
+  CHECK(engine.pop(decoded));
+  CHECK_EQUAL(REPORT_STATUS, decoded.report.type);
+  CHECK_EQUAL(4, decoded.report.mesh_id);
+  CHECK(decoded.report.state);
+  CHECK_EQUAL(80, decoded.report.white_brightness);
+  CHECK(decoded.changed);
+  // Same state again
+  CHECK(engine.pop(decoded));
+  CHECK(!decoded.changed);
+  CHECK(!decoded.duplicate);
+  // Relayed copy
+  CHECK(engine.pop(decoded));
+  CHECK(decoded.duplicate);
+  CHECK(!decoded.changed);
+  CHECK(engine.pop(decoded));
+  CHECK(!decoded.report.state);
+  CHECK(decoded.changed);
+  CHECK(engine.pop(decoded));
+  CHECK_EQUAL(REPORT_MAC, decoded.report.type);
+  CHECK_EQUAL(0x13, decoded.report.product[1]);
+  CHECK_EQUAL(0x04, decoded.report.mac[3]);
+  CHECK(engine.pop(decoded));
+  CHECK_EQUAL(REPORT_UNKNOWN, decoded.report.type);
+  CHECK(!engine.pop(decoded));
+
+  // Sequence numbers restart with a new session, the last reported state is kept
+  std::string corrupt = mesh.encrypt_notification(4, 6, 0xdb, status(0, 80));
+  corrupt[10] ^= 0x01;
+  push(engine, corrupt);
+  engine.set_session(mesh.get_session_key(), REVERSE_ADDRESS);
+  push(engine, mesh.encrypt_notification(4, 1, 0xdb, status(0, 80)));
+  CHECK_EQUAL(2, engine.process(16));
+  CHECK_EQUAL(1, engine.get_mac_failures());
+  CHECK(engine.pop(decoded));
+  CHECK(!decoded.duplicate);
+  CHECK(!decoded.changed);
+}
+
+/**
+ * The BLE callback, the protocol task and loop() each on their own thread.
+ * Every notification ends up exactly once as overflow, MAC failure, duplicate or report, the reports of a node keep
+ * their order and the changed flags of the engine match what loop() sees.
+ */
+static void test_threads() {
+  const int nodes = 200;
+  const int count = 20000;
+  MeshSimulator mesh("mesh", "secret", NODE_ADDRESS);
+  HubHarness hub(mesh, "mesh", "secret", NODE_ADDRESS);
+  CHECK(hub.pair());
+
+  std::mt19937 random(3);
+  std::vector<std::string> notifications;
+  std::map<int, uint32_t> sequences;
+  int duplicates = 0, corrupted = 0;
+  bool last_corrupted = false;
+  for (int i = 0; i < count; i++) {
+    int mesh_id = 1 + random() % nodes;
+    if (!notifications.empty() && random() % 10 == 0) {
+      notifications.push_back(notifications.back());
+      last_corrupted ? corrupted++ : duplicates++;
+      continue;
+    }
+    std::string notification = mesh.encrypt_notification(mesh_id, ++sequences[mesh_id], 0xdb,
+                                                          status(random() % 2, 10 * (random() % 3)));
+    last_corrupted = random() % 50 == 0;
+    if (last_corrupted) {
+      notification[12] ^= 0x20;
+      corrupted++;
+    }
+    notifications.push_back(notification);
+  }
+
+  ProtocolEngine engine;
+  engine.set_session(mesh.get_session_key(), REVERSE_ADDRESS);
+  std::atomic<bool> produced{false};
+  std::atomic<bool> engine_done{false};
+
+  std::thread callback([&]() {
+    // Bursts of a few notifications per connection event
+    for (size_t i = 0; i < notifications.size(); i++) {
+      push(engine, notifications[i]);
+      if (i % 4 == 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+    produced.store(true);
+  });
+  std::thread task([&]() {
+    while (true) {
+      bool finished = produced.load();
+      if (engine.process(16) == 0 && finished) {
+        // One more pass, the last pushes may have raced with the check
+        if (engine.process(16) == 0) {
+          break;
+        }
+      }
+    }
+    engine_done.store(true);
+  });
+
+  int reports = 0, seen_duplicates = 0;
+  std::map<int, MeshReport> last;
+  std::map<int, uint32_t> last_sequence;
+  DecodedNotification decoded;
+  while (true) {
+    bool finished = engine_done.load();
+    if (!engine.pop(decoded)) {
+      if (finished) {
+        break;
+      }
+      std::this_thread::yield();
+      continue;
+    }
+    if (decoded.duplicate) {
+      seen_duplicates++;
+      continue;
+    }
+    reports++;
+    int mesh_id = decoded.report.mesh_id;
+    uint32_t sequence = decoded.packet.data[0] | (decoded.packet.data[1] << 8) | (decoded.packet.data[2] << 16);
+    CHECK(sequence > last_sequence[mesh_id]);
+    last_sequence[mesh_id] = sequence;
+    auto previous = last.find(mesh_id);
+    CHECK_EQUAL(previous == last.end() || !previous->second.same_state(decoded.report), decoded.changed);
+    last[mesh_id] = decoded.report;
+  }
+  callback.join();
+  task.join();
+
+  uint32_t overflows = engine.get_overflows();
+  CHECK_EQUAL(count, reports + seen_duplicates + engine.get_mac_failures() + overflows);
+  CHECK(engine.get_mac_failures() <= (uint32_t) corrupted);
+  CHECK(seen_duplicates <= duplicates);
+  CHECK_EQUAL(0, engine.get_malformed());
+  printf("%d notifications: %d reports, %d duplicates, %u MAC failures, %u overflows\n", count, reports,
+         seen_duplicates, engine.get_mac_failures(), overflows);
+}
+
+int main() {
+  test_decode();
+  test_threads();
+  return test_result();
+}
@@ -0,0 +1,142 @@
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+#include "spsc_ring.h"
+#include "test_helpers.h"
+
+using namespace esphome::awox_mesh;
+
+/** Notification of which every byte is derived from its sequence number, so torn copies show up. */
+static void fill(uint32_t sequence, uint8_t *data) {
+  for (int i = 0; i < NOTIFICATION_SIZE; i++) {
+    data[i] = static_cast<uint8_t>(sequence * 31 + i);
+  }
+}
+
+static bool matches(uint32_t sequence, const RawNotification &notification) {
+  uint8_t expected[NOTIFICATION_SIZE];
+  fill(sequence, expected);
+  return notification.length == NOTIFICATION_SIZE && memcmp(expected, notification.data, NOTIFICATION_SIZE) == 0;
+}
+
+static void test_single_thread() {
+  SpscRing<int, 8> ring;
+  int item;
+  CHECK(!ring.pop(item));
+
+  // One slot is kept free
+  for (int i = 0; i < 7; i++) {
+    CHECK(ring.push(i));
+  }
+  CHECK(!ring.push(7));
+  CHECK_EQUAL(1, ring.get_overflows());
+
+  for (int i = 0; i < 7; i++) {
+    CHECK(ring.pop(item));
+    CHECK_EQUAL(i, item);
+  }
+  CHECK(!ring.pop(item));
+  CHECK_EQUAL(7, ring.get_high_water_mark());
+
+  // Wraps around
+  for (int i = 0; i < 20; i++) {
+    CHECK(ring.push(i));
+    CHECK(ring.pop(item));
+    CHECK_EQUAL(i, item);
+  }
+
+  ring.push(1);
+  ring.push(2);
+  ring.clear();
+  CHECK(!ring.pop(item));
+}
+
+/** A status sweep answered by more nodes than the ring holds, while loop() is busy elsewhere. */
+static void test_burst_without_consumer() {
+  NotificationRing<32> ring;
+  uint8_t data[NOTIFICATION_SIZE];
+  for (uint32_t i = 0; i < 64; i++) {
+    fill(i, data);
+    ring.push(data, NOTIFICATION_SIZE);
+  }
+  CHECK_EQUAL(33, ring.get_overflows());
+
+  RawNotification notification;
+  uint32_t popped = 0;
+  while (ring.pop(notification)) {
+    CHECK(matches(popped, notification));
+    popped++;
+  }
+  CHECK_EQUAL(31, popped);
+}
+
+/**
+ * BLE callback and loop() on their own threads: bursts of notifications with short gaps.
+ * Every notification is either delivered intact and in order, or counted as overflow.
+ */
+static void test_bursts_between_threads() {
+  static const uint32_t BURSTS = 2000;
+  static const uint32_t BURST_SIZE = 48;
+
+  NotificationRing<32> ring;
+  std::atomic<bool> done{false};
+
+  std::thread producer([&ring, &done]() {
+    uint8_t data[NOTIFICATION_SIZE];
+    uint32_t sequence = 0;
+    for (uint32_t burst = 0; burst < BURSTS; burst++) {
+      for (uint32_t i = 0; i < BURST_SIZE; i++) {
+        fill(sequence, data);
+        // The sequence number goes along in the first bytes, the rest is derived from it
+        memcpy(data, &sequence, sizeof(sequence));
+        ring.push(data, NOTIFICATION_SIZE);
+        sequence++;
+      }
+      std::this_thread::yield();
+    }
+    done.store(true);
+  });
+
+  uint32_t received = 0;
+  uint32_t corrupted = 0;
+  uint32_t out_of_order = 0;
+  int64_t last = -1;
+  RawNotification notification;
+  while (true) {
+    bool finished = done.load();
+    while (ring.pop(notification)) {
+      uint32_t sequence;
+      memcpy(&sequence, notification.data, sizeof(sequence));
+      uint8_t expected[NOTIFICATION_SIZE];
+      fill(sequence, expected);
+      if (memcmp(expected + sizeof(sequence), notification.data + sizeof(sequence),
+                 NOTIFICATION_SIZE - sizeof(sequence)) != 0) {
+        corrupted++;
+      }
+      if ((int64_t) sequence <= last) {
+        out_of_order++;
+      }
+      last = sequence;
+      received++;
+    }
+    if (finished) {
+      break;
+    }
+  }
+  producer.join();
+
+  CHECK_EQUAL(0, corrupted);
+  CHECK_EQUAL(0, out_of_order);
+  CHECK_EQUAL(BURSTS * BURST_SIZE, received + ring.get_overflows());
+  CHECK(ring.get_high_water_mark() <= 31);
+  printf("bursts: %u received, %u overflows, high water mark %u\n", received, ring.get_overflows(),
+         ring.get_high_water_mark());
+}
+
+int main() {
+  test_single_thread();
+  test_burst_without_consumer();
+  test_bursts_between_threads();
+  return test_result();
+}
@@ -0,0 +1,68 @@
+#include "status_poller.h"
+#include "test_helpers.h"
+
+using namespace esphome::awox_mesh;
+
+static void test_pacing() {
+  StatusPoller poller;
+  CHECK(!poller.is_due(0, 10));
+  poller.set_period(10000);
+  poller.set_in_flight_limit(2);
+
+  // 10 devices in 10 s: one request a second, counted from the queueing
+  CHECK(poller.is_due(1000, 10));
+  poller.queued(1, 1000);
+  CHECK(poller.is_pending(1));
+  CHECK(!poller.is_in_flight(1));
+  CHECK(!poller.is_due(1500, 10));
+  CHECK(poller.is_due(2000, 10));
+  poller.queued(2, 2000);
+  // The limit counts queued requests too
+  CHECK(!poller.is_due(5000, 10));
+
+  // A request dropped by the queue frees its place without counting as sent or unanswered
+  poller.dropped(2);
+  CHECK(!poller.is_pending(2));
+  CHECK(poller.is_due(5000, 10));
+  CHECK_EQUAL(0, poller.get_sent());
+  CHECK_EQUAL(0, poller.get_unanswered());
+}
+
+static void test_reply_timeout() {
+  StatusPoller poller;
+  poller.set_period(10000);
+  poller.set_in_flight_limit(1);
+
+  // Queued behind interactive commands for longer than the reply timeout, then written
+  poller.queued(1, 1000);
+  CHECK(!poller.is_due(6000, 1));
+  poller.sent(1, 6000);
+  CHECK(poller.is_in_flight(1));
+  CHECK_EQUAL(1, poller.get_sent());
+  // The reply timeout runs from the write
+  CHECK(!poller.is_due(8000, 1));
+  CHECK(poller.is_in_flight(1));
+  poller.answered(1);
+  CHECK(!poller.is_pending(1));
+  CHECK(poller.is_due(11000, 1));
+  CHECK_EQUAL(0, poller.get_unanswered());
+
+  poller.queued(2, 11000);
+  poller.sent(2, 11000);
+  CHECK(poller.is_due(21000, 1));
+  CHECK_EQUAL(1, poller.get_unanswered());
+  CHECK(!poller.is_pending(2));
+
+  // A lost connection drops the written requests, a queued one is written after the reconnect
+  poller.queued(3, 22000);
+  poller.clear();
+  CHECK(poller.is_pending(3));
+  poller.sent(3, 23000);
+  CHECK(poller.is_in_flight(3));
+}
+
+int main() {
+  test_pacing();
+  test_reply_timeout();
+  return test_result();
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdio>
+
+/*
+ * Minimal checks for the host tests, a failed check is reported and the test continues.
+ * main() returns test_result() so ctest sees the failures.
+ */
+
+static int test_failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      test_failures++; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+  do { \
+    long long _expected = (long long) (expected); \
+    long long _actual = (long long) (actual); \
+    if (_expected != _actual) { \
+      fprintf(stderr, "%s:%d: %s: expected %lld, got %lld\n", __FILE__, __LINE__, #actual, _expected, _actual); \
+      test_failures++; \
+    } \
+  } while (0)
+
+static int test_result() {
+  if (test_failures > 0) {
+    fprintf(stderr, "%d checks failed\n", test_failures);
+    return 1;
+  }
+  return 0;
+}
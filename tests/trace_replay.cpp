@@ -0,0 +1,74 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "trace_replay.h"
+
+using namespace esphome::awox_mesh;
+
+/*
+ * Decodes a packet trace dump and replays it through the report decoding of the component.
+ *   mosquitto_sub -t '<prefix>/mesh/trace' -C 1 > trace.bin
+ *   trace_replay trace.bin [--quiet] [--benchmark <rounds>]
+ */
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <dump> [--quiet] [--benchmark <rounds>]\n", argv[0]);
+    return 2;
+  }
+  bool quiet = false;
+  int rounds = 0;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--quiet") == 0) {
+      quiet = true;
+    } else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc) {
+      rounds = atoi(argv[++i]);
+    }
+  }
+
+  std::ifstream file(argv[1], std::ios::binary);
+  if (!file) {
+    fprintf(stderr, "can not open %s\n", argv[1]);
+    return 1;
+  }
+  std::string dump((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+  std::vector<TraceRecord> records = decode_trace(dump);
+  if (dump.size() % sizeof(TraceRecord) != 0) {
+    fprintf(stderr, "%zu trailing bytes ignored\n", dump.size() % sizeof(TraceRecord));
+  }
+
+  if (!quiet) {
+    for (auto &record : records) {
+      printf("%s\n", format_record(record).c_str());
+    }
+  }
+
+  ReplaySummary summary = replay_trace(records);
+  printf("%zu packets in %u ms: %d sent, %d received, %d duplicates, %d unknown, %d state changes\n", records.size(),
+         summary.last_time - summary.first_time, summary.sent, summary.received, summary.duplicates, summary.unknown,
+         summary.changes);
+  for (auto &opcode : summary.opcodes) {
+    printf("  opcode %02X: %d\n", opcode.first, opcode.second);
+  }
+  for (auto &state : summary.states) {
+    const MeshReport &report = state.second;
+    printf("  [%d] %s %s w_b %d temp %d c_b %d rgb %02X%02X%02X\n", state.first, report.state ? "ON" : "OFF",
+           report.online ? "online" : "offline", report.white_brightness, report.temperature, report.color_brightness,
+           report.R, report.G, report.B);
+  }
+
+  if (rounds > 0 && summary.received > 0) {
+    auto started = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+      replay_trace(records);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - started;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count() / rounds / summary.received;
+    printf("replay: %.0f ns per received packet over %d rounds\n", ns, rounds);
+  }
+  return 0;
+}
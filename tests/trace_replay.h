@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mesh_protocol.h"
+#include "packet_trace.h"
+#include "relay_filter.h"
+
+namespace esphome {
+namespace awox_mesh {
+
+/*
+ * Decoding and replay of a packet trace dump (<prefix>/mesh/trace), shared by the trace_replay tool and its test.
+ */
+
+struct ReplaySummary {
+  int received = 0;
+  int sent = 0;
+  /** Received packets the relay filter drops */
+  int duplicates = 0;
+  int unknown = 0;
+  /** Status reports that changed the state of their node */
+  int changes = 0;
+  uint32_t first_time = 0;
+  uint32_t last_time = 0;
+  /** Received packets per opcode */
+  std::map<int, int> opcodes;
+  /** Last status report per node */
+  std::map<int, MeshReport> states;
+};
+
+/** Splits a dump in its records, an incomplete record at the end is ignored. */
+inline std::vector<TraceRecord> decode_trace(const std::string &dump) {
+  std::vector<TraceRecord> records(dump.size() / sizeof(TraceRecord));
+  if (!records.empty()) {
+    memcpy(records.data(), dump.data(), records.size() * sizeof(TraceRecord));
+  }
+  return records;
+}
+
+/** One line per record: time, direction, opcode, mesh ID and the packet in hex. */
+inline std::string format_record(const TraceRecord &record) {
+  char line[128];
+  int length = snprintf(line, sizeof(line), "%10u %s %02X %5u ", (unsigned) record.time,
+                        record.direction == TRACE_RX ? "rx" : "tx", record.opcode, record.mesh_id);
+  for (int i = 0; i < 20 && length + 3 < (int) sizeof(line); i++) {
+    length += snprintf(line + length, sizeof(line) - length, "%02X", record.packet[i]);
+  }
+  return std::string(line, length);
+}
+
+/** Runs the received packets through the relay filter and the report decoding of the component. */
+inline ReplaySummary replay_trace(const std::vector<TraceRecord> &records) {
+  ReplaySummary summary;
+  RelayFilter relay_filter;
+  if (!records.empty()) {
+    summary.first_time = records.front().time;
+    summary.last_time = records.back().time;
+  }
+
+  for (auto &record : records) {
+    if (record.direction != TRACE_RX) {
+      summary.sent++;
+      continue;
+    }
+    summary.received++;
+    std::string packet((const char *) record.packet, sizeof(record.packet));
+    uint32_t sequence = record.packet[0] | (record.packet[1] << 8) | (record.packet[2] << 16);
+    if (relay_filter.is_duplicate(record.mesh_id, sequence)) {
+      summary.duplicates++;
+      continue;
+    }
+    summary.opcodes[record.opcode]++;
+
+    MeshReport report;
+    parse_report(packet, report);
+    if (report.type == REPORT_UNKNOWN) {
+      summary.unknown++;
+    } else if (report.type == REPORT_STATUS) {
+      auto previous = summary.states.find(report.mesh_id);
+      if (previous == summary.states.end() || !previous->second.same_state(report)) {
+        summary.changes++;
+      }
+      summary.states[report.mesh_id] = report;
+    }
+  }
+  return summary;
+}
+
+}  // namespace awox_mesh
+}  // namespace esphome
@@ -0,0 +1,80 @@
+#include "mesh_protocol.h"
+#include "packet_trace.h"
+#include "test_helpers.h"
+#include "trace_replay.h"
+
+using namespace esphome::awox_mesh;
+
+/** A decrypted notification as the packet trace records it. */
+static std::string notification(uint32_t sequence, int source, int opcode, const std::string &payload) {
+  std::string packet(20, 0);
+  packet[0] = sequence & 0xff;
+  packet[1] = (sequence >> 8) & 0xff;
+  packet[2] = (sequence >> 16) & 0xff;
+  packet[3] = source & 0xff;
+  packet[4] = (source >> 8) & 0xff;
+  packet[7] = opcode;
+  packet.replace(10, payload.size(), payload);
+  return packet;
+}
+
+static std::string status(uint8_t mode, uint8_t brightness) {
+  return {static_cast<char>(mode), static_cast<char>(brightness), 50, 100, 1, 2, 3};
+}
+
+static void test_replay() {
+  PacketTrace trace;
+  trace.set_size(8);
+  trace.record(TRACE_TX, build_packet(1, 3, 0xd0, std::string(1, 1)), 1000);
+  trace.record(TRACE_RX, notification(10, 3, 0xdb, status(1, 80)), 1040);
+  // Relayed copy
+  trace.record(TRACE_RX, notification(10, 3, 0xdb, status(1, 80)), 1045);
+  trace.record(TRACE_RX, notification(11, 3, 0xdb, status(1, 80)), 1300);
+  trace.record(TRACE_RX, notification(12, 3, 0xdb, status(0, 80)), 1500);
+  trace.record(TRACE_RX, notification(1, 4, 0x77, ""), 1600);
+
+  std::string dump = trace.dump();
+  CHECK_EQUAL(6 * 28, dump.size());
+  // A cut off record at the end is ignored
+  std::vector<TraceRecord> records = decode_trace(dump + std::string(5, 0));
+  CHECK_EQUAL(6, records.size());
+  CHECK_EQUAL(1000, records[0].time);
+  CHECK_EQUAL(TRACE_TX, records[0].direction);
+  CHECK_EQUAL(3, records[0].mesh_id);
+  CHECK_EQUAL(0xd0, records[0].opcode);
+  CHECK(format_record(records[1]) == "      1040 rx DB     3 0A000003000000DB000001503264010203000000");
+
+  ReplaySummary summary = replay_trace(records);
+  CHECK_EQUAL(1, summary.sent);
+  CHECK_EQUAL(5, summary.received);
+  CHECK_EQUAL(1, summary.duplicates);
+  CHECK_EQUAL(1, summary.unknown);
+  CHECK_EQUAL(2, summary.changes);
+  CHECK_EQUAL(3, summary.opcodes[0xdb]);
+  CHECK_EQUAL(600, summary.last_time - summary.first_time);
+  CHECK(!summary.states[3].state);
+  CHECK_EQUAL(80, summary.states[3].white_brightness);
+}
+
+static void test_wrapped_trace() {
+  PacketTrace trace;
+  trace.set_size(4);
+  for (uint32_t i = 0; i < 10; i++) {
+    trace.record(TRACE_RX, notification(i, 5, 0xdb, status(i % 2, 10)), i * 100);
+  }
+  std::vector<TraceRecord> records = decode_trace(trace.dump());
+  CHECK_EQUAL(4, records.size());
+  CHECK_EQUAL(600, records.front().time);
+  CHECK_EQUAL(900, records.back().time);
+  CHECK_EQUAL(4, replay_trace(records).changes);
+
+  trace.clear();
+  CHECK(trace.dump().empty());
+  CHECK_EQUAL(0, replay_trace(decode_trace(trace.dump())).received);
+}
+
+int main() {
+  test_replay();
+  test_wrapped_trace();
+  return test_result();
+}